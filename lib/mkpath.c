@@ -0,0 +1,185 @@
+/*
+ *  mkpath.c  --  Make directories including parents
+ */
+
+
+#include "mkpath.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static size_t pathset_hash( const char *);
+
+
+/*
+ *  Create a directory and its missing parents.  The leaf is tried first;
+ *  parents are only looked at when that fails with ENOENT.  An already
+ *  existing directory counts as success, even if another process just
+ *  created it.
+ *
+ *  This doesn't call Ruby and may be run without the GVL.  The path
+ *  buffer is modified temporarily.  If it fails, -1 is returned, errno
+ *  is set and the buffer is cut down to the directory that could not be
+ *  created.  Otherwise the result is 1 if the directory was created and
+ *  0 if it existed.
+ *
+ *  If +exact+ is set, every directory made is given +mode+ regardless
+ *  of the umask.
+ *
+ *  If +known+ is given, directories found or made are remembered there
+ *  and not looked at again.
+ */
+
+int
+supplement_mkpath( char *path, mode_t mode, int exact,
+                   struct supplement_pathset *known)
+{
+    struct stat st;
+    char *p, *e;
+    int tried = 0;
+
+    if (known != NULL && supplement_pathset_has( known, path))
+        return 0;
+
+    for (;;) {
+        if (mkdir( path, mode) == 0)
+            break;
+        switch (errno) {
+        case EEXIST:
+            if (stat( path, &st) == 0 && S_ISDIR( st.st_mode)) {
+                if (known != NULL)
+                    supplement_pathset_add( known, path);
+                return 0;
+            }
+            errno = EEXIST;
+            return -1;
+        case ENOENT:
+            if (tried++)
+                return -1;
+            for (e = path + strlen( path); e > path && e[ -1] == '/'; --e)
+                ;
+            for (p = e; p > path && p[ -1] != '/'; --p)
+                ;
+            for (; p > path && p[ -1] == '/'; --p)
+                ;
+            if (p == path)
+                return -1;
+            *p = '\0';
+            if (supplement_mkpath( path, mode, exact, known) < 0)
+                return -1;
+            *p = '/';
+            continue;
+        default:
+            return -1;
+        }
+    }
+    if (exact) {
+        int fd, r;
+
+        /* Not by name: somebody could have replaced it meanwhile. */
+        fd = open( path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        r = fchmod( fd, mode);
+        if (r < 0) {
+            int e = errno;
+            close( fd);
+            errno = e;
+            return -1;
+        }
+        close( fd);
+    }
+    if (known != NULL)
+        supplement_pathset_add( known, path);
+    return 1;
+}
+
+
+/*
+ *  A small set of path names.  Plain malloc() is used, so it may be
+ *  filled without the GVL.  Adding returns -1 with errno set when memory
+ *  runs out; the set is then left unchanged.
+ */
+
+size_t
+pathset_hash( const char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+    return (size_t) h;
+}
+
+int
+supplement_pathset_has( struct supplement_pathset *set, const char *path)
+{
+    size_t i;
+
+    if (set->slot == NULL)
+        return 0;
+    for (i = pathset_hash( path) & set->mask; set->slot[ i]; i = (i + 1) & set->mask)
+        if (strcmp( set->slot[ i], path) == 0)
+            return 1;
+    return 0;
+}
+
+int
+supplement_pathset_add( struct supplement_pathset *set, const char *path)
+{
+    char *d;
+    size_t i;
+
+    if (2 * (set->count + 1) > set->mask) {
+        struct supplement_pathset n;
+        char **s;
+        size_t j;
+
+        n.mask = set->mask ? 2 * set->mask + 1 : 255;
+        n.slot = calloc( n.mask + 1, sizeof (char *));
+        if (n.slot == NULL)
+            return -1;
+        for (j = 0; set->slot != NULL && j <= set->mask; j++) {
+            s = set->slot + j;
+            if (*s == NULL)
+                continue;
+            for (i = pathset_hash( *s) & n.mask; n.slot[ i]; i = (i + 1) & n.mask)
+                ;
+            n.slot[ i] = *s;
+        }
+        free( set->slot);
+        set->slot = n.slot;
+        set->mask = n.mask;
+    }
+    for (i = pathset_hash( path) & set->mask; set->slot[ i]; i = (i + 1) & set->mask)
+        if (strcmp( set->slot[ i], path) == 0)
+            return 0;
+    d = strdup( path);
+    if (d == NULL)
+        return -1;
+    set->slot[ i] = d;
+    set->count++;
+    return 0;
+}
+
+void
+supplement_pathset_free( struct supplement_pathset *set)
+{
+    size_t i;
+
+    if (set->slot != NULL) {
+        for (i = 0; i <= set->mask; i++)
+            free( set->slot[ i]);
+        free( set->slot);
+    }
+    set->slot = NULL;
+    set->mask = set->count = 0;
+}
+
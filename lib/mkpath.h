@@ -0,0 +1,26 @@
+/*
+ *  mkpath.h  --  Make directories including parents
+ */
+
+
+#ifndef __MKPATH_H__
+#define __MKPATH_H__
+
+#include <sys/types.h>
+
+
+struct supplement_pathset {
+    char   **slot;
+    size_t   mask;
+    size_t   count;
+};
+
+extern int  supplement_mkpath( char *, mode_t, int,
+                               struct supplement_pathset *);
+
+extern int  supplement_pathset_has( struct supplement_pathset *, const char *);
+extern int  supplement_pathset_add( struct supplement_pathset *, const char *);
+extern void supplement_pathset_free( struct supplement_pathset *);
+
+#endif
+
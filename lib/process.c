@@ -6,6 +6,7 @@
 #include "process.h"
 
 #include <ruby/ruby.h>
+#include <ruby/thread.h>
 
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -15,6 +16,7 @@
 
 static VALUE rb_process_renice( int argc, VALUE *argv, VALUE obj);
 static VALUE rb_process_sync( VALUE obj);
+static void *process_sync_nogvl( void *);
 static VALUE rb_process_alarm( int argc, VALUE *argv, VALUE obj);
 
 
@@ -49,15 +51,23 @@ rb_process_renice( int argc, VALUE *argv, VALUE obj)
  *     Process.sync -> nil
  *
  * Force completion of pending disk writes (flush cache). See sync(8).
+ * Other Ruby threads keep running meanwhile.
  */
 
 VALUE
 rb_process_sync( VALUE obj)
 {
-    sync();
+    rb_thread_call_without_gvl( &process_sync_nogvl, NULL, NULL, NULL);
     return Qnil;
 }
 
+void *
+process_sync_nogvl( void *p)
+{
+    sync();
+    return NULL;
+}
+
 
 /*
  *  call-seq:
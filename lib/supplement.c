@@ -5,11 +5,44 @@
 #include "supplement.h"
 
 #include "process.h"
+#include "mkpath.h"
 
 #include <ruby/st.h>
 #include <ruby/io.h>
 #include <ruby/re.h>
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifndef RENAME_NOREPLACE
+    #define RENAME_NOREPLACE  (1 << 0)
+    #define RENAME_EXCHANGE   (1 << 1)
+#endif
+
 
+struct supplement_create {
+    const char  *path;
+    mode_t       mode;
+    int          exact;
+    int          fd;
+    int          err;
+};
+
+struct supplement_at {
+    int          op;
+    int          fd, fd2;
+    const char  *name, *name2;
+    int          flags;
+    mode_t       mode;
+    struct stat  st;
+    int          res;
+};
 
 static long  supplement_args_len_default( int, VALUE *);
 static void  supplement_ary_assure_notempty( VALUE);
@@ -18,6 +51,18 @@ static VALUE supplement_index_ref( VALUE, VALUE);
 static VALUE supplement_rindex_blk( VALUE);
 static VALUE supplement_rindex_ref( VALUE, VALUE);
 static VALUE supplement_do_unumask( VALUE);
+static void *supplement_create_nogvl( void *);
+static OnigPosition supplement_scan_search( regex_t *, VALUE,
+                                            struct re_registers *, void *);
+static VALUE supplement_scan_offsets( VALUE);
+static VALUE supplement_scan_done( VALUE);
+static VALUE supplement_mkdirs( VALUE, VALUE, VALUE, int);
+static void *supplement_mkdirs_nogvl( void *);
+static void  supplement_mkdirs_ubf( void *);
+static int   supplement_dir_fd( VALUE);
+static VALUE supplement_child_path( VALUE, VALUE);
+static void  supplement_at( struct supplement_at *, VALUE, VALUE);
+static void *supplement_at_nogvl( void *);
 
 
 static const char *supplement_ellipse = "...";
@@ -25,8 +70,13 @@ static const char *supplement_ellipse = "...";
 static ID id_delete_at = 0;
 static ID id_cmp = 0;
 static ID id_eqq = 0;
-static ID id_mkdir = 0;
 static ID id_index = 0;
+static ID id_fileno = 0;
+static ID id_path = 0;
+static ID id_noreplace = 0;
+static ID id_exchange = 0;
+static ID id_mode = 0;
+static ID id_exact_mode = 0;
 
 
 
@@ -552,6 +602,109 @@ rb_str_ends_with_p( int argc, VALUE *argv, VALUE str)
 }
 
 
+/*
+ *  call-seq:
+ *     scan_offsets( pattern) { |beg, end, ...| ... }   -> str
+ *     scan_offsets( pattern)                           -> enum
+ *
+ *  Like <code>String#scan</code> but yields only the byte offsets of
+ *  each match and its groups, as <code>MatchData#offsets_all</code>
+ *  would return them.  Neither MatchData objects nor substrings will be
+ *  created.
+ *
+ *     "a1 b22".scan_offsets /(\w)(\d+)/ do |*o| p o end
+ *     # [0, 2, 0, 1, 1, 2]
+ *     # [3, 6, 3, 4, 4, 6]
+ */
+
+struct supplement_scan {
+    VALUE str;
+    VALUE re;
+    long  pos;
+    struct re_registers regs;
+};
+
+VALUE
+rb_str_scan_offsets( VALUE str, VALUE pat)
+{
+    struct supplement_scan sc;
+
+    RETURN_ENUMERATOR( str, 1, &pat);
+    if (!RB_TYPE_P( pat, T_REGEXP))
+        pat = rb_reg_regcomp( rb_reg_quote( StringValue( pat)));
+    sc.str = str;
+    sc.re  = pat;
+    sc.pos = 0;
+    MEMZERO( &sc.regs, struct re_registers, 1);
+    rb_ensure( supplement_scan_offsets, (VALUE) &sc,
+               supplement_scan_done, (VALUE) &sc);
+    return str;
+}
+
+OnigPosition
+supplement_scan_search( regex_t *reg, VALUE str, struct re_registers *regs,
+                        void *args)
+{
+    const UChar *s, *e;
+
+    s = (const UChar *) RSTRING_PTR( str);
+    e = s + RSTRING_LEN( str);
+    return onig_search( reg, s, e, s + *(long *) args, e, regs,
+                        ONIG_OPTION_NONE);
+}
+
+VALUE
+supplement_scan_offsets( VALUE v)
+{
+    struct supplement_scan *sc = (struct supplement_scan *) v;
+    VALUE buf[ 16];
+    VALUE *vals, tmp = 0;
+    int i, n;
+
+    while (sc->pos <= RSTRING_LEN( sc->str)) {
+        const char *p;
+        long len, b, e;
+
+        if (rb_reg_onig_match( sc->re, sc->str, supplement_scan_search,
+                               &sc->pos, &sc->regs) < 0)
+            break;
+        n = 2 * sc->regs.num_regs;
+        vals = n <= 16 ? buf : ALLOCV_N( VALUE, tmp, n);
+        for (i = 0; i < sc->regs.num_regs; i++) {
+            if (sc->regs.beg[ i] < 0)
+                vals[ 2*i] = vals[ 2*i+1] = Qnil;
+            else {
+                vals[ 2*i]   = LONG2NUM( sc->regs.beg[ i]);
+                vals[ 2*i+1] = LONG2NUM( sc->regs.end[ i]);
+            }
+        }
+        b = sc->regs.beg[ 0], e = sc->regs.end[ 0];
+        p = RSTRING_PTR( sc->str), len = RSTRING_LEN( sc->str);
+        rb_yield_values2( n, vals);
+        if (tmp)
+            ALLOCV_END( tmp), tmp = 0;
+        if (p != RSTRING_PTR( sc->str) || len != RSTRING_LEN( sc->str))
+            rb_raise( rb_eRuntimeError, "string modified");
+        if (e > b)
+            sc->pos = e;
+        else if (e < len)
+            sc->pos = e + rb_enc_fast_mbclen( p + e, p + len, rb_enc_get( sc->str));
+        else
+            break;
+    }
+    return Qnil;
+}
+
+VALUE
+supplement_scan_done( VALUE v)
+{
+    struct supplement_scan *sc = (struct supplement_scan *) v;
+
+    onig_region_free( &sc->regs, 0);
+    return Qnil;
+}
+
+
 /*
  *  call-seq:
  *     starts_with?( oth)   -> nil or int
@@ -994,6 +1147,87 @@ supplement_do_unumask( VALUE v)
     return Qnil;
 }
 
+/*
+ *  call-seq:
+ *     File.create( path, mode: nil, exact_mode: true)               -> file
+ *     File.create( path, mode: nil, exact_mode: true) { |f| ... }   -> obj
+ *
+ *  Create a new file and open it for writing.  It is an error if +path+
+ *  already exists.
+ *
+ *  With +exact_mode+, the file gets exactly the permissions +mode+,
+ *  regardless of the umask.  The umask is not touched, so other threads
+ *  creating files at the same time are not affected and there is no
+ *  need to serialize them.  Without a +mode+ that is 0644.  If
+ *  +exact_mode+ is false, +mode+ defaults to 0666 and the umask applies
+ *  as usual.
+ *
+ *  With a block, the file is closed afterwards.
+ *
+ *     File.umask                                  #=> 18
+ *     File.create "shared.log", mode: 0664 do |f| ... end
+ *     File.stat( "shared.log").mode & 0777        #=> 436
+ */
+
+VALUE
+rb_file_s_create( int argc, VALUE *argv, VALUE file)
+{
+    VALUE path, opts, v, f;
+    struct supplement_create c;
+
+    rb_scan_args( argc, argv, "1:", &path, &opts);
+    FilePathValue( path);
+    c.path = StringValueCStr( path);
+    c.exact = 1;
+    v = Qnil;
+    if (!NIL_P( opts)) {
+        VALUE e;
+
+        v = rb_hash_aref( opts, ID2SYM( id_mode));
+        e = rb_hash_lookup2( opts, ID2SYM( id_exact_mode), Qundef);
+        if (e != Qundef)
+            c.exact = RTEST( e);
+    }
+    c.mode = !NIL_P( v) ? NUM2UINT( v) : c.exact ? 0644 : 0666;
+    do {
+        rb_thread_call_without_gvl( &supplement_create_nogvl, &c,
+                                    RUBY_UBF_IO, NULL);
+        if (c.err == EINTR)
+            rb_thread_check_ints();
+    } while (c.err == EINTR);
+    if (c.err)
+        rb_syserr_fail_str( c.err, path);
+    f = rb_io_fdopen( c.fd, O_WRONLY, c.path);
+    RB_GC_GUARD( path);
+    if (rb_block_given_p())
+        return rb_ensure( rb_yield, f, rb_io_close, f);
+    return f;
+}
+
+/*
+ *  The umask can only take permissions away, so the file is never
+ *  accessible to more than +mode+ allows while it is being fixed up.
+ */
+
+void *
+supplement_create_nogvl( void *p)
+{
+    struct supplement_create *c = p;
+
+    c->err = 0;
+    c->fd = open( c->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, c->mode);
+    if (c->fd < 0) {
+        c->err = errno;
+        return NULL;
+    }
+    if (c->exact && fchmod( c->fd, c->mode) < 0) {
+        c->err = errno;
+        unlink( c->path);
+        close( c->fd);
+    }
+    return NULL;
+}
+
 
 /*
  *  Document-class: Dir
@@ -1017,39 +1251,410 @@ rb_dir_s_current( VALUE dir)
 
 /*
  *  call-seq:
- *     Dir.mkdir!( path, modes = nil)   -> str or nil
+ *     Dir.mkdir!( path, modes = nil, exact_mode: false)   -> str or nil
  *
  *  Make a directory and all subdirectories if needed.
  *
  *  If you specifiy modes, be sure that you have the permission to create
- *  subdirectories.
+ *  subdirectories.  With +exact_mode+, every directory created gets
+ *  exactly +modes+, regardless of the umask; 0755 if none are given.
+ *  The umask itself is not changed.
  *
  *  Returns the path demanded if the directory was created and +nil+ if
  *  it existed before.
  *
+ *  The directory itself is tried first; its parents are only examined
+ *  if that fails.  A directory that was created by somebody else in the
+ *  meantime is no error.  Other Ruby threads may run during the system
+ *  calls.
+ *
  */
 
 VALUE
 rb_dir_s_mkdir_bang( int argc, VALUE *argv, VALUE dir)
 {
-    VALUE path, modes;
+    VALUE path, modes, opts;
+
+    rb_scan_args( argc, argv, "11:", &path, &modes, &opts);
+    return supplement_mkdirs( rb_ary_new3( 1, path), modes, opts, 1);
+}
+
+/*
+ *  call-seq:
+ *     Dir.mkdir_all( paths, modes = nil, exact_mode: false)   -> ary
+ *
+ *  Do a <code>Dir.mkdir!</code> for every path in +paths+.  Directories
+ *  already seen during the call will not be looked at again, so
+ *  siblings deep in a common tree are cheap.
+ *
+ *  Returns the paths that were created.
+ *
+ *     Dir.mkdir_all %w(a/b/c a/b/d a/e)   #=> ["a/b/c", "a/b/d", "a/e"]
+ *
+ */
+
+VALUE
+rb_dir_s_mkdir_all( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE paths, modes, opts;
+
+    rb_scan_args( argc, argv, "11:", &paths, &modes, &opts);
+    return supplement_mkdirs( rb_Array( paths), modes, opts, 0);
+}
+
+struct supplement_mkdirs {
+    char   *buf;
+    long   *offs;
+    char   *created;
+    long    n;
+    long    i;
+    mode_t  mode;
+    int     exact;
+    int     err;
+    volatile int stop;
+};
+
+VALUE
+supplement_mkdirs( VALUE paths, VALUE modes, VALUE opts, int single)
+{
+    struct supplement_mkdirs m;
+    VALUE buf, r;
+    VALUE tmp1 = 0, tmp2 = 0;
+    long i;
+
+    paths = rb_ary_dup( paths);
+    m.n = RARRAY_LEN( paths);
+    m.offs = ALLOCV_N( long, tmp1, m.n + 1);
+    m.created = ALLOCV_N( char, tmp2, m.n + 1);
+    buf = rb_str_buf_new( 0);
+    for (i = 0; i < m.n; i++) {
+        VALUE p = RARRAY_AREF( paths, i);
+
+        FilePathValue( p);
+        RARRAY_ASET( paths, i, p);
+        m.offs[ i] = RSTRING_LEN( buf);
+        m.created[ i] = 0;
+        rb_str_buf_cat( buf, RSTRING_PTR( p), RSTRING_LEN( p) + 1);
+    }
+    m.buf = RSTRING_PTR( buf);
+    m.exact = !NIL_P( opts) &&
+                RTEST( rb_hash_aref( opts, ID2SYM( id_exact_mode)));
+    m.mode = !NIL_P( modes) ? NUM2UINT( modes) : m.exact ? 0755 : 0777;
+    m.err = 0;
+    for (m.i = 0; m.i < m.n && !m.err;) {
+        m.stop = 0;
+        rb_thread_call_without_gvl( &supplement_mkdirs_nogvl, &m,
+                                    &supplement_mkdirs_ubf, &m);
+        if (m.stop)
+            rb_thread_check_ints();
+    }
+    if (m.err)
+        rb_syserr_fail_str( m.err, rb_str_new_cstr( m.buf + m.offs[ m.i]));
+
+    r = Qnil;
+    if (single) {
+        if (m.created[ 0])
+            r = RARRAY_AREF( paths, 0);
+    } else {
+        r = rb_ary_new();
+        for (i = 0; i < m.n; i++)
+            if (m.created[ i])
+                rb_ary_push( r, RARRAY_AREF( paths, i));
+    }
+    ALLOCV_END( tmp1);
+    ALLOCV_END( tmp2);
+    RB_GC_GUARD( buf);
+    return r;
+}
+
+void *
+supplement_mkdirs_nogvl( void *p)
+{
+    struct supplement_mkdirs *m = p;
+    struct supplement_pathset known = { NULL, 0, 0};
+    int r;
+
+    for (; m->i < m->n && !m->stop; m->i++) {
+        r = supplement_mkpath( m->buf + m->offs[ m->i], m->mode, m->exact,
+                               m->n > 1 ? &known : NULL);
+        if (r < 0) {
+            m->err = errno;
+            break;
+        }
+        m->created[ m->i] = r;
+    }
+    supplement_pathset_free( &known);
+    return NULL;
+}
+
+void
+supplement_mkdirs_ubf( void *p)
+{
+    ((struct supplement_mkdirs *) p)->stop = 1;
+}
+
+
+/*
+ *  Operations relative to an open directory.  The names are looked up
+ *  from the directory's descriptor, so the directory may be renamed
+ *  meanwhile and the path leading to it isn't resolved again.
+ */
+
+enum {
+    SUPPLEMENT_AT_OPEN,
+    SUPPLEMENT_AT_STAT,
+    SUPPLEMENT_AT_UNLINK,
+    SUPPLEMENT_AT_MKDIR,
+    SUPPLEMENT_AT_RENAME
+};
+
+int
+supplement_dir_fd( VALUE dir)
+{
+    return NUM2INT( rb_funcall( dir, id_fileno, 0));
+}
+
+/*
+ *  A directory made by Dir.for_fd has no path; name it by its
+ *  descriptor then.
+ */
+
+VALUE
+supplement_child_path( VALUE dir, VALUE name)
+{
+    VALUE r;
+
+    r = rb_funcall( dir, id_path, 0);
+    if (NIL_P( r))
+        return rb_sprintf( "fd:%d/%" PRIsVALUE, supplement_dir_fd( dir), name);
+    r = rb_str_dup( r);
+    rb_str_cat( r, "/", 1);
+    rb_str_append( r, name);
+    return r;
+}
+
+void
+supplement_at( struct supplement_at *a, VALUE dir, VALUE name)
+{
+    do {
+        rb_thread_call_without_gvl( &supplement_at_nogvl, a, RUBY_UBF_IO, NULL);
+        if (a->res >= 0)
+            return;
+        if (a->res == -EINTR)
+            rb_thread_check_ints();
+    } while (a->res == -EINTR);
+    rb_syserr_fail_str( -a->res, supplement_child_path( dir, name));
+}
 
-    rb_scan_args( argc, argv, "11", &path, &modes);
-    if (!rb_file_directory_p( rb_cFile, path)) {
-        VALUE parent[2];
+void *
+supplement_at_nogvl( void *p)
+{
+    struct supplement_at *a = p;
+    int r = 0;
 
-        parent[ 0] = rb_file_dirname( path);
-        parent[ 1] = modes;
-        rb_dir_s_mkdir_bang( 2, parent, dir);
-        if (!id_mkdir)
-            id_mkdir = rb_intern( "mkdir");
-        if (NIL_P(modes))
-            rb_funcall( rb_cDir, id_mkdir, 1, path);
+    switch (a->op) {
+      case SUPPLEMENT_AT_OPEN:
+        r = openat( a->fd, a->name, a->flags, a->mode);
+        break;
+      case SUPPLEMENT_AT_STAT:
+        r = fstatat( a->fd, a->name, &a->st, a->flags);
+        break;
+      case SUPPLEMENT_AT_UNLINK:
+        r = unlinkat( a->fd, a->name, a->flags);
+        break;
+      case SUPPLEMENT_AT_MKDIR:
+        r = mkdirat( a->fd, a->name, a->mode);
+        break;
+      case SUPPLEMENT_AT_RENAME:
+        if (a->flags)
+            r = (int) syscall( SYS_renameat2, a->fd, a->name,
+                                              a->fd2, a->name2, a->flags);
         else
-            rb_funcall( rb_cDir, id_mkdir, 2, path, modes);
-        return path;
+            r = renameat( a->fd, a->name, a->fd2, a->name2);
+        break;
     }
-    return Qnil;
+    a->res = r < 0 ? -errno : r;
+    return NULL;
+}
+
+/*
+ *  call-seq:
+ *     dir.open_child( name, mode = "r", perm = 0666)               -> file
+ *     dir.open_child( name, mode = "r", perm = 0666) { |f| ... }   -> obj
+ *
+ *  Open a file in +dir+.  +mode+ is a mode string or an integer of
+ *  <code>File::Constants</code> flags.  With a block, the file is
+ *  closed afterwards.
+ *
+ *     Dir.open "/var/spool/jobs" do |d|
+ *       d.children.each { |c| d.open_child c do |f| ... end }
+ *     end
+ */
+
+VALUE
+rb_dir_open_child( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE name, mode, perm, path, f;
+    struct supplement_at a;
+
+    rb_scan_args( argc, argv, "12", &name, &mode, &perm);
+    FilePathValue( name);
+    a.op = SUPPLEMENT_AT_OPEN;
+    a.fd = supplement_dir_fd( dir);
+    a.name = RSTRING_PTR( name);
+    if (NIL_P( mode))
+        a.flags = O_RDONLY;
+    else if (FIXNUM_P( mode))
+        a.flags = NUM2INT( mode);
+    else
+        a.flags = rb_io_modestr_oflags( StringValueCStr( mode));
+    a.flags |= O_CLOEXEC;
+    a.mode = NIL_P( perm) ? 0666 : NUM2UINT( perm);
+    path = supplement_child_path( dir, name);
+    StringValueCStr( path);
+    supplement_at( &a, dir, name);
+    f = rb_io_fdopen( a.res, a.flags, RSTRING_PTR( path));
+    RB_GC_GUARD( name);
+    if (rb_block_given_p())
+        return rb_ensure( rb_yield, f, rb_io_close, f);
+    return f;
+}
+
+/*
+ *  call-seq:
+ *     dir.stat_child( name)      -> stat
+ *     dir.lstat_child( name)     -> stat
+ *
+ *  Like <code>File.stat</code> and <code>File.lstat</code> for a file
+ *  in +dir+.
+ */
+
+VALUE
+rb_dir_stat_child( VALUE dir, VALUE name)
+{
+    struct supplement_at a;
+
+    FilePathValue( name);
+    a.op = SUPPLEMENT_AT_STAT;
+    a.fd = supplement_dir_fd( dir);
+    a.name = RSTRING_PTR( name);
+    a.flags = 0;
+    supplement_at( &a, dir, name);
+    RB_GC_GUARD( name);
+    return rb_stat_new( &a.st);
+}
+
+VALUE
+rb_dir_lstat_child( VALUE dir, VALUE name)
+{
+    struct supplement_at a;
+
+    FilePathValue( name);
+    a.op = SUPPLEMENT_AT_STAT;
+    a.fd = supplement_dir_fd( dir);
+    a.name = RSTRING_PTR( name);
+    a.flags = AT_SYMLINK_NOFOLLOW;
+    supplement_at( &a, dir, name);
+    RB_GC_GUARD( name);
+    return rb_stat_new( &a.st);
+}
+
+/*
+ *  call-seq:
+ *     dir.unlink_child( name)     -> 0
+ *     dir.rmdir_child( name)      -> 0
+ *
+ *  Remove a file or an empty directory in +dir+.
+ */
+
+VALUE
+rb_dir_unlink_child( VALUE dir, VALUE name)
+{
+    struct supplement_at a;
+
+    FilePathValue( name);
+    a.op = SUPPLEMENT_AT_UNLINK;
+    a.fd = supplement_dir_fd( dir);
+    a.name = RSTRING_PTR( name);
+    a.flags = 0;
+    supplement_at( &a, dir, name);
+    RB_GC_GUARD( name);
+    return INT2FIX( 0);
+}
+
+VALUE
+rb_dir_rmdir_child( VALUE dir, VALUE name)
+{
+    struct supplement_at a;
+
+    FilePathValue( name);
+    a.op = SUPPLEMENT_AT_UNLINK;
+    a.fd = supplement_dir_fd( dir);
+    a.name = RSTRING_PTR( name);
+    a.flags = AT_REMOVEDIR;
+    supplement_at( &a, dir, name);
+    RB_GC_GUARD( name);
+    return INT2FIX( 0);
+}
+
+/*
+ *  call-seq:
+ *     dir.mkdir_child( name, mode = 0777)     -> 0
+ *
+ *  Make a directory in +dir+.
+ */
+
+VALUE
+rb_dir_mkdir_child( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE name, mode;
+    struct supplement_at a;
+
+    rb_scan_args( argc, argv, "11", &name, &mode);
+    FilePathValue( name);
+    a.op = SUPPLEMENT_AT_MKDIR;
+    a.fd = supplement_dir_fd( dir);
+    a.name = RSTRING_PTR( name);
+    a.mode = NIL_P( mode) ? 0777 : NUM2UINT( mode);
+    supplement_at( &a, dir, name);
+    RB_GC_GUARD( name);
+    return INT2FIX( 0);
+}
+
+/*
+ *  call-seq:
+ *     dir.rename_child( old, new, to = nil, noreplace: false, exchange: false)   -> 0
+ *
+ *  Rename a file in +dir+.  If +to+ is another Dir, the file is moved
+ *  there.  With <code>noreplace: true</code> an existing +new+ is an
+ *  error; <code>exchange: true</code> swaps +old+ and +new+ atomically.
+ */
+
+VALUE
+rb_dir_rename_child( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE old, new, to, opts;
+    struct supplement_at a;
+
+    rb_scan_args( argc, argv, "21:", &old, &new, &to, &opts);
+    FilePathValue( old);
+    FilePathValue( new);
+    a.op = SUPPLEMENT_AT_RENAME;
+    a.fd = supplement_dir_fd( dir);
+    a.fd2 = NIL_P( to) ? a.fd : supplement_dir_fd( to);
+    a.name = RSTRING_PTR( old);
+    a.name2 = RSTRING_PTR( new);
+    a.flags = 0;
+    if (!NIL_P( opts)) {
+        if (RTEST( rb_hash_aref( opts, ID2SYM( id_noreplace))))
+            a.flags |= RENAME_NOREPLACE;
+        if (RTEST( rb_hash_aref( opts, ID2SYM( id_exchange))))
+            a.flags |= RENAME_EXCHANGE;
+    }
+    supplement_at( &a, dir, old);
+    RB_GC_GUARD( old);
+    RB_GC_GUARD( new);
+    return INT2FIX( 0);
 }
 
 
@@ -1128,6 +1733,59 @@ rb_match_end( int argc, VALUE *argv, VALUE match)
 }
 
 
+/*
+ *  call-seq:
+ *     offsets_all( packed = false)   -> ary or str
+ *
+ *  Returns the begin and end offsets of all groups in one flat array.
+ *  Groups that did not participate in the match give +nil+.
+ *
+ *  If +packed+ is true, the offsets will be returned as native 64-bit
+ *  integers in a binary string and missing groups are -1.
+ *
+ *     m = /(.)(.)(\d+)(\d)/.match("THX1138.")
+ *     m.offsets_all               #=> [1, 7, 1, 2, 2, 3, 3, 6, 6, 7]
+ *     m.offsets_all( true).unpack "q*"
+ *                                 #=> [1, 7, 1, 2, 2, 3, 3, 6, 6, 7]
+ */
+
+VALUE
+rb_match_offsets_all( int argc, VALUE *argv, VALUE match)
+{
+    VALUE packed;
+    VALUE r;
+    struct re_registers *regs;
+    int i;
+
+    rb_scan_args( argc, argv, "01", &packed);
+    regs = RMATCH_REGS( match);
+    if (RTEST( packed)) {
+        int64_t *p;
+
+        r = rb_str_new( NULL, 2 * regs->num_regs * sizeof (int64_t));
+        p = (int64_t *) RSTRING_PTR( r);
+        for (i = 0; i < regs->num_regs; i++) {
+            if (regs->beg[ i] < 0)
+                *p++ = -1, *p++ = -1;
+            else
+                *p++ = regs->beg[ i], *p++ = regs->end[ i];
+        }
+    } else {
+        r = rb_ary_new2( 2 * regs->num_regs);
+        for (i = 0; i < regs->num_regs; i++) {
+            if (regs->beg[ i] < 0) {
+                rb_ary_push( r, Qnil);
+                rb_ary_push( r, Qnil);
+            } else {
+                rb_ary_push( r, LONG2NUM( regs->beg[ i]));
+                rb_ary_push( r, LONG2NUM( regs->end[ i]));
+            }
+        }
+    }
+    return r;
+}
+
+
 /*
  *  call-seq:
  *     fields( ...)   -> ary
@@ -1219,6 +1877,7 @@ void Init_supplement( void)
     rb_define_method( rb_cString, "axe!", rb_str_axe_bang, -1);
     rb_define_method( rb_cString, "starts_with?", rb_str_starts_with_p, -1);
     rb_define_method( rb_cString, "ends_with?", rb_str_ends_with_p, -1);
+    rb_define_method( rb_cString, "scan_offsets", rb_str_scan_offsets, 1);
     rb_define_method( rb_cSymbol, "starts_with?", rb_sym_starts_with_p, -1);
     rb_define_method( rb_cSymbol, "ends_with?", rb_sym_ends_with_p, -1);
 
@@ -1240,15 +1899,25 @@ void Init_supplement( void)
 
     rb_undef_method( CLASS_OF( rb_cFile), "umask");
     rb_define_singleton_method( rb_cFile, "umask", rb_file_s_umask, -1);
+    rb_define_singleton_method( rb_cFile, "create", rb_file_s_create, -1);
 
     rb_define_singleton_method( rb_cDir, "current", rb_dir_s_current, 0);
     rb_define_singleton_method( rb_cDir, "mkdir!", rb_dir_s_mkdir_bang, -1);
+    rb_define_singleton_method( rb_cDir, "mkdir_all", rb_dir_s_mkdir_all, -1);
     rb_define_alias(  rb_cDir, "entries!", "children");
+    rb_define_method( rb_cDir, "open_child", rb_dir_open_child, -1);
+    rb_define_method( rb_cDir, "stat_child", rb_dir_stat_child, 1);
+    rb_define_method( rb_cDir, "lstat_child", rb_dir_lstat_child, 1);
+    rb_define_method( rb_cDir, "unlink_child", rb_dir_unlink_child, 1);
+    rb_define_method( rb_cDir, "rmdir_child", rb_dir_rmdir_child, 1);
+    rb_define_method( rb_cDir, "mkdir_child", rb_dir_mkdir_child, -1);
+    rb_define_method( rb_cDir, "rename_child", rb_dir_rename_child, -1);
 
     rb_undef_method( rb_cMatch, "begin");
     rb_undef_method( rb_cMatch, "end");
     rb_define_method( rb_cMatch, "begin", rb_match_begin, -1);
     rb_define_method( rb_cMatch, "end", rb_match_end, -1);
+    rb_define_method( rb_cMatch, "offsets_all", rb_match_offsets_all, -1);
 
     rb_define_alias( rb_singleton_class( rb_cStruct), "[]", "new");
     rb_define_method( rb_cStruct, "fields", rb_struct_fields, -1);
@@ -1261,8 +1930,13 @@ void Init_supplement( void)
     id_delete_at   = rb_intern( "delete_at");
     id_cmp         = rb_intern( "<=>");
     id_eqq         = 0;
-    id_mkdir       = 0;
     id_index       = 0;
+    id_fileno      = rb_intern( "fileno");
+    id_path        = rb_intern( "path");
+    id_noreplace   = rb_intern( "noreplace");
+    id_exchange    = rb_intern( "exchange");
+    id_mode        = rb_intern( "mode");
+    id_exact_mode  = rb_intern( "exact_mode");
 
     Init_supplement_process();
 }
@@ -29,6 +29,7 @@ extern VALUE rb_str_axe( int, VALUE *, VALUE);
 extern VALUE rb_str_axe_bang( int, VALUE *, VALUE);
 extern VALUE rb_str_starts_with_p( int argc, VALUE *argv, VALUE);
 extern VALUE rb_str_ends_with_p( int argc, VALUE *argv, VALUE);
+extern VALUE rb_str_scan_offsets( VALUE, VALUE);
 extern VALUE rb_sym_starts_with_p( int argc, VALUE *argv, VALUE);
 extern VALUE rb_sym_ends_with_p( int argc, VALUE *argv, VALUE);
 
@@ -47,11 +48,21 @@ extern VALUE rb_ary_rpick( int, VALUE *, VALUE);
 extern VALUE rb_hash_notempty_p( VALUE);
 
 extern VALUE rb_file_s_umask( int, VALUE *, VALUE);
+extern VALUE rb_file_s_create( int, VALUE *, VALUE);
 extern VALUE rb_dir_s_current( VALUE);
 extern VALUE rb_dir_s_mkdir_bang( int, VALUE *, VALUE);
+extern VALUE rb_dir_s_mkdir_all( int, VALUE *, VALUE);
+extern VALUE rb_dir_open_child( int, VALUE *, VALUE);
+extern VALUE rb_dir_stat_child( VALUE, VALUE);
+extern VALUE rb_dir_lstat_child( VALUE, VALUE);
+extern VALUE rb_dir_unlink_child( VALUE, VALUE);
+extern VALUE rb_dir_rmdir_child( VALUE, VALUE);
+extern VALUE rb_dir_mkdir_child( int, VALUE *, VALUE);
+extern VALUE rb_dir_rename_child( int, VALUE *, VALUE);
 
 extern VALUE rb_match_begin( int, VALUE *, VALUE);
 extern VALUE rb_match_end( int, VALUE *, VALUE);
+extern VALUE rb_match_offsets_all( int, VALUE *, VALUE);
 
 extern VALUE rb_struct_fields( int, VALUE *, VALUE);
 
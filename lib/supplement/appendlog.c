@@ -0,0 +1,693 @@
+/*
+ *  supplement/appendlog.c  --  Group commit to a shared log file
+ */
+
+#include "locked.h"
+
+#include <ruby/io.h>
+#include <ruby/thread.h>
+
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define ALOG_CHUNK  (64 * 1024)
+#define ALOG_IOV    64
+#define ALOG_GC_WAIT  1000               /* milliseconds */
+
+
+/*
+ *  Records are copied into a list of chunks, so a batch can be written
+ *  by one writev() without the GVL.  A native thread writes a batch
+ *  when it is full or when its first record has waited long enough.
+ *  Batches are written in the order they were taken; +wmutex+ keeps
+ *  the flusher thread and explicit flushes from overtaking each other.
+ *  The lock is polled, so that a waiting writer can be stopped; a batch
+ *  is only taken once the lock is held.
+ *
+ *  The thread does not survive a fork.  In a child process the log is
+ *  left alone, pending records included; they belong to the parent.
+ */
+
+struct alog_chunk {
+    struct alog_chunk *next;
+    size_t             len;
+    char               data[ ALOG_CHUNK];
+};
+
+struct alog_batch {
+    struct alog_chunk *head, *tail;
+    size_t             bytes;
+    unsigned long      records;
+    struct timespec    since;
+};
+
+struct alog {
+    pthread_mutex_t    mutex;
+    pthread_mutex_t    wmutex;
+    pthread_cond_t     cond;
+    pthread_t          thread;
+    int                running;
+    volatile int       stop;
+    volatile int       cancel;           /* interrupt a Ruby call */
+    pid_t              pid;
+    int                fd;
+    VALUE              path;
+    struct alog_batch  pending;
+    unsigned long      max_records;
+    size_t             max_bytes;
+    long               interval;         /* milliseconds */
+    int                sync;
+    int                err;
+    unsigned long      batches, records, syncs, largest;
+    unsigned long long bytes;
+};
+
+static struct alog *get_alog( VALUE);
+static void  alog_mark( void *);
+static void  alog_free( void *);
+static int   alog_foreign( struct alog *);
+static int   alog_stop( struct alog *, const volatile int *, long);
+static void *alog_stop_nogvl( void *);
+static void  alog_ubf( void *);
+static void *alog_thread( void *);
+static int   alog_full( struct alog *);
+static int   alog_lock( int, const volatile int *, long);
+static int   alog_write( struct alog *, const volatile int *, long);
+static void *alog_flush_nogvl( void *);
+static void  alog_batch_free( struct alog_batch *);
+static void  alog_check( struct alog *);
+
+static VALUE rb_cAppendLog;
+
+static ID id_max_records = 0;
+static ID id_max_bytes = 0;
+static ID id_interval = 0;
+static ID id_sync = 0;
+static ID id_perm = 0;
+static VALUE sym_batches, sym_records, sym_bytes, sym_syncs, sym_largest;
+
+static const rb_data_type_t alog_data_type = {
+    "supplement:appendlog",
+    { &alog_mark, &alog_free, NULL, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+/*
+ *  Document-class: LockedFile::AppendLog
+ *
+ *  Append records to a file that other processes append to, too.
+ *  The file stays open and the records are collected in memory.  They
+ *  are written in batches, each under one exclusive +flock+ and with
+ *  one +writev+, by a native thread.
+ */
+
+VALUE
+rb_alog_s_alloc( VALUE cls)
+{
+    struct alog *l;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct( cls, struct alog, &alog_data_type, l);
+    pthread_mutex_init( &l->mutex, NULL);
+    pthread_mutex_init( &l->wmutex, NULL);
+    pthread_cond_init( &l->cond, NULL);
+    l->fd = -1;
+    l->pid = getpid();
+    l->path = Qnil;
+    return obj;
+}
+
+/*
+ *  call-seq:
+ *     LockedFile::AppendLog.new( path, max_records: 1000, max_bytes: 65536,
+ *                                interval: 0.05, sync: false, perm: 0666)   -> log
+ *     LockedFile::AppendLog.open( path, ...) { |log| ... }                  -> obj
+ *
+ *  Open +path+ for appending; it is created if necessary.  A batch is
+ *  written when it has +max_records+ records or +max_bytes+ bytes, or
+ *  +interval+ seconds after its first record.  With
+ *  <code>sync: true</code>, every batch is followed by an
+ *  +fdatasync+.
+ *
+ *  An error while writing is raised by the next call.  A log can't be
+ *  used in a child process; it raises an IOError there.
+ *
+ *     LockedFile::AppendLog.open "events.log", sync: true do |l|
+ *       l << "#{Time.now} started\n"
+ *     end
+ */
+
+VALUE
+rb_alog_init( int argc, VALUE *argv, VALUE self)
+{
+    VALUE path, opts, v;
+    struct alog *l;
+    sigset_t all, old;
+    mode_t perm = 0666;
+    double d;
+    int r;
+
+    TypedData_Get_Struct( self, struct alog, &alog_data_type, l);
+    if (l->fd >= 0)
+        rb_raise( rb_eArgError, "log already open");
+    rb_scan_args( argc, argv, "1:", &path, &opts);
+    FilePathValue( path);
+    l->max_records = 1000;
+    l->max_bytes = 64 * 1024;
+    l->interval = 50;
+    if (!NIL_P( opts)) {
+        v = rb_hash_aref( opts, ID2SYM( id_max_records));
+        if (!NIL_P( v))
+            l->max_records = NUM2ULONG( v);
+        v = rb_hash_aref( opts, ID2SYM( id_max_bytes));
+        if (!NIL_P( v))
+            l->max_bytes = NUM2SIZET( v);
+        v = rb_hash_aref( opts, ID2SYM( id_interval));
+        if (!NIL_P( v)) {
+            d = NUM2DBL( v);
+            if (d < 0.0)
+                rb_raise( rb_eArgError, "interval must not be negative");
+            l->interval = (long) (d * 1000.0 + 0.5);
+        }
+        l->sync = RTEST( rb_hash_aref( opts, ID2SYM( id_sync)));
+        v = rb_hash_aref( opts, ID2SYM( id_perm));
+        if (!NIL_P( v))
+            perm = NUM2UINT( v);
+    }
+    l->pid = getpid();
+    l->path = rb_str_new_frozen( path);
+    l->fd = rb_cloexec_open( StringValueCStr( path),
+                             O_WRONLY | O_APPEND | O_CREAT, perm);
+    if (l->fd < 0)
+        rb_sys_fail_str( path);
+
+    sigfillset( &all);
+    pthread_sigmask( SIG_SETMASK, &all, &old);
+    r = pthread_create( &l->thread, NULL, &alog_thread, l);
+    pthread_sigmask( SIG_SETMASK, &old, NULL);
+    if (r != 0) {
+        close( l->fd);
+        l->fd = -1;
+        rb_syserr_fail( r, "pthread_create");
+    }
+    l->running = 1;
+    return self;
+}
+
+VALUE
+rb_alog_s_open( int argc, VALUE *argv, VALUE cls)
+{
+    VALUE obj;
+
+    obj = rb_class_new_instance_kw( argc, argv, cls, RB_PASS_CALLED_KEYWORDS);
+    if (rb_block_given_p())
+        return rb_ensure( rb_yield, obj, rb_alog_close, obj);
+    return obj;
+}
+
+struct alog *
+get_alog( VALUE obj)
+{
+    struct alog *l;
+
+    TypedData_Get_Struct( obj, struct alog, &alog_data_type, l);
+    if (alog_foreign( l))
+        rb_raise( rb_eIOError, "log was opened by another process");
+    if (l->fd < 0 || l->stop)
+        rb_raise( rb_eIOError, "closed log");
+    return l;
+}
+
+void
+alog_mark( void *p)
+{
+    rb_gc_mark( ((struct alog *) p)->path);
+}
+
+void
+alog_free( void *p)
+{
+    struct alog *l = p;
+
+    /* Don't block the GC for good when the lock isn't released. */
+    alog_stop( l, NULL, ALOG_GC_WAIT);
+    alog_batch_free( &l->pending);
+    if (!alog_foreign( l)) {
+        pthread_cond_destroy( &l->cond);
+        pthread_mutex_destroy( &l->wmutex);
+        pthread_mutex_destroy( &l->mutex);
+    }
+    xfree( l);
+}
+
+int
+alog_foreign( struct alog *l)
+{
+    return l->pid != getpid();
+}
+
+/*
+ *  Stop the thread, write what is left and close.  Returns EINTR if
+ *  +abort+ was set while waiting for the lock; the file stays open
+ *  then.
+ */
+
+int
+alog_stop( struct alog *l, const volatile int *abort, long patience)
+{
+    if (alog_foreign( l)) {
+        l->running = 0;
+        alog_batch_free( &l->pending);
+        memset( &l->pending, 0, sizeof l->pending);
+        if (l->fd >= 0)
+            close( l->fd), l->fd = -1;
+        return 0;
+    }
+    if (l->running) {
+        pthread_mutex_lock( &l->mutex);
+        l->stop = 1;
+        pthread_cond_signal( &l->cond);
+        pthread_mutex_unlock( &l->mutex);
+        pthread_join( l->thread, NULL);
+        l->running = 0;
+    }
+    if (l->fd >= 0) {
+        if (alog_write( l, abort, patience) == EINTR)
+            return EINTR;
+        close( l->fd);
+        l->fd = -1;
+    }
+    return 0;
+}
+
+void *
+alog_stop_nogvl( void *p)
+{
+    struct alog *l = p;
+
+    return alog_stop( l, &l->cancel, -1) == EINTR ? p : NULL;
+}
+
+void
+alog_ubf( void *p)
+{
+    ((struct alog *) p)->cancel = 1;
+}
+
+void *
+alog_thread( void *p)
+{
+    struct alog *l = p;
+    struct timespec due;
+
+    pthread_mutex_lock( &l->mutex);
+    while (!l->stop) {
+        if (l->pending.records == 0) {
+            pthread_cond_wait( &l->cond, &l->mutex);
+            continue;
+        }
+        if (!alog_full( l)) {
+            due = l->pending.since;
+            due.tv_sec += l->interval / 1000;
+            due.tv_nsec += (l->interval % 1000) * 1000000;
+            if (due.tv_nsec >= 1000000000L)
+                due.tv_sec++, due.tv_nsec -= 1000000000L;
+            if (pthread_cond_timedwait( &l->cond, &l->mutex, &due) == 0)
+                continue;
+        }
+        pthread_mutex_unlock( &l->mutex);
+        alog_write( l, &l->stop, -1);
+        pthread_mutex_lock( &l->mutex);
+    }
+    pthread_mutex_unlock( &l->mutex);
+    return NULL;
+}
+
+/* Called with the mutex held. */
+
+int
+alog_full( struct alog *l)
+{
+    return l->pending.records >= l->max_records ||
+           l->pending.bytes >= l->max_bytes;
+}
+
+/*
+ *  Take the exclusive lock, polling.  Gives up with EINTR when +abort+
+ *  gets set and with ETIMEDOUT after +patience+ milliseconds unless
+ *  that is negative.
+ */
+
+int
+alog_lock( int fd, const volatile int *abort, long patience)
+{
+    struct timespec d;
+    long waited = 0;
+
+    d.tv_sec = 0;
+    d.tv_nsec = 1000000;
+    for (;;) {
+        if (flock( fd, LOCK_EX | LOCK_NB) == 0)
+            return 0;
+        if (errno != EWOULDBLOCK && errno != EINTR)
+            return errno;
+        if (abort != NULL && *abort)
+            return EINTR;
+        if (patience >= 0 && waited >= patience)
+            return ETIMEDOUT;
+        nanosleep( &d, NULL);
+        waited += d.tv_nsec / 1000000;
+        if (d.tv_nsec < 16000000)
+            d.tv_nsec *= 2;
+    }
+}
+
+/*
+ *  Take the pending batch and write it.  Returns 0 or an error number,
+ *  which is also kept for the Ruby side.  If +abort+ stops the wait for
+ *  the lock, EINTR is returned and the records stay pending.  When the
+ *  lock isn't had within +patience+, the batch is appended without it.
+ */
+
+int
+alog_write( struct alog *l, const volatile int *abort, long patience)
+{
+    struct alog_batch b;
+    struct alog_chunk *c;
+    struct iovec iov[ ALOG_IOV];
+    ssize_t w;
+    int n, i, locked, err;
+
+    pthread_mutex_lock( &l->wmutex);
+    pthread_mutex_lock( &l->mutex);
+    n = l->pending.records > 0;
+    pthread_mutex_unlock( &l->mutex);
+    if (!n) {
+        pthread_mutex_unlock( &l->wmutex);
+        return 0;
+    }
+    err = alog_lock( l->fd, abort, patience);
+    if (err == EINTR) {
+        pthread_mutex_unlock( &l->wmutex);
+        return EINTR;
+    }
+    locked = err == 0;
+    if (err == ETIMEDOUT)
+        err = 0;
+    pthread_mutex_lock( &l->mutex);
+    b = l->pending;
+    memset( &l->pending, 0, sizeof l->pending);
+    pthread_mutex_unlock( &l->mutex);
+
+    for (c = b.head; c != NULL && !err;) {
+        for (n = 0; c != NULL && n < ALOG_IOV; c = c->next, n++) {
+            iov[ n].iov_base = c->data;
+            iov[ n].iov_len = c->len;
+        }
+        for (i = 0; i < n;) {
+            w = writev( l->fd, iov + i, n - i);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                err = errno;
+                break;
+            }
+            for (; i < n && (size_t) w >= iov[ i].iov_len; i++)
+                w -= iov[ i].iov_len;
+            if (i < n) {
+                iov[ i].iov_base = (char *) iov[ i].iov_base + w;
+                iov[ i].iov_len -= w;
+            }
+        }
+    }
+    if (!err && l->sync)
+        while (fdatasync( l->fd) < 0)
+            if (errno != EINTR) {
+                err = errno;
+                break;
+            }
+    if (locked)
+        flock( l->fd, LOCK_UN);
+
+    pthread_mutex_lock( &l->mutex);
+    if (err) {
+        if (!l->err)
+            l->err = err;
+    } else {
+        l->batches++;
+        l->records += b.records;
+        l->bytes += b.bytes;
+        if (l->sync)
+            l->syncs++;
+        if (b.records > l->largest)
+            l->largest = b.records;
+    }
+    pthread_mutex_unlock( &l->mutex);
+    pthread_mutex_unlock( &l->wmutex);
+    alog_batch_free( &b);
+    return err;
+}
+
+void
+alog_batch_free( struct alog_batch *b)
+{
+    struct alog_chunk *c;
+
+    while ((c = b->head) != NULL) {
+        b->head = c->next;
+        free( c);
+    }
+    b->tail = NULL;
+}
+
+/* Raise an error the flusher ran into; it is reported once. */
+
+void
+alog_check( struct alog *l)
+{
+    int err;
+
+    pthread_mutex_lock( &l->mutex);
+    err = l->err;
+    l->err = 0;
+    pthread_mutex_unlock( &l->mutex);
+    if (err)
+        rb_syserr_fail_str( err, l->path);
+}
+
+
+/*
+ *  call-seq:
+ *     log << str         -> log
+ *     log.append( str)   -> log
+ *
+ *  Add a record.  It is written as it is; add a newline yourself if
+ *  you want one.
+ */
+
+VALUE
+rb_alog_append( VALUE self, VALUE str)
+{
+    struct alog *l;
+    struct alog_chunk *c;
+    const char *p;
+    long len, k;
+    int wake;
+
+    l = get_alog( self);
+    alog_check( l);
+    StringValue( str);
+    p = RSTRING_PTR( str);
+    len = RSTRING_LEN( str);
+    pthread_mutex_lock( &l->mutex);
+    if (l->pending.records == 0)
+        clock_gettime( CLOCK_REALTIME, &l->pending.since);
+    while (len > 0) {
+        c = l->pending.tail;
+        if (c == NULL || c->len == ALOG_CHUNK) {
+            c = malloc( sizeof *c);
+            if (c == NULL) {
+                pthread_mutex_unlock( &l->mutex);
+                rb_memerror();
+            }
+            c->next = NULL;
+            c->len = 0;
+            if (l->pending.tail != NULL)
+                l->pending.tail->next = c;
+            else
+                l->pending.head = c;
+            l->pending.tail = c;
+        }
+        k = ALOG_CHUNK - c->len;
+        if (k > len)
+            k = len;
+        memcpy( c->data + c->len, p, k);
+        c->len += k, p += k, len -= k;
+        l->pending.bytes += k;
+    }
+    wake = l->pending.records++ == 0 || alog_full( l);
+    if (wake)
+        pthread_cond_signal( &l->cond);
+    pthread_mutex_unlock( &l->mutex);
+    RB_GC_GUARD( str);
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     log.flush     -> log
+ *
+ *  Write the pending records now and wait for it.
+ */
+
+VALUE
+rb_alog_flush( VALUE self)
+{
+    struct alog *l;
+
+    l = get_alog( self);
+    for (;;) {
+        l->cancel = 0;
+        if (rb_thread_call_without_gvl( &alog_flush_nogvl, l,
+                                        &alog_ubf, l) == NULL)
+            break;
+        rb_thread_check_ints();
+    }
+    alog_check( l);
+    return self;
+}
+
+void *
+alog_flush_nogvl( void *p)
+{
+    struct alog *l = p;
+
+    return alog_write( l, &l->cancel, -1) == EINTR ? p : NULL;
+}
+
+/*
+ *  call-seq:
+ *     log.stats     -> hash
+ *
+ *  How the records were batched: <code>:batches</code>,
+ *  <code>:records</code>, <code>:bytes</code>, <code>:syncs</code> and
+ *  the number of records in the <code>:largest</code> batch.
+ */
+
+VALUE
+rb_alog_stats( VALUE self)
+{
+    struct alog *l;
+    VALUE r;
+
+    TypedData_Get_Struct( self, struct alog, &alog_data_type, l);
+    if (alog_foreign( l))
+        rb_raise( rb_eIOError, "log was opened by another process");
+    r = rb_hash_new();
+    pthread_mutex_lock( &l->mutex);
+    rb_hash_aset( r, sym_batches, ULONG2NUM( l->batches));
+    rb_hash_aset( r, sym_records, ULONG2NUM( l->records));
+    rb_hash_aset( r, sym_bytes,   ULL2NUM( l->bytes));
+    rb_hash_aset( r, sym_syncs,   ULONG2NUM( l->syncs));
+    rb_hash_aset( r, sym_largest, ULONG2NUM( l->largest));
+    pthread_mutex_unlock( &l->mutex);
+    return r;
+}
+
+/*
+ *  call-seq:
+ *     log.path     -> str
+ */
+
+VALUE
+rb_alog_path( VALUE self)
+{
+    struct alog *l;
+
+    TypedData_Get_Struct( self, struct alog, &alog_data_type, l);
+    return l->path;
+}
+
+/*
+ *  call-seq:
+ *     log.close     -> nil
+ *
+ *  Write the pending records and close the file.
+ */
+
+VALUE
+rb_alog_close( VALUE self)
+{
+    struct alog *l;
+
+    TypedData_Get_Struct( self, struct alog, &alog_data_type, l);
+    if (l->fd < 0)
+        return Qnil;
+    if (alog_foreign( l)) {
+        alog_stop( l, NULL, -1);
+        return Qnil;
+    }
+    for (;;) {
+        l->cancel = 0;
+        if (rb_thread_call_without_gvl( &alog_stop_nogvl, l,
+                                        &alog_ubf, l) == NULL)
+            break;
+        rb_thread_check_ints();
+    }
+    alog_check( l);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     log.closed?     -> true or false
+ */
+
+VALUE
+rb_alog_closed_p( VALUE self)
+{
+    struct alog *l;
+
+    TypedData_Get_Struct( self, struct alog, &alog_data_type, l);
+    return l->fd < 0 ? Qtrue : Qfalse;
+}
+
+
+void Init_appendlog( VALUE rb_cLockedFile)
+{
+    rb_cAppendLog = rb_define_class_under( rb_cLockedFile, "AppendLog",
+                                                                rb_cObject);
+    rb_define_alloc_func( rb_cAppendLog, rb_alog_s_alloc);
+    rb_define_singleton_method( rb_cAppendLog, "open", rb_alog_s_open, -1);
+    rb_define_method( rb_cAppendLog, "initialize", rb_alog_init, -1);
+    rb_define_method( rb_cAppendLog, "append", rb_alog_append, 1);
+    rb_define_method( rb_cAppendLog, "<<", rb_alog_append, 1);
+    rb_define_method( rb_cAppendLog, "flush", rb_alog_flush, 0);
+    rb_define_method( rb_cAppendLog, "stats", rb_alog_stats, 0);
+    rb_define_method( rb_cAppendLog, "path", rb_alog_path, 0);
+    rb_define_method( rb_cAppendLog, "close", rb_alog_close, 0);
+    rb_define_method( rb_cAppendLog, "closed?", rb_alog_closed_p, 0);
+
+    id_max_records = rb_intern( "max_records");
+    id_max_bytes   = rb_intern( "max_bytes");
+    id_interval    = rb_intern( "interval");
+    id_sync        = rb_intern( "sync");
+    id_perm        = rb_intern( "perm");
+    sym_batches    = ID2SYM( rb_intern( "batches"));
+    sym_records    = ID2SYM( rb_intern( "records"));
+    sym_bytes      = ID2SYM( rb_intern( "bytes"));
+    sym_syncs      = ID2SYM( rb_intern( "syncs"));
+    sym_largest    = ID2SYM( rb_intern( "largest"));
+}
+
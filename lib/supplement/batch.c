@@ -0,0 +1,715 @@
+/*
+ *  supplement/batch.c  --  Batched file system calls
+ */
+
+#include "batch.h"
+
+#include "pool.h"
+
+#include <ruby/io.h>
+#include <ruby/thread.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define BATCH_RING     256
+#define BATCH_PENDING  INT_MIN
+#define BATCH_WAIT     100000000         /* nanoseconds */
+
+#ifndef IORING_SETUP_SUBMIT_ALL
+    #define IORING_SETUP_SUBMIT_ALL  (1U << 7)
+#endif
+
+enum batch_opcode {
+    BOP_STAT,
+    BOP_LSTAT,
+    BOP_OPEN,
+    BOP_UNLINK,
+    BOP_RMDIR,
+    BOP_MKDIR,
+    BOP_RENAME,
+    BOP_SYMLINK,
+    BOP_LINK,
+    BOP_COUNT
+};
+
+struct batch_op {
+    struct supplement_pool_job link;
+    int                        op;
+    int                        flags;
+    unsigned int               mode;
+    char                      *path, *path2;
+    int                        res;
+    struct statx               stx;
+};
+
+struct batch {
+    struct supplement_pool pool;
+    struct batch_op       *ops;
+    long                   n, capa;
+    int                    done;
+};
+
+struct batch_ring {
+    int                  fd;
+    unsigned int         entries;
+    int                  ext_arg;
+    void                *sq, *cq;
+    size_t               sqlen, cqlen;
+    struct io_uring_sqe *sqes;
+    size_t               sqeslen;
+    unsigned int        *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int        *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static struct batch *get_batch( VALUE);
+static void   batch_free( void *);
+static size_t batch_memsize( const void *);
+static struct batch_op *batch_add( VALUE, int, VALUE, VALUE);
+static void  *batch_nogvl( void *);
+static void   batch_ubf( void *);
+static int    batch_ring_init( struct batch_ring *, unsigned int);
+static void   batch_ring_close( struct batch_ring *);
+static int    batch_uring( struct batch *);
+static int    batch_uring_wait( struct batch_ring *);
+static void   batch_prep( struct batch_op *, struct io_uring_sqe *, long);
+static void   batch_work( struct supplement_pool *, struct supplement_pool_job *);
+static void   batch_drop( struct supplement_pool *, struct supplement_pool_job *);
+static VALUE  batch_result( struct batch_op *);
+static VALUE  batch_run( VALUE);
+static VALUE  batch_check_ints( VALUE);
+
+static VALUE rb_cFileBatch;
+
+static const unsigned char batch_uring_ops[ BOP_COUNT] = {
+    IORING_OP_STATX, IORING_OP_STATX, IORING_OP_OPENAT,
+    IORING_OP_UNLINKAT, IORING_OP_UNLINKAT, IORING_OP_MKDIRAT,
+    IORING_OP_RENAMEAT, IORING_OP_SYMLINKAT, IORING_OP_LINKAT
+};
+
+static const rb_data_type_t batch_data_type = {
+    "supplement:batch",
+    { NULL, &batch_free, &batch_memsize, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+/*
+ *  Document-class: File::Batch
+ *
+ *  File system calls collected by File.batch.  Each method queues one
+ *  call and returns its index in the results.
+ */
+
+/*
+ *  call-seq:
+ *     File.batch { |b| ... }     -> ary
+ *
+ *  Collect file system calls and run them all at once, without the
+ *  GVL, through io_uring.  Where io_uring is not available, or the
+ *  kernel doesn't know some of the operations, they are run by native
+ *  threads.  The calls are not ordered; don't queue operations that
+ *  depend on each other.
+ *
+ *  The result has one entry per call: a File::Stat for #stat and
+ *  #lstat, a File for #open, 0 for the others, or a SystemCallError
+ *  object if the call failed.  Nothing is raised.
+ *
+ *     stats = File.batch { |b| names.each { |n| b.stat n } }
+ *     File.batch { |b| old.each { |n| b.unlink n } }.grep SystemCallError
+ */
+
+VALUE
+rb_file_s_batch( VALUE file)
+{
+    VALUE obj;
+    struct batch *b;
+
+    rb_need_block();
+    obj = TypedData_Make_Struct( rb_cFileBatch, struct batch,
+                                                    &batch_data_type, b);
+    rb_yield( obj);
+    return batch_run( obj);
+}
+
+struct batch *
+get_batch( VALUE obj)
+{
+    struct batch *b;
+
+    TypedData_Get_Struct( obj, struct batch, &batch_data_type, b);
+    return b;
+}
+
+void
+batch_free( void *p)
+{
+    struct batch *b = p;
+    long i;
+
+    for (i = 0; i < b->n; i++) {
+        free( b->ops[ i].path);
+        free( b->ops[ i].path2);
+    }
+    free( b->ops);
+    xfree( b);
+}
+
+size_t
+batch_memsize( const void *p)
+{
+    const struct batch *b = p;
+
+    return sizeof *b + b->capa * sizeof (struct batch_op);
+}
+
+struct batch_op *
+batch_add( VALUE self, int op, VALUE path, VALUE path2)
+{
+    struct batch *b;
+    struct batch_op *o;
+    long c;
+
+    b = get_batch( self);
+    if (b->done)
+        rb_raise( rb_eRuntimeError, "batch already run");
+    FilePathValue( path);
+    StringValueCStr( path);
+    if (!NIL_P( path2)) {
+        FilePathValue( path2);
+        StringValueCStr( path2);
+    }
+    if (b->n == b->capa) {
+        c = b->capa ? b->capa * 2 : 64;
+        o = realloc( b->ops, c * sizeof *o);
+        if (o == NULL)
+            rb_memerror();
+        b->ops = o;
+        b->capa = c;
+    }
+    o = b->ops + b->n;
+    MEMZERO( o, struct batch_op, 1);
+    o->op = op;
+    o->res = BATCH_PENDING;
+    o->path = strdup( RSTRING_PTR( path));
+    if (!NIL_P( path2))
+        o->path2 = strdup( RSTRING_PTR( path2));
+    if (o->path == NULL || (!NIL_P( path2) && o->path2 == NULL)) {
+        free( o->path);
+        rb_memerror();
+    }
+    b->n++;
+    return o;
+}
+
+/*
+ *  call-seq:
+ *     batch.stat( path)     -> int
+ *     batch.lstat( path)    -> int
+ *
+ *  Queue a <code>File.stat</code> or <code>File.lstat</code>.
+ */
+
+VALUE
+rb_batch_stat( VALUE self, VALUE path)
+{
+    batch_add( self, BOP_STAT, path, Qnil);
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+VALUE
+rb_batch_lstat( VALUE self, VALUE path)
+{
+    batch_add( self, BOP_LSTAT, path, Qnil);
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+/*
+ *  call-seq:
+ *     batch.open( path, mode = "r", perm = 0666)     -> int
+ *
+ *  Queue opening a file.  +mode+ is a mode string or an integer of
+ *  <code>File::Constants</code> flags.
+ */
+
+VALUE
+rb_batch_open( int argc, VALUE *argv, VALUE self)
+{
+    VALUE path, mode, perm;
+    struct batch_op *o;
+    mode_t m;
+    int flags;
+
+    rb_scan_args( argc, argv, "12", &path, &mode, &perm);
+    if (NIL_P( mode))
+        flags = O_RDONLY;
+    else if (FIXNUM_P( mode))
+        flags = NUM2INT( mode);
+    else
+        flags = rb_io_modestr_oflags( StringValueCStr( mode));
+    m = NIL_P( perm) ? 0666 : NUM2UINT( perm);
+    o = batch_add( self, BOP_OPEN, path, Qnil);
+    o->flags = flags | O_CLOEXEC;
+    o->mode = m;
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+/*
+ *  call-seq:
+ *     batch.unlink( path)     -> int
+ *     batch.rmdir( path)      -> int
+ *
+ *  Queue removing a file or an empty directory.
+ */
+
+VALUE
+rb_batch_unlink( VALUE self, VALUE path)
+{
+    batch_add( self, BOP_UNLINK, path, Qnil);
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+VALUE
+rb_batch_rmdir( VALUE self, VALUE path)
+{
+    batch_add( self, BOP_RMDIR, path, Qnil);
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+/*
+ *  call-seq:
+ *     batch.mkdir( path, mode = 0777)     -> int
+ *
+ *  Queue making a directory.
+ */
+
+VALUE
+rb_batch_mkdir( int argc, VALUE *argv, VALUE self)
+{
+    VALUE path, mode;
+    struct batch_op *o;
+    mode_t m;
+
+    rb_scan_args( argc, argv, "11", &path, &mode);
+    m = NIL_P( mode) ? 0777 : NUM2UINT( mode);
+    o = batch_add( self, BOP_MKDIR, path, Qnil);
+    o->mode = m;
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+/*
+ *  call-seq:
+ *     batch.rename( old, new)        -> int
+ *     batch.symlink( target, new)    -> int
+ *     batch.link( old, new)          -> int
+ *
+ *  Queue renaming a file or making a link.
+ */
+
+VALUE
+rb_batch_rename( VALUE self, VALUE from, VALUE to)
+{
+    batch_add( self, BOP_RENAME, from, to);
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+VALUE
+rb_batch_symlink( VALUE self, VALUE from, VALUE to)
+{
+    batch_add( self, BOP_SYMLINK, from, to);
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+VALUE
+rb_batch_link( VALUE self, VALUE from, VALUE to)
+{
+    batch_add( self, BOP_LINK, from, to);
+    return LONG2NUM( get_batch( self)->n - 1);
+}
+
+/*
+ *  call-seq:
+ *     batch.size     -> int
+ *
+ *  Number of calls queued.
+ */
+
+VALUE
+rb_batch_size( VALUE self)
+{
+    return LONG2NUM( get_batch( self)->n);
+}
+
+
+VALUE
+batch_run( VALUE self)
+{
+    struct batch *b;
+    VALUE r;
+    long i;
+    int state;
+
+    b = get_batch( self);
+    b->done = 1;
+    while (b->n > 0) {
+        supplement_pool_init( &b->pool, &batch_work, &batch_drop, b);
+        rb_thread_call_without_gvl( &batch_nogvl, b, &batch_ubf, b);
+        supplement_pool_destroy( &b->pool);
+        if (!b->pool.stop)
+            break;
+        /* Calls not reached stay pending and are run again. */
+        rb_protect( &batch_check_ints, Qnil, &state);
+        if (state) {
+            for (i = 0; i < b->n; i++)
+                if (b->ops[ i].op == BOP_OPEN && b->ops[ i].res >= 0)
+                    close( b->ops[ i].res);
+            rb_jump_tag( state);
+        }
+    }
+    r = rb_ary_new_capa( b->n);
+    for (i = 0; i < b->n; i++)
+        rb_ary_push( r, batch_result( b->ops + i));
+    return r;
+}
+
+VALUE
+batch_check_ints( VALUE v)
+{
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+/*
+ *  A single call is short and not interrupted.  An interrupt stops
+ *  further submissions; what is in flight is still collected.
+ */
+
+void *
+batch_nogvl( void *p)
+{
+    struct batch *b = p;
+    long i, left;
+    int n;
+
+    batch_uring( b);
+    for (left = 0, i = 0; !b->pool.stop && i < b->n; i++)
+        if (b->ops[ i].res == BATCH_PENDING) {
+            supplement_pool_push( &b->pool, &b->ops[ i].link);
+            left++;
+        }
+    if (left > 0) {
+        n = (int) sysconf( _SC_NPROCESSORS_ONLN);
+        supplement_pool_run( &b->pool, n > 0 && left > n ? n : (int) left);
+    }
+    return NULL;
+}
+
+void
+batch_ubf( void *p)
+{
+    supplement_pool_stop( &((struct batch *) p)->pool);
+}
+
+int
+batch_ring_init( struct batch_ring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    /*
+     * Without SUBMIT_ALL (before Linux 5.18), submission stops at an
+     * entry that fails early, e.g. for a bad path.
+     */
+    memset( &p, 0, sizeof p);
+    p.flags = IORING_SETUP_SUBMIT_ALL;
+    r->fd = (int) syscall( __NR_io_uring_setup, entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset( &p, 0, sizeof p);
+        r->fd = (int) syscall( __NR_io_uring_setup, entries, &p);
+    }
+    if (r->fd < 0)
+        return -1;
+    r->entries = p.sq_entries;
+    r->ext_arg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    r->sqlen = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    r->cqlen = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqlen > r->sqlen)
+            r->sqlen = r->cqlen;
+        r->cqlen = 0;
+    }
+    r->sqeslen = p.sq_entries * sizeof (struct io_uring_sqe);
+    r->sq = mmap( NULL, r->sqlen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq = r->sqes = MAP_FAILED;
+    if (r->sq != MAP_FAILED)
+        r->cq = r->cqlen == 0 ? r->sq :
+                mmap( NULL, r->cqlen, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq != MAP_FAILED)
+        r->sqes = mmap( NULL, r->sqeslen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        batch_ring_close( r);
+        return -1;
+    }
+    r->sq_head  = (unsigned int *) ((char *) r->sq + p.sq_off.head);
+    r->sq_tail  = (unsigned int *) ((char *) r->sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned int *) ((char *) r->sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *) ((char *) r->sq + p.sq_off.array);
+    r->cq_head  = (unsigned int *) ((char *) r->cq + p.cq_off.head);
+    r->cq_tail  = (unsigned int *) ((char *) r->cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned int *) ((char *) r->cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq + p.cq_off.cqes);
+    return 0;
+}
+
+void
+batch_ring_close( struct batch_ring *r)
+{
+    if (r->sqes != MAP_FAILED)
+        munmap( r->sqes, r->sqeslen);
+    if (r->cq != MAP_FAILED && r->cq != r->sq)
+        munmap( r->cq, r->cqlen);
+    if (r->sq != MAP_FAILED)
+        munmap( r->sq, r->sqlen);
+    close( r->fd);
+}
+
+/*
+ *  Submit everything the kernel supports, a ring full at a time.
+ *  Operations left pending are for the threads.  The return value of
+ *  io_uring_enter() is the number of entries consumed; the rest is
+ *  submitted again.
+ */
+
+int
+batch_uring( struct batch *b)
+{
+    struct batch_ring r;
+    struct io_uring_probe *probe;
+    struct io_uring_cqe *cqe;
+    unsigned char ok[ BOP_COUNT];
+    unsigned int entries, tail, head, idx, sent, sub, got;
+    long i, j;
+    int k, some;
+
+    for (entries = 1; entries < BATCH_RING && entries < b->n; entries *= 2)
+        ;
+    if (batch_ring_init( &r, entries) < 0)
+        return -1;
+
+    probe = calloc( 1, sizeof *probe + 256 * sizeof (struct io_uring_probe_op));
+    if (probe == NULL ||
+            syscall( __NR_io_uring_register, r.fd, IORING_REGISTER_PROBE,
+                     probe, 256) < 0) {
+        free( probe);
+        batch_ring_close( &r);
+        return -1;
+    }
+    for (some = 0, k = 0; k < BOP_COUNT; k++) {
+        ok[ k] = batch_uring_ops[ k] <= probe->last_op &&
+                (probe->ops[ batch_uring_ops[ k]].flags & IO_URING_OP_SUPPORTED);
+        some |= ok[ k];
+    }
+    free( probe);
+
+    for (i = 0; some && i < b->n && !b->pool.stop;) {
+        tail = *r.sq_tail;
+        for (sent = 0; sent < r.entries && i < b->n; i++) {
+            if (!ok[ b->ops[ i].op] || b->ops[ i].res != BATCH_PENDING)
+                continue;
+            idx = tail & *r.sq_mask;
+            batch_prep( b->ops + i, r.sqes + idx, i);
+            r.sq_array[ idx] = idx;
+            tail++, sent++;
+        }
+        __atomic_store_n( r.sq_tail, tail, __ATOMIC_RELEASE);
+        for (sub = got = 0; got < sub || (sub < sent && !b->pool.stop);) {
+            if (sub < sent && !b->pool.stop) {
+                k = (int) syscall( __NR_io_uring_enter, r.fd, sent - sub, 0,
+                                   0, NULL, 0);
+                if (k > 0)
+                    sub += k;
+                else if (got == sub && (k == 0 || errno != EINTR)) {
+                    /* Nothing goes in; leave the rest to the threads. */
+                    i = b->n;
+                    break;
+                }
+            } else
+                k = batch_uring_wait( &r);
+            if (k < 0 && errno != EINTR && errno != EAGAIN &&
+                    errno != EBUSY && errno != ETIME) {
+                /* What didn't come back is unknown; give up on it. */
+                for (j = 0; j < i; j++)
+                    if (b->ops[ j].res == BATCH_PENDING && ok[ b->ops[ j].op])
+                        b->ops[ j].res = -errno;
+                batch_ring_close( &r);
+                return -1;
+            }
+            head = *r.cq_head;
+            while (head != __atomic_load_n( r.cq_tail, __ATOMIC_ACQUIRE)) {
+                cqe = r.cqes + (head & *r.cq_mask);
+                b->ops[ cqe->user_data].res = cqe->res;
+                head++, got++;
+            }
+            __atomic_store_n( r.cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    batch_ring_close( &r);
+    return 0;
+}
+
+/*
+ *  Wait for a completion, but not so long that an interrupt would go
+ *  unnoticed.
+ */
+
+int
+batch_uring_wait( struct batch_ring *r)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+
+    if (!r->ext_arg)
+        return (int) syscall( __NR_io_uring_enter, r->fd, 0, 1,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+    memset( &arg, 0, sizeof arg);
+    ts.tv_sec = 0;
+    ts.tv_nsec = BATCH_WAIT;
+    arg.ts = (unsigned long) &ts;
+    return (int) syscall( __NR_io_uring_enter, r->fd, 0, 1,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof arg);
+}
+
+void
+batch_prep( struct batch_op *o, struct io_uring_sqe *sqe, long i)
+{
+    memset( sqe, 0, sizeof *sqe);
+    sqe->opcode = batch_uring_ops[ o->op];
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) o->path;
+    sqe->user_data = i;
+    switch (o->op) {
+      case BOP_STAT:
+      case BOP_LSTAT:
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (unsigned long) &o->stx;
+        sqe->statx_flags = o->op == BOP_LSTAT ? AT_SYMLINK_NOFOLLOW : 0;
+        break;
+      case BOP_OPEN:
+        sqe->len = o->mode;
+        sqe->open_flags = o->flags;
+        break;
+      case BOP_RMDIR:
+        sqe->unlink_flags = AT_REMOVEDIR;
+        break;
+      case BOP_MKDIR:
+        sqe->len = o->mode;
+        break;
+      case BOP_RENAME:
+      case BOP_LINK:
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (unsigned long) o->path2;
+        break;
+      case BOP_SYMLINK:
+        sqe->addr2 = (unsigned long) o->path2;
+        break;
+    }
+}
+
+void
+batch_work( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    struct batch_op *o = (struct batch_op *) j;
+    int r = 0;
+
+    switch (o->op) {
+      case BOP_STAT:
+      case BOP_LSTAT:
+        r = statx( AT_FDCWD, o->path,
+                   o->op == BOP_LSTAT ? AT_SYMLINK_NOFOLLOW : 0,
+                   STATX_BASIC_STATS, &o->stx);
+        break;
+      case BOP_OPEN:    r = openat( AT_FDCWD, o->path, o->flags, o->mode); break;
+      case BOP_UNLINK:  r = unlinkat( AT_FDCWD, o->path, 0);               break;
+      case BOP_RMDIR:   r = unlinkat( AT_FDCWD, o->path, AT_REMOVEDIR);    break;
+      case BOP_MKDIR:   r = mkdirat( AT_FDCWD, o->path, o->mode);          break;
+      case BOP_RENAME:  r = renameat( AT_FDCWD, o->path, AT_FDCWD, o->path2); break;
+      case BOP_SYMLINK: r = symlinkat( o->path, AT_FDCWD, o->path2);       break;
+      case BOP_LINK:    r = linkat( AT_FDCWD, o->path, AT_FDCWD, o->path2, 0); break;
+    }
+    o->res = r < 0 ? -errno : r;
+}
+
+void
+batch_drop( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+}
+
+VALUE
+batch_result( struct batch_op *o)
+{
+    struct stat st;
+
+    if (o->res < 0)
+        return rb_syserr_new( -o->res, o->path);
+    switch (o->op) {
+      case BOP_STAT:
+      case BOP_LSTAT:
+        memset( &st, 0, sizeof st);
+        st.st_dev     = makedev( o->stx.stx_dev_major, o->stx.stx_dev_minor);
+        st.st_ino     = o->stx.stx_ino;
+        st.st_mode    = o->stx.stx_mode;
+        st.st_nlink   = o->stx.stx_nlink;
+        st.st_uid     = o->stx.stx_uid;
+        st.st_gid     = o->stx.stx_gid;
+        st.st_rdev    = makedev( o->stx.stx_rdev_major, o->stx.stx_rdev_minor);
+        st.st_size    = o->stx.stx_size;
+        st.st_blksize = o->stx.stx_blksize;
+        st.st_blocks  = o->stx.stx_blocks;
+        st.st_atim.tv_sec  = o->stx.stx_atime.tv_sec;
+        st.st_atim.tv_nsec = o->stx.stx_atime.tv_nsec;
+        st.st_mtim.tv_sec  = o->stx.stx_mtime.tv_sec;
+        st.st_mtim.tv_nsec = o->stx.stx_mtime.tv_nsec;
+        st.st_ctim.tv_sec  = o->stx.stx_ctime.tv_sec;
+        st.st_ctim.tv_nsec = o->stx.stx_ctime.tv_nsec;
+        return rb_stat_new( &st);
+      case BOP_OPEN:
+        return rb_io_fdopen( o->res, o->flags, o->path);
+      default:
+        return INT2FIX( 0);
+    }
+}
+
+
+void Init_batch( void)
+{
+    rb_define_singleton_method( rb_cFile, "batch", rb_file_s_batch, 0);
+
+    rb_cFileBatch = rb_define_class_under( rb_cFile, "Batch", rb_cObject);
+    rb_undef_alloc_func( rb_cFileBatch);
+    rb_define_method( rb_cFileBatch, "stat", rb_batch_stat, 1);
+    rb_define_method( rb_cFileBatch, "lstat", rb_batch_lstat, 1);
+    rb_define_method( rb_cFileBatch, "open", rb_batch_open, -1);
+    rb_define_method( rb_cFileBatch, "unlink", rb_batch_unlink, 1);
+    rb_define_method( rb_cFileBatch, "rmdir", rb_batch_rmdir, 1);
+    rb_define_method( rb_cFileBatch, "mkdir", rb_batch_mkdir, -1);
+    rb_define_method( rb_cFileBatch, "rename", rb_batch_rename, 2);
+    rb_define_method( rb_cFileBatch, "symlink", rb_batch_symlink, 2);
+    rb_define_method( rb_cFileBatch, "link", rb_batch_link, 2);
+    rb_define_method( rb_cFileBatch, "size", rb_batch_size, 0);
+}
+
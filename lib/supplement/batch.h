@@ -0,0 +1,27 @@
+/*
+ *  supplement/batch.h  --  Batched file system calls
+ */
+
+#ifndef __SUPPLEMENT_BATCH_H__
+#define __SUPPLEMENT_BATCH_H__
+
+#include <ruby/ruby.h>
+
+
+extern VALUE rb_file_s_batch( VALUE);
+
+extern VALUE rb_batch_stat( VALUE, VALUE);
+extern VALUE rb_batch_lstat( VALUE, VALUE);
+extern VALUE rb_batch_open( int, VALUE *, VALUE);
+extern VALUE rb_batch_unlink( VALUE, VALUE);
+extern VALUE rb_batch_rmdir( VALUE, VALUE);
+extern VALUE rb_batch_mkdir( int, VALUE *, VALUE);
+extern VALUE rb_batch_rename( VALUE, VALUE, VALUE);
+extern VALUE rb_batch_symlink( VALUE, VALUE, VALUE);
+extern VALUE rb_batch_link( VALUE, VALUE, VALUE);
+extern VALUE rb_batch_size( VALUE);
+
+extern void Init_batch( void);
+
+#endif
+
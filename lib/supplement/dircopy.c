@@ -0,0 +1,525 @@
+/*
+ *  supplement/dircopy.c  --  Copy directory trees
+ */
+
+#include "dirtree.h"
+
+#include "pool.h"
+#include "../mkpath.h"
+
+#include <ruby/thread.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define COPY_OPEN  (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#define COPY_BUF   (1024 * 1024)
+
+#ifndef FICLONE
+    #define FICLONE  _IOW( 0x94, 9, int)
+#endif
+
+
+struct copy {
+    struct supplement_pool pool;
+    const char *src, *dst;
+    int         srcfd, dstfd;
+    int         threads;
+    int         err;
+    char        errpath[ PATH_MAX];
+};
+
+/*
+ *  A directory's job counts its own work, its files and its
+ *  subdirectories.  When that drops to zero the directory gets its
+ *  mode and times, so that copying into it doesn't change them again.
+ */
+
+struct copy_job {
+    struct supplement_pool_job  link;
+    struct copy_job            *parent;
+    int                         pending;
+    struct stat                 st;
+    char                        path[];
+};
+
+static void *copy_nogvl( void *);
+static void  copy_ubf( void *);
+static void  copy_fail( struct copy *, int, const char *, const char *);
+static int   copy_inside( char *, const struct stat *);
+static int   copy_spawn( struct copy *, struct copy_job *, const char *,
+                                                        struct stat *);
+static void  copy_work( struct supplement_pool *, struct supplement_pool_job *);
+static void  copy_drop( struct supplement_pool *, struct supplement_pool_job *);
+static void  copy_dir( struct copy *, struct copy_job *);
+static void  copy_entry( struct copy *, struct copy_job *);
+static int   copy_temp( struct copy *, const char *, char *);
+static int   copy_data( int, int, off_t);
+static void  copy_job_done( struct copy *, struct copy_job *);
+
+static int copy_serial = 0;
+
+static ID id_threads = 0;
+
+
+/*
+ *  Document-class: Dir
+ */
+
+/*
+ *  call-seq:
+ *     Dir.copy_tree( src, dst, threads: nil)     -> nil
+ *
+ *  Copy a directory tree.  +dst+ and its parents are created if
+ *  necessary; existing files in it are overwritten.  +dst+ must not
+ *  lie inside +src+.
+ *
+ *  File contents are shared with the source where the file system
+ *  supports it (reflinks), otherwise copied in the kernel, and only as
+ *  a last resort read and written.  Modes and modification times are
+ *  preserved, symbolic links are copied as links.  Hard links are
+ *  not preserved, devices and sockets are skipped.
+ *
+ *  Other Ruby threads keep running meanwhile.  With <code>threads:
+ *  n</code> files are copied by +n+ native threads in parallel; +true+
+ *  means one thread per processor.
+ *
+ *     Dir.copy_tree "releases/current", "staging/next", threads: true
+ */
+
+VALUE
+rb_dir_s_copy_tree( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE src, dst, opts;
+    struct copy c;
+
+    rb_scan_args( argc, argv, "2:", &src, &dst, &opts);
+    FilePathValue( src);
+    FilePathValue( dst);
+    c.threads = supplement_pool_threads(
+                NIL_P( opts) ? Qnil : rb_hash_aref( opts, ID2SYM( id_threads)));
+    c.src = RSTRING_PTR( src);
+    c.dst = RSTRING_PTR( dst);
+    for (;;) {
+        supplement_pool_init( &c.pool, &copy_work, &copy_drop, &c);
+        c.err = 0;
+        rb_thread_call_without_gvl( &copy_nogvl, &c, &copy_ubf, &c);
+        supplement_pool_destroy( &c.pool);
+        if (c.err)
+            rb_syserr_fail_str( c.err, rb_str_new_cstr( c.errpath));
+        if (!c.pool.stop)
+            break;
+        rb_thread_check_ints();
+    }
+    RB_GC_GUARD( src);
+    RB_GC_GUARD( dst);
+    return Qnil;
+}
+
+void *
+copy_nogvl( void *p)
+{
+    struct copy *c = p;
+    char path[ PATH_MAX];
+    struct stat st;
+
+    c->srcfd = open( c->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (c->srcfd < 0 || fstat( c->srcfd, &st) < 0) {
+        copy_fail( c, errno, c->src, "");
+        if (c->srcfd >= 0)
+            close( c->srcfd);
+        return NULL;
+    }
+    if (strlen( c->dst) >= PATH_MAX) {
+        copy_fail( c, ENAMETOOLONG, c->dst, "");
+        close( c->srcfd);
+        return NULL;
+    }
+    strcpy( path, c->dst);
+    if (copy_inside( path, &st)) {
+        copy_fail( c, EINVAL, c->dst, "");
+        close( c->srcfd);
+        return NULL;
+    }
+    strcpy( path, c->dst);
+    if (supplement_mkpath( path, 0777, 0, NULL) < 0) {
+        copy_fail( c, errno, path, "");
+        close( c->srcfd);
+        return NULL;
+    }
+    c->dstfd = open( c->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (c->dstfd < 0)
+        copy_fail( c, errno, c->dst, "");
+    else {
+        if (copy_spawn( c, NULL, "", &st) == 0)
+            supplement_pool_run( &c->pool, c->threads);
+        close( c->dstfd);
+    }
+    close( c->srcfd);
+    return NULL;
+}
+
+/*
+ *  Whether +path+ or its nearest existing ancestor lies within the
+ *  directory +src+.  Walks up by "..", so symbolic links and bind
+ *  mounts don't fool it.  +path+ is overwritten.
+ */
+
+int
+copy_inside( char *path, const struct stat *src)
+{
+    struct stat st, up;
+    char *s;
+    int fd, ufd, r = 0;
+
+    for (;;) {
+        fd = open( *path ? path : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+            break;
+        s = strrchr( path, '/');
+        if (s == NULL) {
+            fd = open( ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            break;
+        }
+        *s = '\0';
+    }
+    if (fd < 0 || fstat( fd, &st) < 0)
+        goto out;
+    for (;;) {
+        if (st.st_dev == src->st_dev && st.st_ino == src->st_ino) {
+            r = 1;
+            break;
+        }
+        ufd = openat( fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (ufd < 0 || fstat( ufd, &up) < 0) {
+            if (ufd >= 0)
+                close( ufd);
+            break;
+        }
+        close( fd);
+        fd = ufd;
+        if (up.st_dev == st.st_dev && up.st_ino == st.st_ino)
+            break;
+        st = up;
+    }
+out:
+    if (fd >= 0)
+        close( fd);
+    return r;
+}
+
+void
+copy_ubf( void *p)
+{
+    supplement_pool_stop( &((struct copy *) p)->pool);
+}
+
+void
+copy_fail( struct copy *c, int err, const char *root, const char *rel)
+{
+    pthread_mutex_lock( &c->pool.mutex);
+    if (!c->err) {
+        c->err = err;
+        snprintf( c->errpath, PATH_MAX, *rel ? "%s/%s" : "%s", root, rel);
+    }
+    pthread_mutex_unlock( &c->pool.mutex);
+    supplement_pool_stop( &c->pool);
+}
+
+int
+copy_spawn( struct copy *c, struct copy_job *parent, const char *path,
+                                                        struct stat *st)
+{
+    struct copy_job *job;
+    size_t l;
+
+    l = strlen( path);
+    job = malloc( sizeof (struct copy_job) + l + 1);
+    if (job == NULL) {
+        copy_fail( c, errno, c->src, path);
+        return -1;
+    }
+    job->parent = parent;
+    job->pending = 1;
+    job->st = *st;
+    memcpy( job->path, path, l + 1);
+    if (parent != NULL)
+        __atomic_add_fetch( &parent->pending, 1, __ATOMIC_ACQ_REL);
+    supplement_pool_push( &c->pool, &job->link);
+    return 0;
+}
+
+void
+copy_work( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    struct copy *c = pool->arg;
+    struct copy_job *job = (struct copy_job *) j;
+
+    if (S_ISDIR( job->st.st_mode))
+        copy_dir( c, job);
+    else
+        copy_entry( c, job);
+    copy_job_done( c, job);
+}
+
+void
+copy_drop( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    copy_job_done( pool->arg, (struct copy_job *) j);
+}
+
+/*
+ *  The destination directory of a job already exists.  It is kept
+ *  writable until it is complete, even when it was there before.
+ *  Subdirectories are created here, before their jobs are queued.
+ */
+
+void
+copy_dir( struct copy *c, struct copy_job *job)
+{
+    char path[ PATH_MAX];
+    struct dirent *e;
+    struct stat st;
+    size_t len, l;
+    DIR *d;
+    int fd;
+
+    len = strlen( job->path);
+    memcpy( path, job->path, len + 1);
+    fchmodat( c->dstfd, len ? path : ".", S_IRWXU, 0);
+    fd = openat( c->srcfd, len ? path : ".", COPY_OPEN);
+    if (fd < 0 || (d = fdopendir( fd)) == NULL) {
+        copy_fail( c, errno, c->src, path);
+        if (fd >= 0)
+            close( fd);
+        return;
+    }
+    while (!c->pool.stop) {
+        errno = 0;
+        e = readdir( d);
+        if (e == NULL) {
+            if (errno)
+                copy_fail( c, errno, c->src, path);
+            break;
+        }
+        if (e->d_name[ 0] == '.' && (e->d_name[ 1] == '\0' ||
+                    (e->d_name[ 1] == '.' && e->d_name[ 2] == '\0')))
+            continue;
+        l = len + strlen( e->d_name) + 2;
+        if (l > PATH_MAX) {
+            copy_fail( c, ENAMETOOLONG, c->src, path);
+            break;
+        }
+        if (len > 0)
+            path[ len] = '/';
+        strcpy( path + len + (len > 0), e->d_name);
+        if (fstatat( fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            if (errno != ENOENT) {
+                copy_fail( c, errno, c->src, path);
+                break;
+            }
+        } else if (S_ISDIR( st.st_mode)) {
+            if (mkdirat( c->dstfd, path, S_IRWXU) < 0 && errno != EEXIST) {
+                copy_fail( c, errno, c->dst, path);
+                break;
+            }
+            if (copy_spawn( c, job, path, &st) < 0)
+                break;
+        } else if (S_ISREG( st.st_mode) || S_ISLNK( st.st_mode) ||
+                                                    S_ISFIFO( st.st_mode)) {
+            if (copy_spawn( c, job, path, &st) < 0)
+                break;
+        }
+        path[ len] = '\0';
+    }
+    closedir( d);
+}
+
+void
+copy_entry( struct copy *c, struct copy_job *job)
+{
+    struct timespec ts[ 2];
+    char target[ PATH_MAX];
+    char tmp[ PATH_MAX];
+    ssize_t l;
+    int sfd, dfd;
+
+    ts[ 0] = job->st.st_atim;
+    ts[ 1] = job->st.st_mtim;
+    if (S_ISLNK( job->st.st_mode)) {
+        l = readlinkat( c->srcfd, job->path, target, sizeof target - 1);
+        if (l < 0) {
+            copy_fail( c, errno, c->src, job->path);
+            return;
+        }
+        target[ l] = '\0';
+        if (symlinkat( target, c->dstfd, job->path) < 0) {
+            if (errno != EEXIST || unlinkat( c->dstfd, job->path, 0) < 0 ||
+                    symlinkat( target, c->dstfd, job->path) < 0) {
+                copy_fail( c, errno, c->dst, job->path);
+                return;
+            }
+        }
+        utimensat( c->dstfd, job->path, ts, AT_SYMLINK_NOFOLLOW);
+        return;
+    }
+    if (S_ISFIFO( job->st.st_mode)) {
+        if (mkfifoat( c->dstfd, job->path, job->st.st_mode & 07777) < 0 &&
+                                                            errno != EEXIST)
+            copy_fail( c, errno, c->dst, job->path);
+        else
+            utimensat( c->dstfd, job->path, ts, AT_SYMLINK_NOFOLLOW);
+        return;
+    }
+
+    sfd = openat( c->srcfd, job->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (sfd < 0) {
+        if (errno != ENOENT)
+            copy_fail( c, errno, c->src, job->path);
+        return;
+    }
+    dfd = copy_temp( c, job->path, tmp);
+    if (dfd < 0)
+        copy_fail( c, errno, c->dst, job->path);
+    else {
+        if (copy_data( sfd, dfd, job->st.st_size) < 0 ||
+                fchmod( dfd, job->st.st_mode & 07777) < 0 ||
+                futimens( dfd, ts) < 0 ||
+                renameat( c->dstfd, tmp, c->dstfd, job->path) < 0) {
+            copy_fail( c, errno, c->dst, job->path);
+            unlinkat( c->dstfd, tmp, 0);
+        }
+        close( dfd);
+    }
+    close( sfd);
+}
+
+/*
+ *  Files are written under a temporary name next to the destination and
+ *  renamed over it at last.  Truncating an existing file in place would
+ *  fail when it is read-only, and would destroy the source if both are
+ *  hard links to the same inode.
+ */
+
+int
+copy_temp( struct copy *c, const char *path, char *tmp)
+{
+    const char *base;
+    int i, fd;
+
+    base = strrchr( path, '/');
+    base = base != NULL ? base + 1 : path;
+    for (i = 0; i < 100; i++) {
+        if (snprintf( tmp, PATH_MAX, "%.*s.copy.%ld.%d",
+                    (int) (base - path), path, (long) getpid(),
+                    __atomic_add_fetch( &copy_serial, 1, __ATOMIC_RELAXED))
+                >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        fd = openat( c->dstfd, tmp,
+                O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+    }
+    return -1;
+}
+
+/*
+ *  Reflink, else copy_file_range(), else read() and write().
+ */
+
+int
+copy_data( int sfd, int dfd, off_t size)
+{
+    char *buf;
+    ssize_t n, w, o;
+
+    if (ioctl( dfd, FICLONE, sfd) == 0)
+        return 0;
+    while (size > 0) {
+        n = copy_file_range( sfd, NULL, dfd, NULL,
+                        size > 0x40000000 ? 0x40000000 : (size_t) size, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP || errno == EBADF)
+                break;
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        size -= n;
+    }
+    if (size <= 0)
+        return 0;
+
+    buf = malloc( COPY_BUF);
+    if (buf == NULL)
+        return -1;
+    for (;;) {
+        n = read( sfd, buf, COPY_BUF);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (o = 0; o < n; o += w) {
+            w = write( dfd, buf + o, n - o);
+            if (w < 0 && errno == EINTR)
+                w = 0;
+            else if (w < 0) {
+                n = -1;
+                break;
+            }
+        }
+        if (n < 0)
+            break;
+    }
+    free( buf);
+    return n < 0 ? -1 : 0;
+}
+
+void
+copy_job_done( struct copy *c, struct copy_job *job)
+{
+    struct timespec ts[ 2];
+    struct copy_job *p;
+    const char *path;
+
+    while (job != NULL &&
+            __atomic_sub_fetch( &job->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        p = job->parent;
+        if (S_ISDIR( job->st.st_mode) && !c->pool.stop) {
+            path = *job->path ? job->path : ".";
+            ts[ 0] = job->st.st_atim;
+            ts[ 1] = job->st.st_mtim;
+            if (fchmodat( c->dstfd, path, job->st.st_mode & 07777, 0) < 0 ||
+                    utimensat( c->dstfd, path, ts, 0) < 0)
+                copy_fail( c, errno, c->dst, job->path);
+        }
+        free( job);
+        job = p;
+    }
+}
+
+
+void Init_dircopy( void)
+{
+    rb_define_singleton_method( rb_cDir, "copy_tree", rb_dir_s_copy_tree, -1);
+
+    id_threads = rb_intern( "threads");
+}
+
@@ -0,0 +1,668 @@
+/*
+ *  supplement/dirdigest.c  --  Content digests of directory trees
+ */
+
+#include "dirtree.h"
+
+#include "pool.h"
+#include "hashes.h"
+
+#include <ruby/thread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define DIG_OPEN  (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#define DIG_BUF   (1024 * 1024)
+
+enum dig_algo {
+    DIG_SHA256,
+    DIG_XXH64
+};
+
+struct dig_entry {
+    struct dig_entry *parent;
+    size_t            idx;
+    int               depth;
+    char              type;          /* 'd', 'f' or 'l' */
+    uint64_t          ino, size;
+    int64_t           mtime;         /* nanoseconds */
+    unsigned char     md[ 32];
+    size_t            name;          /* offset in path */
+    char              path[];
+};
+
+struct dig_cached {
+    uint64_t      ino, size;
+    int64_t       mtime;
+    unsigned char md[ 32];
+};
+
+struct dig {
+    struct supplement_pool pool;
+    const char        *root;
+    const char        *cache;
+    int                rootfd;
+    int                threads;
+    int                algo;
+    size_t             mdlen;
+    struct dig_entry **ent;          /* guarded by the pool's mutex */
+    size_t             n, capa;
+    struct dig_cached *cached;       /* read-only while the pool runs */
+    size_t             cmask;
+    int                err;
+    char               errpath[ PATH_MAX];
+};
+
+struct dig_job {
+    struct supplement_pool_job link;
+    struct dig_entry          *e;
+};
+
+union dig_ctx {
+    struct supplement_sha256 sha256;
+    struct supplement_xxh64  xxh64;
+};
+
+static void *dig_nogvl( void *);
+static void  dig_ubf( void *);
+static void  dig_fail( struct dig *, int, const char *);
+static struct dig_entry *dig_add( struct dig *, struct dig_entry *,
+                                  const char *, struct stat *);
+static int   dig_spawn( struct dig *, struct dig_entry *);
+static void  dig_work( struct supplement_pool *, struct supplement_pool_job *);
+static void  dig_dir( struct dig *, struct dig_entry *);
+static void  dig_file( struct dig *, struct dig_entry *);
+static void  dig_init( struct dig *, union dig_ctx *);
+static void  dig_update( struct dig *, union dig_ctx *, const void *, size_t);
+static void  dig_final( struct dig *, union dig_ctx *, unsigned char *);
+static int   dig_merkle( struct dig *);
+static int   dig_by_parent( const void *, const void *);
+static int   dig_by_depth( const void *, const void *);
+static void  dig_cache_load( struct dig *);
+static int   dig_cache_save( struct dig *);
+static struct dig_cached *dig_cache_find( struct dig *, uint64_t);
+static VALUE dig_hex( struct dig *, const unsigned char *);
+static void  dig_free( struct dig *);
+
+static const char *dig_names[] = { "sha256", "xxh64" };
+
+static ID id_algo = 0;
+static ID id_threads = 0;
+static ID id_cache = 0;
+
+
+/*
+ *  Document-class: Dir
+ */
+
+/*
+ *  call-seq:
+ *     Dir.digest_tree( name, algo: :sha256, threads: nil, cache: nil)   -> [ digest, files]
+ *
+ *  Compute a digest of a directory tree's contents.  +files+ is a Hash
+ *  of the digests of the files and symbolic links by their path
+ *  relative to +name+; +digest+ covers all of them together with the
+ *  names and the structure of the tree (a Merkle tree).  Digests are
+ *  hex strings.  Modes and times don't matter; empty directories do.
+ *
+ *  +algo+ is <code>:sha256</code> or <code>:xxh64</code> (faster, not
+ *  cryptographic).
+ *
+ *  If +cache+ is the name of a file, files whose inode, modification
+ *  time and size are found there won't be read again.  The file is
+ *  rewritten afterwards.
+ *
+ *  Other Ruby threads keep running meanwhile.  With <code>threads:
+ *  n</code> files are read by +n+ native threads in parallel; +true+
+ *  means one thread per processor.
+ *
+ *     digest, files = Dir.digest_tree "public/assets", algo: :xxh64,
+ *                                cache: "tmp/assets.digests", threads: true
+ */
+
+VALUE
+rb_dir_s_digest_tree( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE name, opts, algo, cache, files;
+    struct dig d;
+    size_t i;
+
+    rb_scan_args( argc, argv, "1:", &name, &opts);
+    FilePathValue( name);
+    MEMZERO( &d, struct dig, 1);
+    d.root = RSTRING_PTR( name);
+    d.algo = DIG_SHA256;
+    cache = Qnil;
+    d.threads = supplement_pool_threads(
+                NIL_P( opts) ? Qnil : rb_hash_aref( opts, ID2SYM( id_threads)));
+    if (!NIL_P( opts)) {
+        algo = rb_hash_aref( opts, ID2SYM( id_algo));
+        if (!NIL_P( algo)) {
+            for (i = 0; i < sizeof dig_names / sizeof *dig_names; i++)
+                if (SYM2ID( rb_to_symbol( algo)) == rb_intern( dig_names[ i]))
+                    break;
+            if (i == sizeof dig_names / sizeof *dig_names)
+                rb_raise( rb_eArgError, "unknown digest algorithm: %"PRIsVALUE,
+                                                                        algo);
+            d.algo = (int) i;
+        }
+        cache = rb_hash_aref( opts, ID2SYM( id_cache));
+        if (!NIL_P( cache)) {
+            FilePathValue( cache);
+            d.cache = RSTRING_PTR( cache);
+        }
+    }
+    d.mdlen = d.algo == DIG_SHA256 ? 32 : 8;
+
+    for (;;) {
+        supplement_pool_init( &d.pool, &dig_work, NULL, &d);
+        d.err = 0;
+        rb_thread_call_without_gvl( &dig_nogvl, &d, &dig_ubf, &d);
+        supplement_pool_destroy( &d.pool);
+        if (d.err) {
+            dig_free( &d);
+            rb_syserr_fail_str( d.err, rb_str_new_cstr( d.errpath));
+        }
+        if (!d.pool.stop)
+            break;
+        dig_free( &d);
+        rb_thread_check_ints();
+    }
+
+    files = rb_hash_new();
+    for (i = 1; i < d.n; i++)
+        if (d.ent[ i]->type != 'd')
+            rb_hash_aset( files, rb_str_new_cstr( d.ent[ i]->path),
+                                 dig_hex( &d, d.ent[ i]->md));
+    name = rb_assoc_new( dig_hex( &d, d.ent[ 0]->md), files);
+    dig_free( &d);
+    RB_GC_GUARD( cache);
+    return name;
+}
+
+void *
+dig_nogvl( void *p)
+{
+    struct dig *d = p;
+    struct dig_entry *root;
+    struct stat st;
+
+    if (d->cache != NULL)
+        dig_cache_load( d);
+    d->rootfd = open( d->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d->rootfd < 0 || fstat( d->rootfd, &st) < 0) {
+        dig_fail( d, errno, "");
+        if (d->rootfd >= 0)
+            close( d->rootfd);
+        return NULL;
+    }
+    root = dig_add( d, NULL, "", &st);
+    if (root != NULL && dig_spawn( d, root) == 0)
+        supplement_pool_run( &d->pool, d->threads);
+    close( d->rootfd);
+    if (d->err || d->pool.stop)
+        return NULL;
+    if (dig_merkle( d) < 0)
+        dig_fail( d, errno, "");
+    else if (d->cache != NULL && dig_cache_save( d) < 0) {
+        d->root = d->cache;
+        dig_fail( d, errno, "");
+    }
+    return NULL;
+}
+
+void
+dig_ubf( void *p)
+{
+    supplement_pool_stop( &((struct dig *) p)->pool);
+}
+
+void
+dig_fail( struct dig *d, int err, const char *path)
+{
+    pthread_mutex_lock( &d->pool.mutex);
+    if (!d->err) {
+        d->err = err;
+        snprintf( d->errpath, PATH_MAX, *path ? "%s/%s" : "%s", d->root, path);
+    }
+    pthread_mutex_unlock( &d->pool.mutex);
+    supplement_pool_stop( &d->pool);
+}
+
+struct dig_entry *
+dig_add( struct dig *d, struct dig_entry *parent, const char *name,
+                                                        struct stat *st)
+{
+    struct dig_entry *e, **n;
+    size_t pl, l;
+
+    pl = parent != NULL && *parent->path ? strlen( parent->path) + 1 : 0;
+    l = strlen( name);
+    e = malloc( sizeof (struct dig_entry) + pl + l + 1);
+    if (e == NULL) {
+        dig_fail( d, errno, name);
+        return NULL;
+    }
+    e->parent = parent;
+    e->depth = parent != NULL ? parent->depth + 1 : 0;
+    e->type = S_ISDIR( st->st_mode) ? 'd' : S_ISLNK( st->st_mode) ? 'l' : 'f';
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    if (pl > 0) {
+        memcpy( e->path, parent->path, pl - 1);
+        e->path[ pl - 1] = '/';
+    }
+    memcpy( e->path + pl, name, l + 1);
+    e->name = pl;
+
+    pthread_mutex_lock( &d->pool.mutex);
+    if (d->n == d->capa) {
+        n = realloc( d->ent, (d->capa ? d->capa * 2 : 1024) * sizeof *n);
+        if (n == NULL) {
+            pthread_mutex_unlock( &d->pool.mutex);
+            free( e);
+            dig_fail( d, ENOMEM, name);
+            return NULL;
+        }
+        d->ent = n;
+        d->capa = d->capa ? d->capa * 2 : 1024;
+    }
+    e->idx = d->n;
+    d->ent[ d->n++] = e;
+    pthread_mutex_unlock( &d->pool.mutex);
+    return e;
+}
+
+int
+dig_spawn( struct dig *d, struct dig_entry *e)
+{
+    struct dig_job *job;
+
+    job = malloc( sizeof (struct dig_job));
+    if (job == NULL) {
+        dig_fail( d, errno, e->path);
+        return -1;
+    }
+    job->e = e;
+    supplement_pool_push( &d->pool, &job->link);
+    return 0;
+}
+
+void
+dig_work( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    struct dig *d = pool->arg;
+    struct dig_entry *e = ((struct dig_job *) j)->e;
+
+    free( j);
+    if (e->type == 'd')
+        dig_dir( d, e);
+    else
+        dig_file( d, e);
+}
+
+/*
+ *  List a directory.  Files that aren't in the cache become jobs.
+ */
+
+void
+dig_dir( struct dig *d, struct dig_entry *e)
+{
+    struct dig_entry *c;
+    struct dig_cached *k;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int fd;
+
+    fd = openat( d->rootfd, *e->path ? e->path : ".", DIG_OPEN);
+    if (fd < 0 || (dir = fdopendir( fd)) == NULL) {
+        dig_fail( d, errno, e->path);
+        if (fd >= 0)
+            close( fd);
+        return;
+    }
+    while (!d->pool.stop) {
+        errno = 0;
+        de = readdir( dir);
+        if (de == NULL) {
+            if (errno)
+                dig_fail( d, errno, e->path);
+            break;
+        }
+        if (de->d_name[ 0] == '.' && (de->d_name[ 1] == '\0' ||
+                    (de->d_name[ 1] == '.' && de->d_name[ 2] == '\0')))
+            continue;
+        if (fstatat( fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            if (errno == ENOENT)
+                continue;
+            dig_fail( d, errno, e->path);
+            break;
+        }
+        if (!S_ISDIR( st.st_mode) && !S_ISREG( st.st_mode) &&
+                                            !S_ISLNK( st.st_mode))
+            continue;
+        c = dig_add( d, e, de->d_name, &st);
+        if (c == NULL)
+            break;
+        if (c->type == 'f' && (k = dig_cache_find( d, c->ino)) != NULL &&
+                k->size == c->size && k->mtime == c->mtime) {
+            memcpy( c->md, k->md, d->mdlen);
+            continue;
+        }
+        if (dig_spawn( d, c) < 0)
+            break;
+    }
+    closedir( dir);
+}
+
+void
+dig_file( struct dig *d, struct dig_entry *e)
+{
+    union dig_ctx ctx;
+    char target[ PATH_MAX];
+    char *buf;
+    size_t l;
+    ssize_t n;
+    int fd;
+
+    dig_init( d, &ctx);
+    if (e->type == 'l') {
+        n = readlinkat( d->rootfd, e->path, target, sizeof target);
+        if (n < 0) {
+            dig_fail( d, errno, e->path);
+            return;
+        }
+        dig_update( d, &ctx, target, n);
+        dig_final( d, &ctx, e->md);
+        return;
+    }
+
+    fd = openat( d->rootfd, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        dig_fail( d, errno, e->path);
+        return;
+    }
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    l = e->size < DIG_BUF ? (size_t) e->size + 1 : DIG_BUF;
+    buf = malloc( l);
+    if (buf == NULL)
+        dig_fail( d, errno, e->path);
+    else {
+        while (!d->pool.stop) {
+            n = read( fd, buf, l);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                dig_fail( d, errno, e->path);
+            if (n <= 0)
+                break;
+            dig_update( d, &ctx, buf, n);
+        }
+        dig_final( d, &ctx, e->md);
+        free( buf);
+    }
+    close( fd);
+}
+
+void
+dig_init( struct dig *d, union dig_ctx *c)
+{
+    if (d->algo == DIG_SHA256)
+        supplement_sha256_init( &c->sha256);
+    else
+        supplement_xxh64_init( &c->xxh64, 0);
+}
+
+void
+dig_update( struct dig *d, union dig_ctx *c, const void *p, size_t l)
+{
+    if (d->algo == DIG_SHA256)
+        supplement_sha256_update( &c->sha256, p, l);
+    else
+        supplement_xxh64_update( &c->xxh64, p, l);
+}
+
+void
+dig_final( struct dig *d, union dig_ctx *c, unsigned char *md)
+{
+    if (d->algo == DIG_SHA256)
+        supplement_sha256_final( &c->sha256, md);
+    else
+        supplement_xxh64_final( &c->xxh64, md);
+}
+
+/*
+ *  A directory's digest is taken over its entries sorted by name, each
+ *  as type letter, name, NUL and the entry's digest.  Deeper
+ *  directories are done first.
+ */
+
+int
+dig_merkle( struct dig *d)
+{
+    struct dig_entry **by, **dirs, *e, *c;
+    size_t *first, i, j, ndirs;
+    union dig_ctx ctx;
+
+    by = malloc( (d->n + 1) * sizeof *by);
+    dirs = malloc( (d->n + 1) * sizeof *dirs);
+    first = malloc( (d->n + 1) * sizeof *first);
+    if (by == NULL || dirs == NULL || first == NULL) {
+        free( by), free( dirs), free( first);
+        return -1;
+    }
+    memcpy( by, d->ent + 1, (d->n - 1) * sizeof *by);
+    qsort( by, d->n - 1, sizeof *by, &dig_by_parent);
+    for (i = 0; i <= d->n; i++)
+        first[ i] = d->n - 1;
+    for (i = d->n - 1; i-- > 0;)
+        first[ by[ i]->parent->idx] = i;
+
+    for (ndirs = 0, i = 0; i < d->n; i++)
+        if (d->ent[ i]->type == 'd')
+            dirs[ ndirs++] = d->ent[ i];
+    qsort( dirs, ndirs, sizeof *dirs, &dig_by_depth);
+    for (i = 0; i < ndirs; i++) {
+        e = dirs[ i];
+        dig_init( d, &ctx);
+        for (j = first[ e->idx]; j < d->n - 1 && by[ j]->parent == e; j++) {
+            c = by[ j];
+            dig_update( d, &ctx, &c->type, 1);
+            dig_update( d, &ctx, c->path + c->name,
+                                        strlen( c->path + c->name) + 1);
+            dig_update( d, &ctx, c->md, d->mdlen);
+        }
+        dig_final( d, &ctx, e->md);
+    }
+    free( by), free( dirs), free( first);
+    return 0;
+}
+
+int
+dig_by_parent( const void *a, const void *b)
+{
+    const struct dig_entry *x = *(struct dig_entry **) a;
+    const struct dig_entry *y = *(struct dig_entry **) b;
+
+    if (x->parent->idx != y->parent->idx)
+        return x->parent->idx < y->parent->idx ? -1 : 1;
+    return strcmp( x->path + x->name, y->path + y->name);
+}
+
+int
+dig_by_depth( const void *a, const void *b)
+{
+    return (*(struct dig_entry **) b)->depth - (*(struct dig_entry **) a)->depth;
+}
+
+/*
+ *  The cache is a text file: a header line naming the algorithm, then
+ *  one line per file with inode, size, mtime in nanoseconds and the
+ *  digest.  Anything unreadable is ignored.
+ */
+
+void
+dig_cache_load( struct dig *d)
+{
+    char line[ 256], hex[ 65], head[ 64];
+    struct dig_cached k, *s;
+    unsigned long long ino, size;
+    long long mtime;
+    size_t i, n = 0, m;
+    unsigned int x;
+    FILE *f;
+
+    f = fopen( d->cache, "r");
+    if (f == NULL)
+        return;
+    snprintf( head, sizeof head, "# digest_tree %s\n", dig_names[ d->algo]);
+    if (fgets( line, sizeof line, f) == NULL || strcmp( line, head) != 0) {
+        fclose( f);
+        return;
+    }
+    while (fgets( line, sizeof line, f) != NULL) {
+        if (sscanf( line, "%llu %llu %lld %64s", &ino, &size, &mtime, hex) != 4
+                || strlen( hex) != 2 * d->mdlen)
+            continue;
+        if ((n + 1) * 2 > (d->cached ? d->cmask + 1 : 0)) {
+            m = d->cached ? d->cmask * 2 + 1 : 1023;
+            s = calloc( m + 1, sizeof *s);
+            if (s == NULL)
+                break;
+            for (i = 0; d->cached != NULL && i <= d->cmask; i++)
+                if (d->cached[ i].ino != 0) {
+                    uint64_t h = d->cached[ i].ino * 0x9e3779b97f4a7c15ULL;
+                    size_t j;
+
+                    for (j = h & m; s[ j].ino != 0; j = (j + 1) & m)
+                        ;
+                    s[ j] = d->cached[ i];
+                }
+            free( d->cached);
+            d->cached = s;
+            d->cmask = m;
+        }
+        k.ino = ino, k.size = size, k.mtime = mtime;
+        for (i = 0; i < d->mdlen; i++) {
+            sscanf( hex + 2 * i, "%2x", &x);
+            k.md[ i] = (unsigned char) x;
+        }
+        if (k.ino == 0 || dig_cache_find( d, k.ino) != NULL)
+            continue;
+        for (i = (k.ino * 0x9e3779b97f4a7c15ULL) & d->cmask;
+                d->cached[ i].ino != 0; i = (i + 1) & d->cmask)
+            ;
+        d->cached[ i] = k;
+        n++;
+    }
+    fclose( f);
+}
+
+struct dig_cached *
+dig_cache_find( struct dig *d, uint64_t ino)
+{
+    size_t i;
+
+    if (d->cached == NULL)
+        return NULL;
+    for (i = (ino * 0x9e3779b97f4a7c15ULL) & d->cmask;
+            d->cached[ i].ino != 0; i = (i + 1) & d->cmask)
+        if (d->cached[ i].ino == ino)
+            return d->cached + i;
+    return NULL;
+}
+
+int
+dig_cache_save( struct dig *d)
+{
+    char tmp[ PATH_MAX];
+    struct dig_entry *e;
+    size_t i, j;
+    FILE *f;
+    int r;
+
+    if (snprintf( tmp, sizeof tmp, "%s.%d", d->cache, (int) getpid()) >=
+                                                            (int) sizeof tmp) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    f = fopen( tmp, "w");
+    if (f == NULL)
+        return -1;
+    fprintf( f, "# digest_tree %s\n", dig_names[ d->algo]);
+    for (i = 1; i < d->n; i++) {
+        e = d->ent[ i];
+        if (e->type != 'f')
+            continue;
+        fprintf( f, "%llu %llu %lld ", (unsigned long long) e->ino,
+                    (unsigned long long) e->size, (long long) e->mtime);
+        for (j = 0; j < d->mdlen; j++)
+            fprintf( f, "%02x", e->md[ j]);
+        fputc( '\n', f);
+    }
+    r = ferror( f);
+    if (fclose( f) != 0 || r) {
+        unlink( tmp);
+        return -1;
+    }
+    if (rename( tmp, d->cache) < 0) {
+        r = errno;
+        unlink( tmp);
+        errno = r;
+        return -1;
+    }
+    return 0;
+}
+
+VALUE
+dig_hex( struct dig *d, const unsigned char *md)
+{
+    static const char digits[] = "0123456789abcdef";
+    char hex[ 64];
+    size_t i;
+
+    for (i = 0; i < d->mdlen; i++) {
+        hex[ 2 * i]     = digits[ md[ i] >> 4];
+        hex[ 2 * i + 1] = digits[ md[ i] & 15];
+    }
+    return rb_usascii_str_new( hex, 2 * d->mdlen);
+}
+
+void
+dig_free( struct dig *d)
+{
+    size_t i;
+
+    for (i = 0; i < d->n; i++)
+        free( d->ent[ i]);
+    free( d->ent);
+    d->ent = NULL;
+    d->n = d->capa = 0;
+    free( d->cached);
+    d->cached = NULL;
+    d->cmask = 0;
+}
+
+
+void Init_dirdigest( void)
+{
+    rb_define_singleton_method( rb_cDir, "digest_tree", rb_dir_s_digest_tree, -1);
+
+    id_algo    = rb_intern( "algo");
+    id_threads = rb_intern( "threads");
+    id_cache   = rb_intern( "cache");
+}
+
@@ -0,0 +1,855 @@
+/*
+ *  supplement/dirtree.c  --  Operations on directory trees
+ */
+
+#include "dirtree.h"
+
+#include "pool.h"
+
+#include <ruby/thread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define DIRTREE_OPEN  (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#define DIRTREE_TRASH ".nuke-trash"
+
+#ifndef IOPRIO_WHO_PROCESS
+    #define IOPRIO_WHO_PROCESS  1
+    #define IOPRIO_CLASS_IDLE   3
+    #define IOPRIO_CLASS_SHIFT  13
+#endif
+
+
+struct nuke {
+    struct supplement_pool pool;
+    const char *root;
+    int         rootfd;
+    int         threads;
+    int         err;
+    char        errpath[ PATH_MAX];
+    unsigned long removed;
+};
+
+struct nuke_job {
+    struct supplement_pool_job  link;
+    struct nuke_job            *parent;
+    int                         pending;
+    char                        path[];
+};
+
+struct nuke_async {
+    struct nuke      n;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    int              refs;
+    int              done;
+    int              interrupted;
+    int              top;
+    char             trash[ PATH_MAX];
+};
+
+struct prune {
+    const char   *root;
+    int           err;
+    char          errpath[ PATH_MAX];
+    unsigned long removed;
+    volatile int  stop;
+};
+
+struct nuke_trash {
+    const char *path;
+    char       *trash;
+    int         top;
+    int         err;
+};
+
+static size_t dirtree_path( char *, size_t, const char *);
+static void  *nuke_nogvl( void *);
+static void   nuke_ubf( void *);
+static int    nuke_dir( struct nuke *, int, char *, size_t, struct nuke_job *);
+static void   nuke_fail( struct nuke *, int, const char *);
+static int    nuke_spawn( struct nuke *, struct nuke_job *, const char *);
+static void   nuke_work( struct supplement_pool *, struct supplement_pool_job *);
+static void   nuke_drop( struct supplement_pool *, struct supplement_pool_job *);
+static void   nuke_job_done( struct nuke *, struct nuke_job *);
+static VALUE  dirtree_fail( int, const char *, const char *);
+static VALUE  nuke_async_start( VALUE, int);
+static void  *nuke_trash_nogvl( void *);
+static int    nuke_trash_dir( const char *, char *);
+static void  *nuke_async_thread( void *);
+static void   nuke_async_release( void *);
+static struct nuke_async *get_nuke_async( VALUE);
+static void  *nuke_async_wait_nogvl( void *);
+static void   nuke_async_wait_ubf( void *);
+
+static void  *prune_nogvl( void *);
+static void   prune_ubf( void *);
+static int    prune_dir( struct prune *, int, char *, size_t);
+
+static VALUE rb_cDirNuke;
+
+static ID id_threads = 0;
+static ID id_async = 0;
+
+static const rb_data_type_t nuke_async_data_type = {
+    "supplement:nuke",
+    { NULL, &nuke_async_release, NULL, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+/*
+ *  Append a name to a path relative to the tree's root.  If it doesn't
+ *  fit, the path is left alone and (size_t) -1 is returned.
+ */
+
+size_t
+dirtree_path( char *path, size_t len, const char *name)
+{
+    size_t l = strlen( name);
+
+    if (len + l + 2 > PATH_MAX)
+        return (size_t) -1;
+    if (len > 0)
+        path[ len++] = '/';
+    memcpy( path + len, name, l + 1);
+    return len + l;
+}
+
+VALUE
+dirtree_fail( int err, const char *root, const char *rel)
+{
+    VALUE p;
+
+    p = rb_str_new_cstr( root);
+    if (*rel) {
+        rb_str_cat2( p, "/");
+        rb_str_cat2( p, rel);
+    }
+    rb_syserr_fail_str( err, p);
+    return Qnil;
+}
+
+
+/*
+ *  Document-class: Dir
+ */
+
+/*
+ *  call-seq:
+ *     Dir.nuke!( name, threads: nil)     -> nil
+ *     Dir.nuke!( name, async: true)      -> nuke
+ *
+ *  Delete a directory, all its contents and all subdirectories.
+ *  WARNING! This can cause serious damage.
+ *
+ *  Symbolic links are removed, never followed, not even +name+ itself.
+ *  Other Ruby threads keep running meanwhile.  With <code>threads:
+ *  n</code> subtrees are deleted by +n+ native threads in parallel;
+ *  +true+ means one thread per processor.
+ *
+ *  With <code>async: true</code> the directory is just renamed into a
+ *  trash directory <code>.nuke-trash.</code><i>uid</i> at the top of
+ *  its file system (or, if it cannot be moved there, next to it) and
+ *  deleted by a background thread at idle I/O priority.  A Dir::Nuke object is
+ *  returned.  Trees that were not finished when the process exited stay
+ *  in the trash directory.
+ *
+ *     n = Dir.nuke! "build/cache", async: true
+ *     ...
+ *     n.wait
+ */
+
+VALUE
+rb_dir_s_nuke_bang( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE name, opts;
+    struct nuke n;
+
+    rb_scan_args( argc, argv, "1:", &name, &opts);
+    FilePathValue( name);
+    n.threads = supplement_pool_threads(
+                NIL_P( opts) ? Qnil : rb_hash_aref( opts, ID2SYM( id_threads)));
+    if (!NIL_P( opts) && RTEST( rb_hash_aref( opts, ID2SYM( id_async))))
+        return nuke_async_start( name, n.threads);
+    n.root = RSTRING_PTR( name);
+    n.removed = 0;
+    for (;;) {
+        supplement_pool_init( &n.pool, &nuke_work, &nuke_drop, &n);
+        n.err = 0;
+        rb_thread_call_without_gvl( &nuke_nogvl, &n, &nuke_ubf, &n);
+        supplement_pool_destroy( &n.pool);
+        if (n.err)
+            dirtree_fail( n.err, n.root, n.errpath);
+        if (!n.pool.stop)
+            break;
+        rb_thread_check_ints();
+    }
+    RB_GC_GUARD( name);
+    return Qnil;
+}
+
+void *
+nuke_nogvl( void *p)
+{
+    struct nuke *n = p;
+    char path[ PATH_MAX];
+    int fd;
+
+    n->rootfd = open( n->root, DIRTREE_OPEN);
+    if (n->rootfd < 0) {
+        nuke_fail( n, errno, "");
+        return NULL;
+    }
+    if (n->threads > 1) {
+        if (nuke_spawn( n, NULL, "") == 0)
+            supplement_pool_run( &n->pool, n->threads);
+    } else {
+        fd = dup( n->rootfd);
+        path[ 0] = '\0';
+        if (fd < 0)
+            nuke_fail( n, errno, "");
+        else
+            nuke_dir( n, fd, path, 0, NULL);
+    }
+    close( n->rootfd);
+    if (!n->err && !n->pool.stop) {
+        if (rmdir( n->root) < 0)
+            nuke_fail( n, errno, "");
+        else
+            __atomic_add_fetch( &n->removed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void
+nuke_ubf( void *p)
+{
+    supplement_pool_stop( &((struct nuke *) p)->pool);
+}
+
+void
+nuke_fail( struct nuke *n, int err, const char *path)
+{
+    pthread_mutex_lock( &n->pool.mutex);
+    if (!n->err) {
+        n->err = err;
+        strncpy( n->errpath, path, PATH_MAX - 1);
+        n->errpath[ PATH_MAX - 1] = '\0';
+    }
+    pthread_mutex_unlock( &n->pool.mutex);
+    supplement_pool_stop( &n->pool);
+}
+
+/*
+ *  Empty the directory open as +fd+ and close it.  Subdirectories are
+ *  entered through their descriptors.  Only the directory a job was
+ *  made for hands its subdirectories to idle threads; below that it
+ *  recurses itself.
+ */
+
+int
+nuke_dir( struct nuke *n, int fd, char *path, size_t len, struct nuke_job *job)
+{
+    DIR *d;
+    struct dirent *e;
+    struct stat st;
+    int type, sub;
+    size_t l;
+
+    d = fdopendir( fd);
+    if (d == NULL) {
+        nuke_fail( n, errno, path);
+        close( fd);
+        return -1;
+    }
+    for (;;) {
+        if (n->pool.stop)
+            break;
+        errno = 0;
+        e = readdir( d);
+        if (e == NULL) {
+            if (errno)
+                nuke_fail( n, errno, path);
+            break;
+        }
+        if (e->d_name[ 0] == '.' && (e->d_name[ 1] == '\0' ||
+                    (e->d_name[ 1] == '.' && e->d_name[ 2] == '\0')))
+            continue;
+        l = dirtree_path( path, len, e->d_name);
+        type = e->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat( dirfd( d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                nuke_fail( n, errno, path);
+                break;
+            }
+            type = S_ISDIR( st.st_mode) ? DT_DIR : DT_REG;
+        }
+        if (type == DT_DIR && job != NULL && l != (size_t) -1 &&
+                __atomic_load_n( &n->pool.idle, __ATOMIC_RELAXED) > 0) {
+            if (nuke_spawn( n, job, path) < 0)
+                break;
+        } else if (type == DT_DIR) {
+            sub = openat( dirfd( d), e->d_name, DIRTREE_OPEN);
+            if (sub < 0 && errno == ENOTDIR)
+                goto unlink;
+            if (sub < 0) {
+                nuke_fail( n, errno, path);
+                break;
+            }
+            if (nuke_dir( n, sub, path, l != (size_t) -1 ? l : len, NULL) < 0)
+                break;
+            if (unlinkat( dirfd( d), e->d_name, AT_REMOVEDIR) < 0) {
+                nuke_fail( n, errno, path);
+                break;
+            }
+            __atomic_add_fetch( &n->removed, 1, __ATOMIC_RELAXED);
+        } else {
+unlink:
+            if (unlinkat( dirfd( d), e->d_name, 0) < 0) {
+                nuke_fail( n, errno, path);
+                break;
+            }
+            __atomic_add_fetch( &n->removed, 1, __ATOMIC_RELAXED);
+        }
+        path[ len] = '\0';
+    }
+    closedir( d);
+    return n->err || n->pool.stop ? -1 : 0;
+}
+
+/*
+ *  A job keeps a count of its own work and of its subdirectories'
+ *  jobs.  Whoever brings it down to zero removes the directory.
+ */
+
+int
+nuke_spawn( struct nuke *n, struct nuke_job *parent, const char *path)
+{
+    struct nuke_job *job;
+    size_t l;
+
+    l = strlen( path);
+    job = malloc( sizeof (struct nuke_job) + l + 1);
+    if (job == NULL) {
+        nuke_fail( n, errno, path);
+        return -1;
+    }
+    job->parent = parent;
+    job->pending = 1;
+    memcpy( job->path, path, l + 1);
+    if (parent != NULL)
+        __atomic_add_fetch( &parent->pending, 1, __ATOMIC_ACQ_REL);
+    supplement_pool_push( &n->pool, &job->link);
+    return 0;
+}
+
+void
+nuke_work( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    struct nuke *n = pool->arg;
+    struct nuke_job *job = (struct nuke_job *) j;
+    char path[ PATH_MAX];
+    size_t len;
+    int fd;
+
+    len = strlen( job->path);
+    memcpy( path, job->path, len + 1);
+    fd = openat( n->rootfd, len ? path : ".", DIRTREE_OPEN);
+    if (fd < 0)
+        nuke_fail( n, errno, path);
+    else
+        nuke_dir( n, fd, path, len, job);
+    nuke_job_done( n, job);
+}
+
+void
+nuke_drop( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    nuke_job_done( pool->arg, (struct nuke_job *) j);
+}
+
+void
+nuke_job_done( struct nuke *n, struct nuke_job *job)
+{
+    struct nuke_job *p;
+
+    while (job != NULL &&
+            __atomic_sub_fetch( &job->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        p = job->parent;
+        if (p != NULL && !n->pool.stop) {
+            if (unlinkat( n->rootfd, job->path, AT_REMOVEDIR) < 0)
+                nuke_fail( n, errno, job->path);
+            else
+                __atomic_add_fetch( &n->removed, 1, __ATOMIC_RELAXED);
+        }
+        free( job);
+        job = p;
+    }
+}
+
+
+/*
+ *  Document-class: Dir::Nuke
+ *
+ *  A directory tree being deleted in the background, see Dir.nuke!.
+ */
+
+VALUE
+nuke_async_start( VALUE name, int threads)
+{
+    VALUE obj;
+    struct nuke_async *a;
+    struct nuke_trash t;
+    pthread_t thr;
+    sigset_t all, old;
+    int r;
+
+    obj = TypedData_Wrap_Struct( rb_cDirNuke, &nuke_async_data_type, NULL);
+    a = calloc( 1, sizeof *a);
+    if (a == NULL)
+        rb_memerror();
+    pthread_mutex_init( &a->mutex, NULL);
+    pthread_cond_init( &a->cond, NULL);
+    a->refs = 1;
+    DATA_PTR( obj) = a;
+
+    t.path = RSTRING_PTR( name);
+    t.trash = a->trash;
+    rb_thread_call_without_gvl( &nuke_trash_nogvl, &t, RUBY_UBF_IO, NULL);
+    if (t.err)
+        rb_syserr_fail_str( t.err, name);
+    a->top = t.top;
+
+    a->n.root = a->trash;
+    a->n.threads = threads;
+    a->refs = 2;
+    sigfillset( &all);
+    pthread_sigmask( SIG_SETMASK, &all, &old);
+    r = pthread_create( &thr, NULL, &nuke_async_thread, a);
+    pthread_sigmask( SIG_SETMASK, &old, NULL);
+    if (r == 0)
+        pthread_detach( thr);
+    else
+        rb_thread_call_without_gvl( &nuke_async_thread, a, RUBY_UBF_IO, NULL);
+    return obj;
+}
+
+void *
+nuke_trash_nogvl( void *p)
+{
+    struct nuke_trash *t = p;
+    char dir[ PATH_MAX];
+    const char *base;
+    struct stat st;
+    size_t l;
+    int i, retry = 0;
+
+    t->err = 0;
+    if (lstat( t->path, &st) < 0) {
+        t->err = errno;
+        return NULL;
+    }
+    if (!S_ISDIR( st.st_mode)) {
+        t->err = ENOTDIR;
+        return NULL;
+    }
+    for (l = strlen( t->path); l > 1 && t->path[ l - 1] == '/'; --l)
+        ;
+    if (l >= PATH_MAX) {
+        t->err = ENAMETOOLONG;
+        return NULL;
+    }
+    memcpy( dir, t->path, l);
+    dir[ l] = '\0';
+    base = strrchr( dir, '/');
+    if (base != NULL) {
+        dir[ base - dir] = '\0';
+        if (base == dir)
+            strcpy( dir, "/");
+    } else
+        strcpy( dir, ".");
+    if (realpath( dir, t->trash) == NULL) {
+        t->err = errno;
+        return NULL;
+    }
+    strcpy( dir, t->trash);
+    t->top = nuke_trash_dir( dir, t->trash) == 0;
+    if (!t->top)
+        strcpy( t->trash, dir);
+    for (;;) {
+        l = strlen( t->trash);
+        for (i = 0; i < 1000; i++) {
+            struct timespec ts;
+
+            clock_gettime( CLOCK_REALTIME, &ts);
+            snprintf( t->trash + l, PATH_MAX - l, "/.nuke.%ld.%ld.%d",
+                        (long) getpid(), (long) ts.tv_nsec, i);
+            if (rename( t->path, t->trash) == 0)
+                return NULL;
+            if (errno != EEXIST && errno != ENOTEMPTY)
+                break;
+        }
+        /*
+         * The trash directory is removed by a finishing nuke as soon as
+         * it gets empty; another one may have done so just now.
+         */
+        if (t->top && errno == ENOENT && retry++ < 100 &&
+                lstat( t->path, &st) == 0) {
+            t->top = nuke_trash_dir( dir, t->trash) == 0;
+            if (!t->top)
+                strcpy( t->trash, dir);
+            continue;
+        }
+        /*
+         * A bind mount shares the device of the file system top but
+         * cannot be renamed out of; use a sibling then.
+         */
+        if (!t->top || (errno != EXDEV && errno != EACCES && errno != EPERM))
+            break;
+        t->trash[ l] = '\0';
+        rmdir( t->trash);
+        strcpy( t->trash, dir);
+        t->top = 0;
+    }
+    t->err = errno;
+    return NULL;
+}
+
+/*
+ *  Find the top directory of the file system that +dir+ lives on, by
+ *  walking upwards as long as device and file system id stay the same.
+ *  Make the trash directory there.  Every user gets a separate one; it is
+ *  removed again when it gets empty.
+ */
+
+int
+nuke_trash_dir( const char *dir, char *trash)
+{
+    struct stat st, ust;
+    struct statfs fs, ufs;
+    char cur[ PATH_MAX], up[ PATH_MAX];
+    char *s;
+
+    strcpy( cur, dir);
+    if (stat( cur, &st) < 0 || statfs( cur, &fs) < 0)
+        return -1;
+    while (strcmp( cur, "/") != 0) {
+        strcpy( up, cur);
+        s = strrchr( up, '/');
+        if (s == up)
+            s[ 1] = '\0';
+        else
+            *s = '\0';
+        if (stat( up, &ust) < 0 || statfs( up, &ufs) < 0 ||
+                ust.st_dev != st.st_dev ||
+                memcmp( &ufs.f_fsid, &fs.f_fsid, sizeof fs.f_fsid) != 0)
+            break;
+        strcpy( cur, up);
+    }
+    snprintf( trash, PATH_MAX, "%s%s" DIRTREE_TRASH ".%ld",
+                cur, cur[ 1] == '\0' ? "" : "/", (long) geteuid());
+    if (mkdir( trash, 0700) < 0 && errno != EEXIST)
+        return -1;
+    if (lstat( trash, &st) < 0 || !S_ISDIR( st.st_mode) ||
+            st.st_uid != geteuid())
+        return -1;
+    return 0;
+}
+
+void *
+nuke_async_thread( void *p)
+{
+    struct nuke_async *a = p;
+
+    syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    supplement_pool_init( &a->n.pool, &nuke_work, &nuke_drop, &a->n);
+    a->n.err = 0;
+    nuke_nogvl( &a->n);
+    if (a->top) {
+        char top[ PATH_MAX];
+
+        strcpy( top, a->trash);
+        *strrchr( top, '/') = '\0';
+        rmdir( top);
+    }
+    pthread_mutex_lock( &a->mutex);
+    a->done = 1;
+    pthread_cond_broadcast( &a->cond);
+    pthread_mutex_unlock( &a->mutex);
+    nuke_async_release( a);
+    return NULL;
+}
+
+void
+nuke_async_release( void *p)
+{
+    struct nuke_async *a = p;
+
+    if (a == NULL || __atomic_sub_fetch( &a->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (a->done)
+        supplement_pool_destroy( &a->n.pool);
+    pthread_cond_destroy( &a->cond);
+    pthread_mutex_destroy( &a->mutex);
+    free( a);
+}
+
+struct nuke_async *
+get_nuke_async( VALUE self)
+{
+    struct nuke_async *a;
+
+    TypedData_Get_Struct( self, struct nuke_async, &nuke_async_data_type, a);
+    return a;
+}
+
+/*
+ *  call-seq:
+ *     wait()   -> nil
+ *
+ *  Wait until the tree is deleted.  Errors are raised here.
+ */
+
+VALUE
+rb_dirnuke_wait( VALUE self)
+{
+    struct nuke_async *a;
+
+    a = get_nuke_async( self);
+    while (!__atomic_load_n( &a->done, __ATOMIC_ACQUIRE)) {
+        rb_thread_call_without_gvl( &nuke_async_wait_nogvl, a,
+                                    &nuke_async_wait_ubf, a);
+        rb_thread_check_ints();
+    }
+    if (a->n.err)
+        dirtree_fail( a->n.err, a->trash, a->n.errpath);
+    return Qnil;
+}
+
+void *
+nuke_async_wait_nogvl( void *p)
+{
+    struct nuke_async *a = p;
+
+    pthread_mutex_lock( &a->mutex);
+    while (!a->done && !a->interrupted)
+        pthread_cond_wait( &a->cond, &a->mutex);
+    a->interrupted = 0;
+    pthread_mutex_unlock( &a->mutex);
+    return NULL;
+}
+
+void
+nuke_async_wait_ubf( void *p)
+{
+    struct nuke_async *a = p;
+
+    pthread_mutex_lock( &a->mutex);
+    a->interrupted = 1;
+    pthread_cond_broadcast( &a->cond);
+    pthread_mutex_unlock( &a->mutex);
+}
+
+/*
+ *  call-seq:
+ *     done?   -> true or false
+ *
+ *  Whether the background thread has finished.
+ */
+
+VALUE
+rb_dirnuke_done_p( VALUE self)
+{
+    return __atomic_load_n( &get_nuke_async( self)->done, __ATOMIC_ACQUIRE) ?
+                                                            Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     progress   -> int
+ *
+ *  Number of files and directories removed so far.
+ */
+
+VALUE
+rb_dirnuke_progress( VALUE self)
+{
+    return ULONG2NUM( __atomic_load_n( &get_nuke_async( self)->n.removed,
+                                       __ATOMIC_RELAXED));
+}
+
+/*
+ *  call-seq:
+ *     path   -> str
+ *
+ *  Where the tree was moved to.
+ */
+
+VALUE
+rb_dirnuke_path( VALUE self)
+{
+    return rb_str_new_cstr( get_nuke_async( self)->trash);
+}
+
+
+/*
+ *  call-seq:
+ *     Dir.prune_empty( name)     -> int
+ *
+ *  Remove all empty directories below +name+ and +name+ itself if it
+ *  gets empty.  Directories that contain only empty directories count
+ *  as empty.  The tree is walked once, bottom-up; emptiness is found out
+ *  by just trying to remove a directory.  Symbolic links are not
+ *  followed.
+ *
+ *  Returns the number of directories removed.
+ */
+
+VALUE
+rb_dir_s_prune_empty( VALUE dir, VALUE name)
+{
+    struct prune p;
+
+    FilePathValue( name);
+    p.root = RSTRING_PTR( name);
+    p.removed = 0;
+    for (;;) {
+        p.err = 0;
+        p.stop = 0;
+        rb_thread_call_without_gvl( &prune_nogvl, &p, &prune_ubf, &p);
+        if (p.err)
+            dirtree_fail( p.err, p.root, p.errpath);
+        if (!p.stop)
+            break;
+        rb_thread_check_ints();
+    }
+    RB_GC_GUARD( name);
+    return ULONG2NUM( p.removed);
+}
+
+void *
+prune_nogvl( void *arg)
+{
+    struct prune *p = arg;
+    char path[ PATH_MAX];
+    int fd;
+
+    fd = open( p->root, DIRTREE_OPEN);
+    if (fd < 0) {
+        p->err = errno;
+        p->errpath[ 0] = '\0';
+        return NULL;
+    }
+    path[ 0] = '\0';
+    if (prune_dir( p, fd, path, 0) < 0)
+        return NULL;
+    if (rmdir( p->root) == 0)
+        p->removed++;
+    else if (errno != ENOTEMPTY && errno != EEXIST) {
+        p->err = errno;
+        p->errpath[ 0] = '\0';
+    }
+    return NULL;
+}
+
+void
+prune_ubf( void *arg)
+{
+    ((struct prune *) arg)->stop = 1;
+}
+
+int
+prune_dir( struct prune *p, int fd, char *path, size_t len)
+{
+    DIR *d;
+    struct dirent *e;
+    struct stat st;
+    int type, sub;
+    size_t l;
+
+    d = fdopendir( fd);
+    if (d == NULL) {
+        p->err = errno;
+        strcpy( p->errpath, path);
+        close( fd);
+        return -1;
+    }
+    while (!p->stop && !p->err) {
+        errno = 0;
+        e = readdir( d);
+        if (e == NULL) {
+            if (errno) {
+                p->err = errno;
+                strcpy( p->errpath, path);
+            }
+            break;
+        }
+        if (e->d_name[ 0] == '.' && (e->d_name[ 1] == '\0' ||
+                    (e->d_name[ 1] == '.' && e->d_name[ 2] == '\0')))
+            continue;
+        type = e->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat( dirfd( d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            type = S_ISDIR( st.st_mode) ? DT_DIR : DT_REG;
+        }
+        if (type != DT_DIR)
+            continue;
+        l = dirtree_path( path, len, e->d_name);
+        sub = openat( dirfd( d), e->d_name, DIRTREE_OPEN);
+        if (sub < 0) {
+            if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP) {
+                p->err = errno;
+                strcpy( p->errpath, path);
+            }
+        } else if (prune_dir( p, sub, path, l != (size_t) -1 ? l : len) == 0) {
+            if (unlinkat( dirfd( d), e->d_name, AT_REMOVEDIR) == 0)
+                p->removed++;
+            else if (errno != ENOTEMPTY && errno != EEXIST && errno != ENOENT) {
+                p->err = errno;
+                strcpy( p->errpath, path);
+            }
+        }
+        path[ len] = '\0';
+    }
+    closedir( d);
+    return p->err || p->stop ? -1 : 0;
+}
+
+
+void Init_dirtree( void)
+{
+    rb_define_singleton_method( rb_cDir, "nuke!", rb_dir_s_nuke_bang, -1);
+    rb_define_singleton_method( rb_cDir, "prune_empty", rb_dir_s_prune_empty, 1);
+
+    rb_cDirNuke = rb_define_class_under( rb_cDir, "Nuke", rb_cObject);
+    rb_undef_alloc_func( rb_cDirNuke);
+    rb_define_method( rb_cDirNuke, "wait", rb_dirnuke_wait, 0);
+    rb_define_method( rb_cDirNuke, "done?", rb_dirnuke_done_p, 0);
+    rb_define_method( rb_cDirNuke, "progress", rb_dirnuke_progress, 0);
+    rb_define_method( rb_cDirNuke, "path", rb_dirnuke_path, 0);
+
+    id_threads = rb_intern( "threads");
+    id_async   = rb_intern( "async");
+
+    Init_dirwalk();
+    Init_dirusage();
+    Init_dircopy();
+    Init_dirdigest();
+}
+
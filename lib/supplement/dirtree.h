@@ -0,0 +1,31 @@
+/*
+ *  supplement/dirtree.h  --  Operations on directory trees
+ */
+
+#ifndef __SUPPLEMENT_DIRTREE_H__
+#define __SUPPLEMENT_DIRTREE_H__
+
+#include <ruby/ruby.h>
+
+
+extern VALUE rb_dir_s_nuke_bang( int, VALUE *, VALUE);
+extern VALUE rb_dir_s_prune_empty( VALUE, VALUE);
+
+extern VALUE rb_dir_s_walk( int, VALUE *, VALUE);
+extern VALUE rb_dir_s_usage( int, VALUE *, VALUE);
+extern VALUE rb_dir_s_copy_tree( int, VALUE *, VALUE);
+extern VALUE rb_dir_s_digest_tree( int, VALUE *, VALUE);
+
+extern VALUE rb_dirnuke_wait( VALUE);
+extern VALUE rb_dirnuke_done_p( VALUE);
+extern VALUE rb_dirnuke_progress( VALUE);
+extern VALUE rb_dirnuke_path( VALUE);
+
+extern void Init_dirtree( void);
+extern void Init_dirwalk( void);
+extern void Init_dirusage( void);
+extern void Init_dircopy( void);
+extern void Init_dirdigest( void);
+
+#endif
+
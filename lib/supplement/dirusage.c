@@ -0,0 +1,379 @@
+/*
+ *  supplement/dirusage.c  --  Disk usage of directory trees
+ */
+
+#include "dirtree.h"
+
+#include "pool.h"
+
+#include <ruby/thread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define USAGE_OPEN  (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
+
+/*
+ *  Files with more than one link, by device and inode.  Open addressing;
+ *  a zero inode marks a free slot.
+ */
+
+struct usage_links {
+    pthread_mutex_t mutex;
+    uint64_t       *slot;
+    size_t          mask;
+    size_t          count;
+};
+
+struct usage {
+    struct supplement_pool pool;
+    const char        *root;
+    int                rootfd;
+    int                threads;
+    dev_t              dev;
+    fsid_t             fsid;
+    struct usage_links links;
+    uint64_t           allocated;
+    uint64_t           apparent;
+    uint64_t           inodes;
+    uint64_t           skipped;
+    int                err;
+    char               errpath[ PATH_MAX];
+};
+
+struct usage_job {
+    struct supplement_pool_job link;
+    char                       path[];
+};
+
+static void *usage_nogvl( void *);
+static void  usage_ubf( void *);
+static void  usage_fail( struct usage *, int, const char *);
+static int   usage_spawn( struct usage *, const char *);
+static void  usage_work( struct supplement_pool *, struct supplement_pool_job *);
+static int   usage_same_fs( struct usage *, int, const char *);
+static int   usage_links_add( struct usage_links *, dev_t, ino_t);
+
+static ID id_threads = 0;
+static ID id_allocated = 0;
+static ID id_apparent = 0;
+static ID id_inodes = 0;
+static ID id_skipped = 0;
+
+
+/*
+ *  Document-class: Dir
+ */
+
+/*
+ *  call-seq:
+ *     Dir.usage( name, threads: nil)     -> hash
+ *
+ *  Sum up the disk usage of a directory tree like <code>du -sx</code>
+ *  does.  The result has the keys <code>:allocated</code> (bytes in
+ *  allocated blocks), <code>:apparent</code> (file sizes) and
+ *  <code>:inodes</code>.  Files with several hard links are counted
+ *  once.  Symbolic links are not followed and other file systems
+ *  mounted below +name+ are left out; they are told apart by their
+ *  file system id (see Filesys::Stat#fsid).  File systems that have
+ *  no id are never entered.
+ *
+ *  Entries that may not be read are left out like <code>du</code>
+ *  does; <code>:skipped</code> counts them.
+ *
+ *  Other Ruby threads keep running meanwhile.  With <code>threads:
+ *  n</code> directories are read by +n+ native threads in parallel;
+ *  +true+ means one thread per processor.
+ *
+ *     Dir.usage "/home/jdoe"
+ *     #=> {:allocated=>1234567680, :apparent=>1198765432, :inodes=>34567,
+ *         :skipped=>0}
+ */
+
+VALUE
+rb_dir_s_usage( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE name, opts, r;
+    struct usage u;
+
+    rb_scan_args( argc, argv, "1:", &name, &opts);
+    FilePathValue( name);
+    u.threads = supplement_pool_threads(
+                NIL_P( opts) ? Qnil : rb_hash_aref( opts, ID2SYM( id_threads)));
+    u.root = RSTRING_PTR( name);
+    for (;;) {
+        supplement_pool_init( &u.pool, &usage_work, NULL, &u);
+        pthread_mutex_init( &u.links.mutex, NULL);
+        u.links.slot = NULL;
+        u.links.mask = u.links.count = 0;
+        u.allocated = u.apparent = u.inodes = u.skipped = 0;
+        u.err = 0;
+        rb_thread_call_without_gvl( &usage_nogvl, &u, &usage_ubf, &u);
+        free( u.links.slot);
+        pthread_mutex_destroy( &u.links.mutex);
+        supplement_pool_destroy( &u.pool);
+        if (u.err) {
+            r = rb_str_new_cstr( u.root);
+            if (*u.errpath) {
+                rb_str_cat2( r, "/");
+                rb_str_cat2( r, u.errpath);
+            }
+            rb_syserr_fail_str( u.err, r);
+        }
+        if (!u.pool.stop)
+            break;
+        rb_thread_check_ints();
+    }
+    RB_GC_GUARD( name);
+
+    r = rb_hash_new();
+    rb_hash_aset( r, ID2SYM( id_allocated), ULL2NUM( u.allocated));
+    rb_hash_aset( r, ID2SYM( id_apparent),  ULL2NUM( u.apparent));
+    rb_hash_aset( r, ID2SYM( id_inodes),    ULL2NUM( u.inodes));
+    rb_hash_aset( r, ID2SYM( id_skipped),   ULL2NUM( u.skipped));
+    return r;
+}
+
+void *
+usage_nogvl( void *p)
+{
+    struct usage *u = p;
+    struct statfs sf;
+    struct stat st;
+
+    u->rootfd = open( u->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (u->rootfd < 0) {
+        usage_fail( u, errno, "");
+        return NULL;
+    }
+    if (fstat( u->rootfd, &st) < 0 || fstatfs( u->rootfd, &sf) < 0)
+        usage_fail( u, errno, "");
+    else {
+        u->dev = st.st_dev;
+        u->fsid = sf.f_fsid;
+        u->allocated = (uint64_t) st.st_blocks * 512;
+        u->apparent = st.st_size;
+        u->inodes = 1;
+        if (usage_spawn( u, "") == 0)
+            supplement_pool_run( &u->pool, u->threads);
+    }
+    close( u->rootfd);
+    return NULL;
+}
+
+void
+usage_ubf( void *p)
+{
+    supplement_pool_stop( &((struct usage *) p)->pool);
+}
+
+void
+usage_fail( struct usage *u, int err, const char *path)
+{
+    pthread_mutex_lock( &u->pool.mutex);
+    if (!u->err) {
+        u->err = err;
+        strncpy( u->errpath, path, PATH_MAX - 1);
+        u->errpath[ PATH_MAX - 1] = '\0';
+    }
+    pthread_mutex_unlock( &u->pool.mutex);
+    supplement_pool_stop( &u->pool);
+}
+
+int
+usage_spawn( struct usage *u, const char *path)
+{
+    struct usage_job *job;
+    size_t l;
+
+    l = strlen( path);
+    job = malloc( sizeof (struct usage_job) + l + 1);
+    if (job == NULL) {
+        usage_fail( u, errno, path);
+        return -1;
+    }
+    memcpy( job->path, path, l + 1);
+    supplement_pool_push( &u->pool, &job->link);
+    return 0;
+}
+
+/*
+ *  Stat everything in one directory.  Each subdirectory becomes a job
+ *  of its own; the sums are added once the directory is done.
+ */
+
+void
+usage_work( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    struct usage *u = pool->arg;
+    struct usage_job *job = (struct usage_job *) j;
+    uint64_t allocated = 0, apparent = 0, inodes = 0;
+    char path[ PATH_MAX];
+    struct dirent *e;
+    struct stat st;
+    size_t len, l;
+    DIR *d;
+    int fd;
+
+    len = strlen( job->path);
+    memcpy( path, job->path, len + 1);
+    free( job);
+    fd = openat( u->rootfd, len ? path : ".", USAGE_OPEN);
+    if (fd < 0) {
+        if (errno == EACCES || errno == EPERM)
+            __atomic_add_fetch( &u->skipped, 1, __ATOMIC_RELAXED);
+        else if (errno != ENOENT)
+            usage_fail( u, errno, path);
+        return;
+    }
+    d = fdopendir( fd);
+    if (d == NULL) {
+        usage_fail( u, errno, path);
+        close( fd);
+        return;
+    }
+    while (!pool->stop) {
+        errno = 0;
+        e = readdir( d);
+        if (e == NULL) {
+            if (errno)
+                usage_fail( u, errno, path);
+            break;
+        }
+        if (e->d_name[ 0] == '.' && (e->d_name[ 1] == '\0' ||
+                    (e->d_name[ 1] == '.' && e->d_name[ 2] == '\0')))
+            continue;
+        if (fstatat( fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            if (errno == ENOENT)
+                continue;
+            if (errno == EACCES || errno == EPERM) {
+                __atomic_add_fetch( &u->skipped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            usage_fail( u, errno, path);
+            break;
+        }
+        if (S_ISDIR( st.st_mode)) {
+            if (st.st_dev != u->dev && !usage_same_fs( u, fd, e->d_name))
+                continue;
+            l = len + strlen( e->d_name) + 2;
+            if (l > PATH_MAX) {
+                usage_fail( u, ENAMETOOLONG, path);
+                break;
+            }
+            if (len > 0)
+                path[ len] = '/';
+            strcpy( path + len + (len > 0), e->d_name);
+            if (usage_spawn( u, path) < 0)
+                break;
+            path[ len] = '\0';
+        } else if (st.st_nlink > 1 &&
+                        !usage_links_add( &u->links, st.st_dev, st.st_ino))
+            continue;
+        allocated += (uint64_t) st.st_blocks * 512;
+        apparent += st.st_size;
+        inodes++;
+    }
+    closedir( d);
+    __atomic_add_fetch( &u->allocated, allocated, __ATOMIC_RELAXED);
+    __atomic_add_fetch( &u->apparent, apparent, __ATOMIC_RELAXED);
+    __atomic_add_fetch( &u->inodes, inodes, __ATOMIC_RELAXED);
+}
+
+/*
+ *  A directory on another device may still belong to the same file
+ *  system, e.g. a bind mount.  Decide by the file system id; some file
+ *  systems (proc, older tmpfs) report zero, which tells nothing.
+ */
+
+int
+usage_same_fs( struct usage *u, int dirfd, const char *name)
+{
+    static const fsid_t none;
+    struct statfs sf;
+    int fd, r;
+
+    if (memcmp( &u->fsid, &none, sizeof (fsid_t)) == 0)
+        return 0;
+    fd = openat( dirfd, name, USAGE_OPEN);
+    if (fd < 0)
+        return 0;
+    r = fstatfs( fd, &sf) == 0 &&
+                memcmp( &sf.f_fsid, &u->fsid, sizeof (fsid_t)) == 0;
+    close( fd);
+    return r;
+}
+
+/*
+ *  Returns 1 if the file wasn't seen before.  If memory runs out, files
+ *  may be counted twice rather than failing.
+ */
+
+int
+usage_links_add( struct usage_links *s, dev_t dev, ino_t ino)
+{
+    uint64_t *n, *o, h;
+    size_t i, m;
+    int r = 1;
+
+    pthread_mutex_lock( &s->mutex);
+    if ((s->count + 1) * 2 > s->mask + 1) {
+        m = s->mask ? s->mask * 2 + 1 : 255;
+        n = calloc( m + 1, 2 * sizeof (uint64_t));
+        if (n == NULL) {
+            if (s->slot == NULL || s->count >= s->mask)
+                goto out;
+            goto find;
+        }
+        for (o = s->slot; s->mask && o < s->slot + 2 * (s->mask + 1); o += 2) {
+            if (o[ 1] == 0)
+                continue;
+            h = (o[ 0] * 0x9e3779b97f4a7c15ULL) ^ o[ 1];
+            for (i = h & m; n[ 2 * i + 1] != 0; i = (i + 1) & m)
+                ;
+            n[ 2 * i] = o[ 0];
+            n[ 2 * i + 1] = o[ 1];
+        }
+        free( s->slot);
+        s->slot = n;
+        s->mask = m;
+    }
+find:
+    h = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) ino;
+    for (i = h & s->mask; s->slot[ 2 * i + 1] != 0; i = (i + 1) & s->mask)
+        if (s->slot[ 2 * i] == (uint64_t) dev &&
+                s->slot[ 2 * i + 1] == (uint64_t) ino) {
+            r = 0;
+            goto out;
+        }
+    s->slot[ 2 * i] = dev;
+    s->slot[ 2 * i + 1] = ino;
+    s->count++;
+out:
+    pthread_mutex_unlock( &s->mutex);
+    return r;
+}
+
+
+void Init_dirusage( void)
+{
+    rb_define_singleton_method( rb_cDir, "usage", rb_dir_s_usage, -1);
+
+    id_threads   = rb_intern( "threads");
+    id_allocated = rb_intern( "allocated");
+    id_apparent  = rb_intern( "apparent");
+    id_inodes    = rb_intern( "inodes");
+    id_skipped   = rb_intern( "skipped");
+}
+
@@ -0,0 +1,524 @@
+/*
+ *  supplement/dirwalk.c  --  Fast directory tree traversal
+ */
+
+#include "dirtree.h"
+
+#include "pool.h"
+
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define WALK_OPEN      (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#define WALK_DENTS     (256 * 1024)
+#define WALK_MAXREADY  4
+#define WALK_SKIP      0xff
+
+/* The kernel's record; glibc doesn't declare it everywhere. */
+struct walk_dirent {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+struct walk_batch {
+    struct walk_batch *next;
+    long               count;
+    unsigned long      serial;
+    size_t             len;
+    size_t             capa;
+    char              *buf;
+};
+
+struct walk_job {
+    struct supplement_pool_job link;
+    unsigned long              serial;
+    size_t                     len;
+    char                       path[];
+};
+
+struct walk {
+    struct supplement_pool pool;
+    pthread_cond_t     ready_cond;
+    pthread_cond_t     space_cond;
+    struct walk_batch *current;
+    struct walk_batch *ready, *ready_tail;
+    struct walk_batch *taken;
+    int                nready;
+    int                interrupted;
+    long               batch;
+    int                threads;
+    int                rootfd;
+    VALUE              root;
+    unsigned long      serial;
+    int                err;
+    char               errpath[ PATH_MAX];
+};
+
+static VALUE walk_run( VALUE);
+static VALUE walk_cleanup( VALUE);
+static void *walk_wait_nogvl( void *);
+static void  walk_wait_ubf( void *);
+static void *walk_join_nogvl( void *);
+static void  walk_done( struct supplement_pool *);
+static void  walk_fail( struct walk *, int, const char *);
+static int   walk_spawn( struct walk *, const char *, size_t, const char *);
+static void  walk_work( struct supplement_pool *, struct supplement_pool_job *);
+static int   walk_emit( struct walk *, struct walk_job *, char *, long);
+static int   walk_put( struct walk_batch *, const void *, size_t);
+static void  walk_batch_free( struct walk_batch *);
+static VALUE walk_yield( struct walk *, struct walk_batch *);
+
+static VALUE sym_types[ 16];
+
+static ID id_batch = 0;
+static ID id_threads = 0;
+
+
+/*
+ *  Document-class: Dir
+ */
+
+/*
+ *  call-seq:
+ *     Dir.walk( name, batch: 1024, threads: nil) { |dirs, names, types, inodes| ... }  -> nil
+ *
+ *  Traverse a directory tree.  The entries are delivered in batches
+ *  of four equally long arrays: the directory (shared String objects,
+ *  beginning with +name+), the entry's name, its type as a Symbol like
+ *  in <code>File.ftype</code> (<code>:file</code>,
+ *  <code>:directory</code>, <code>:link</code>, ...) and its inode
+ *  number.  Types come from the directory entries; no file is
+ *  stat'ed unless the file system doesn't tell.
+ *
+ *  Symbolic links are not followed.  Directories are read with large
+ *  buffers by native threads while the block runs.  With
+ *  <code>threads: n</code> several threads share the directories
+ *  found; +true+ means one per processor.  The order of the entries is
+ *  unspecified.
+ *
+ *  Subdirectories that may not be read are skipped like in Dir.usage:
+ *  their own entry is delivered, but nothing below it.
+ *
+ *     Dir.walk "/usr/share" do |dirs, names, types, inodes|
+ *       names.each_with_index { |n,i|
+ *         puts File.join dirs[i], n if types[i] == :file
+ *       }
+ *     end
+ */
+
+VALUE
+rb_dir_s_walk( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE name, opts;
+    struct walk w;
+
+    RETURN_ENUMERATOR( dir, argc, argv);
+    rb_scan_args( argc, argv, "1:", &name, &opts);
+    FilePathValue( name);
+
+    MEMZERO( &w, struct walk, 1);
+    w.root = name;
+    w.batch = 1024;
+    w.threads = 1;
+    if (!NIL_P( opts)) {
+        VALUE v;
+
+        v = rb_hash_aref( opts, ID2SYM( id_batch));
+        if (!NIL_P( v) && (w.batch = NUM2LONG( v)) < 1)
+            rb_raise( rb_eArgError, "batch size must be positive");
+        w.threads = supplement_pool_threads(
+                                rb_hash_aref( opts, ID2SYM( id_threads)));
+    }
+
+    w.rootfd = open( RSTRING_PTR( name), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (w.rootfd < 0)
+        rb_sys_fail_str( name);
+    supplement_pool_init( &w.pool, &walk_work, NULL, &w);
+    w.pool.done = &walk_done;
+    pthread_cond_init( &w.ready_cond, NULL);
+    pthread_cond_init( &w.space_cond, NULL);
+    rb_ensure( walk_run, (VALUE) &w, walk_cleanup, (VALUE) &w);
+    if (w.err)
+        rb_syserr_fail_str( w.err, rb_str_new_cstr( w.errpath));
+    RB_GC_GUARD( name);
+    return Qnil;
+}
+
+VALUE
+walk_run( VALUE v)
+{
+    struct walk *w = (struct walk *) v;
+    struct walk_batch *b;
+
+    if (walk_spawn( w, "", 0, NULL) < 0)
+        return Qnil;
+    supplement_pool_start( &w->pool, w->threads);
+    if (w->pool.nthreads == 0)
+        rb_raise( rb_eThreadError, "cannot create walker threads");
+    for (;;) {
+        rb_thread_call_without_gvl( &walk_wait_nogvl, w, &walk_wait_ubf, w);
+        if (w->taken == NULL) {
+            if (w->pool.finished || w->pool.stop)
+                break;
+            rb_thread_check_ints();
+            continue;
+        }
+        while ((b = w->taken) != NULL) {
+            walk_yield( w, b);
+            w->taken = b->next;
+            walk_batch_free( b);
+        }
+    }
+    return Qnil;
+}
+
+void *
+walk_wait_nogvl( void *p)
+{
+    struct walk *w = p;
+
+    pthread_mutex_lock( &w->pool.mutex);
+    while (w->ready == NULL && !w->pool.finished && !w->pool.stop &&
+                                                        !w->interrupted)
+        pthread_cond_wait( &w->ready_cond, &w->pool.mutex);
+    w->interrupted = 0;
+    w->taken = w->ready;
+    w->ready = w->ready_tail = NULL;
+    w->nready = 0;
+    pthread_cond_broadcast( &w->space_cond);
+    pthread_mutex_unlock( &w->pool.mutex);
+    return NULL;
+}
+
+void
+walk_wait_ubf( void *p)
+{
+    struct walk *w = p;
+
+    pthread_mutex_lock( &w->pool.mutex);
+    w->interrupted = 1;
+    pthread_cond_broadcast( &w->ready_cond);
+    pthread_mutex_unlock( &w->pool.mutex);
+}
+
+VALUE
+walk_cleanup( VALUE v)
+{
+    struct walk *w = (struct walk *) v;
+    struct walk_batch *b;
+
+    supplement_pool_stop( &w->pool);
+    pthread_mutex_lock( &w->pool.mutex);
+    pthread_cond_broadcast( &w->space_cond);
+    pthread_mutex_unlock( &w->pool.mutex);
+    rb_thread_call_without_gvl( &walk_join_nogvl, w, NULL, NULL);
+
+    walk_batch_free( w->current);
+    while ((b = w->ready) != NULL) {
+        w->ready = b->next;
+        walk_batch_free( b);
+    }
+    while ((b = w->taken) != NULL) {
+        w->taken = b->next;
+        walk_batch_free( b);
+    }
+    pthread_cond_destroy( &w->ready_cond);
+    pthread_cond_destroy( &w->space_cond);
+    supplement_pool_destroy( &w->pool);
+    close( w->rootfd);
+    return Qnil;
+}
+
+void *
+walk_join_nogvl( void *p)
+{
+    supplement_pool_wait( &((struct walk *) p)->pool);
+    return NULL;
+}
+
+/* Called with the pool's mutex held. */
+
+void
+walk_done( struct supplement_pool *pool)
+{
+    struct walk *w = pool->arg;
+
+    if (w->current != NULL) {
+        if (w->ready_tail != NULL)
+            w->ready_tail->next = w->current;
+        else
+            w->ready = w->current;
+        w->ready_tail = w->current;
+        w->current = NULL;
+    }
+    pthread_cond_broadcast( &w->ready_cond);
+}
+
+void
+walk_fail( struct walk *w, int err, const char *path)
+{
+    pthread_mutex_lock( &w->pool.mutex);
+    if (!w->err) {
+        w->err = err;
+        strncpy( w->errpath, RSTRING_PTR( w->root), PATH_MAX - 1);
+        if (*path) {
+            strncat( w->errpath, "/", PATH_MAX - 1 - strlen( w->errpath));
+            strncat( w->errpath, path, PATH_MAX - 1 - strlen( w->errpath));
+        }
+    }
+    w->pool.stop = 1;
+    pthread_cond_broadcast( &w->pool.cond);
+    pthread_cond_broadcast( &w->ready_cond);
+    pthread_cond_broadcast( &w->space_cond);
+    pthread_mutex_unlock( &w->pool.mutex);
+}
+
+int
+walk_spawn( struct walk *w, const char *dir, size_t len, const char *name)
+{
+    struct walk_job *job;
+    size_t l;
+
+    l = name != NULL ? strlen( name) : 0;
+    job = malloc( sizeof (struct walk_job) + len + l + 2);
+    if (job == NULL) {
+        walk_fail( w, errno, dir);
+        return -1;
+    }
+    memcpy( job->path, dir, len);
+    job->len = len;
+    if (name != NULL) {
+        if (len > 0)
+            job->path[ job->len++] = '/';
+        memcpy( job->path + job->len, name, l);
+        job->len += l;
+    }
+    job->path[ job->len] = '\0';
+    job->serial = __atomic_add_fetch( &w->serial, 1, __ATOMIC_RELAXED);
+    supplement_pool_push( &w->pool, &job->link);
+    return 0;
+}
+
+/*
+ *  Read one directory.  Subdirectories become new jobs; the entries are
+ *  appended to the shared batch once per buffer full.
+ */
+
+void
+walk_work( struct supplement_pool *pool, struct supplement_pool_job *j)
+{
+    struct walk *w = pool->arg;
+    struct walk_job *job = (struct walk_job *) j;
+    char buf[ WALK_DENTS] __attribute__(( aligned( 8)));
+    struct walk_dirent *d;
+    struct stat st;
+    long n, off;
+    int fd;
+
+    fd = openat( w->rootfd, job->len ? job->path : ".", WALK_OPEN);
+    if (fd < 0) {
+        if (errno != ENOENT && errno != ENOTDIR &&
+                errno != EACCES && errno != EPERM)
+            walk_fail( w, errno, job->path);
+        free( job);
+        return;
+    }
+    while (!pool->stop) {
+        n = syscall( SYS_getdents64, fd, buf, sizeof buf);
+        if (n < 0) {
+            walk_fail( w, errno, job->path);
+            break;
+        }
+        if (n == 0)
+            break;
+        for (off = 0; off < n; off += d->d_reclen) {
+            d = (struct walk_dirent *) (buf + off);
+            if (d->d_name[ 0] == '.' && (d->d_name[ 1] == '\0' ||
+                        (d->d_name[ 1] == '.' && d->d_name[ 2] == '\0'))) {
+                d->d_type = WALK_SKIP;
+                continue;
+            }
+            if (d->d_type == DT_UNKNOWN) {
+                if (fstatat( fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                    continue;
+                d->d_type = IFTODT( st.st_mode);
+            }
+            if (d->d_type == DT_DIR &&
+                    walk_spawn( w, job->path, job->len, d->d_name) < 0)
+                break;
+        }
+        if (walk_emit( w, job, buf, n) < 0)
+            break;
+    }
+    close( fd);
+    free( job);
+}
+
+int
+walk_emit( struct walk *w, struct walk_job *job, char *buf, long n)
+{
+    struct walk_dirent *d;
+    struct walk_batch *b;
+    unsigned short l;
+    long off;
+    int r = 0;
+
+    pthread_mutex_lock( &w->pool.mutex);
+    for (off = 0; off < n && !w->pool.stop; off += d->d_reclen) {
+        d = (struct walk_dirent *) (buf + off);
+        if (d->d_type == WALK_SKIP)
+            continue;
+        b = w->current;
+        if (b == NULL) {
+            b = calloc( 1, sizeof *b);
+            if (b == NULL) {
+                r = -1;
+                break;
+            }
+            w->current = b;
+        }
+        if (b->serial != job->serial || b->count == 0) {
+            l = job->len;
+            if (walk_put( b, "\0", 1) < 0 || walk_put( b, &l, sizeof l) < 0 ||
+                    walk_put( b, job->path, l) < 0) {
+                r = -1;
+                break;
+            }
+            b->serial = job->serial;
+        }
+        l = strlen( d->d_name);
+        if (walk_put( b, "\1", 1) < 0 || walk_put( b, &d->d_type, 1) < 0 ||
+                walk_put( b, &d->d_ino, sizeof d->d_ino) < 0 ||
+                walk_put( b, &l, sizeof l) < 0 ||
+                walk_put( b, d->d_name, l) < 0) {
+            r = -1;
+            break;
+        }
+        if (++b->count >= w->batch) {
+            if (w->ready_tail != NULL)
+                w->ready_tail->next = b;
+            else
+                w->ready = b;
+            w->ready_tail = b;
+            w->current = NULL;
+            w->nready++;
+            pthread_cond_broadcast( &w->ready_cond);
+            while (w->nready >= WALK_MAXREADY && !w->pool.stop)
+                pthread_cond_wait( &w->space_cond, &w->pool.mutex);
+        }
+    }
+    pthread_mutex_unlock( &w->pool.mutex);
+    if (r < 0)
+        walk_fail( w, ENOMEM, job->path);
+    return r;
+}
+
+int
+walk_put( struct walk_batch *b, const void *p, size_t l)
+{
+    if (b->len + l > b->capa) {
+        size_t c = b->capa ? b->capa : 16384;
+        char *n;
+
+        while (c < b->len + l)
+            c *= 2;
+        n = realloc( b->buf, c);
+        if (n == NULL)
+            return -1;
+        b->buf = n;
+        b->capa = c;
+    }
+    memcpy( b->buf + b->len, p, l);
+    b->len += l;
+    return 0;
+}
+
+void
+walk_batch_free( struct walk_batch *b)
+{
+    if (b != NULL) {
+        free( b->buf);
+        free( b);
+    }
+}
+
+VALUE
+walk_yield( struct walk *w, struct walk_batch *b)
+{
+    VALUE dirs, names, types, inos, dir;
+    rb_encoding *enc;
+    unsigned short l;
+    unsigned char t;
+    uint64_t ino;
+    size_t i;
+
+    enc = rb_filesystem_encoding();
+    dirs  = rb_ary_new_capa( b->count);
+    names = rb_ary_new_capa( b->count);
+    types = rb_ary_new_capa( b->count);
+    inos  = rb_ary_new_capa( b->count);
+    dir = Qnil;
+    for (i = 0; i < b->len;) {
+        if (b->buf[ i++] == '\0') {
+            memcpy( &l, b->buf + i, sizeof l);
+            i += sizeof l;
+            dir = rb_str_dup( w->root);
+            if (l > 0) {
+                rb_str_cat( dir, "/", 1);
+                rb_str_cat( dir, b->buf + i, l);
+            }
+            rb_obj_freeze( dir);
+            i += l;
+        } else {
+            t = b->buf[ i++];
+            memcpy( &ino, b->buf + i, sizeof ino);
+            i += sizeof ino;
+            memcpy( &l, b->buf + i, sizeof l);
+            i += sizeof l;
+            rb_ary_push( dirs, dir);
+            rb_ary_push( names, rb_enc_str_new( b->buf + i, l, enc));
+            rb_ary_push( types, sym_types[ t & 15]);
+            rb_ary_push( inos, ULL2NUM( ino));
+            i += l;
+        }
+    }
+    return rb_yield_values( 4, dirs, names, types, inos);
+}
+
+
+void Init_dirwalk( void)
+{
+    int i;
+
+    rb_define_singleton_method( rb_cDir, "walk", rb_dir_s_walk, -1);
+
+    for (i = 0; i < 16; i++)
+        sym_types[ i] = ID2SYM( rb_intern( "unknown"));
+    sym_types[ DT_REG]  = ID2SYM( rb_intern( "file"));
+    sym_types[ DT_DIR]  = ID2SYM( rb_intern( "directory"));
+    sym_types[ DT_LNK]  = ID2SYM( rb_intern( "link"));
+    sym_types[ DT_CHR]  = ID2SYM( rb_intern( "characterSpecial"));
+    sym_types[ DT_BLK]  = ID2SYM( rb_intern( "blockSpecial"));
+    sym_types[ DT_FIFO] = ID2SYM( rb_intern( "fifo"));
+    sym_types[ DT_SOCK] = ID2SYM( rb_intern( "socket"));
+
+    id_batch = rb_intern( "batch");
+    id_threads = rb_intern( "threads");
+}
+
@@ -0,0 +1,729 @@
+/*
+ *  supplement/dirwatch.c  --  Watch directories for changes
+ */
+
+#include "dirwatch.h"
+
+#include <ruby/io.h>
+#include <ruby/thread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define WATCH_MASK  (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+                     IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define WATCH_BUF   (64 * 1024)
+
+
+/*
+ *  Events are merged per path until the window has passed.  The
+ *  index is an open-addressing table of positions + 1.
+ */
+
+struct watch_ev {
+    char     *path;
+    uint32_t  mask;
+};
+
+struct watch_batch {
+    struct watch_ev *ev;
+    size_t           n, capa;
+    size_t          *index;
+    size_t           imask;
+};
+
+struct watch {
+    pthread_mutex_t    mutex;
+    pthread_t          thread;
+    int                running;
+    int                recursive;
+    int                window;           /* milliseconds */
+    int                ifd;
+    int                stopfd;
+    int                notify;
+    VALUE              io;
+    char             **dirs;             /* by watch descriptor */
+    int                ndirs;
+    struct watch_batch pending;
+    struct timespec    deadline;
+    int                signalled;
+    volatile int       cancel;           /* interrupt Watch#add */
+};
+
+struct watch_add {
+    struct watch *w;
+    const char   *path;
+    int           err;
+};
+
+static struct watch *get_watch( VALUE);
+static void  watch_mark( void *);
+static void  watch_free( void *);
+static void  watch_stop( struct watch *);
+static void *watch_stop_nogvl( void *);
+static void *watch_add_nogvl( void *);
+static void  watch_add_ubf( void *);
+static int   watch_add_tree( struct watch *, const char *, int);
+static void  watch_forget( struct watch *, const char *);
+static void *watch_thread( void *);
+static void  watch_events( struct watch *, char *, ssize_t);
+static void  watch_record( struct watch *, const char *, const char *, uint32_t);
+static void  watch_batch_free( struct watch_batch *);
+static VALUE watch_batch_value( struct watch_batch *);
+
+static VALUE rb_cDirWatch;
+
+static ID id_recursive = 0;
+static ID id_window = 0;
+
+static const struct {
+    uint32_t    bit;
+    const char *name;
+} watch_flags[] = {
+    { IN_CREATE,      "create" },
+    { IN_DELETE,      "delete" },
+    { IN_MODIFY,      "modify" },
+    { IN_ATTRIB,      "attrib" },
+    { IN_MOVED_FROM,  "moved_from" },
+    { IN_MOVED_TO,    "moved_to" },
+    { IN_CLOSE_WRITE, "close_write" },
+    { IN_DELETE_SELF, "delete_self" },
+    { IN_MOVE_SELF,   "move_self" },
+    { IN_Q_OVERFLOW,  "overflow" },
+    { IN_ISDIR,       "directory" },
+};
+#define WATCH_NFLAGS (sizeof watch_flags / sizeof watch_flags[ 0])
+static VALUE watch_syms[ WATCH_NFLAGS];
+
+static const rb_data_type_t watch_data_type = {
+    "supplement:dirwatch",
+    { &watch_mark, &watch_free, NULL, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+/*
+ *  Document-class: Dir::Watch
+ *
+ *  Changes below some directories, reported by inotify.  A native
+ *  thread reads the events and merges everything that happens to the
+ *  same path within a short time window into one entry.  The batches
+ *  are fetched with #read or #each; #to_io may be passed to
+ *  <code>IO.select</code>.
+ */
+
+/*
+ *  call-seq:
+ *     Dir.watch( paths, recursive: true, window: 0.05)            -> watch
+ *     Dir.watch( paths, recursive: true, window: 0.05) { |w| ... } -> obj
+ *
+ *  Start watching one or more directories.  With
+ *  <code>recursive: true</code> all subdirectories are watched, too,
+ *  including those that are created later.  The contents of a newly
+ *  appeared directory are reported as <code>:create</code> events.
+ *
+ *  +window+ is the time in seconds that events are collected before a
+ *  batch is handed over.
+ *
+ *  With a block, the watch is passed to it and closed afterwards.
+ *
+ *     Dir.watch "incoming" do |w|
+ *       w.each { |path,events| process path if events.include? :close_write }
+ *     end
+ */
+
+VALUE
+rb_dir_s_watch( int argc, VALUE *argv, VALUE dir)
+{
+    VALUE paths, opts, obj, v;
+    struct watch *w;
+    sigset_t all, old;
+    int fds[ 2];
+    long i;
+
+    rb_scan_args( argc, argv, "1:", &paths, &opts);
+    paths = rb_Array( paths);
+
+    obj = TypedData_Make_Struct( rb_cDirWatch, struct watch,
+                                                    &watch_data_type, w);
+    pthread_mutex_init( &w->mutex, NULL);
+    w->ifd = w->stopfd = w->notify = -1;
+    w->io = Qnil;
+    w->recursive = 1;
+    w->window = 50;
+    if (!NIL_P( opts)) {
+        v = rb_hash_lookup2( opts, ID2SYM( id_recursive), Qundef);
+        if (v != Qundef)
+            w->recursive = RTEST( v);
+        v = rb_hash_aref( opts, ID2SYM( id_window));
+        if (!NIL_P( v)) {
+            double d = NUM2DBL( v);
+            if (d < 0.0)
+                rb_raise( rb_eArgError, "time window must not be negative");
+            w->window = (int) (d * 1000.0 + 0.5);
+        }
+    }
+
+    w->ifd = inotify_init1( IN_CLOEXEC | IN_NONBLOCK);
+    if (w->ifd < 0)
+        rb_sys_fail( "inotify_init1");
+    w->stopfd = eventfd( 0, EFD_CLOEXEC);
+    if (w->stopfd < 0)
+        rb_sys_fail( "eventfd");
+    if (pipe2( fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        rb_sys_fail( "pipe");
+    w->notify = fds[ 1];
+    w->io = rb_io_fdopen( fds[ 0], O_RDONLY, NULL);
+
+    for (i = 0; i < RARRAY_LEN( paths); i++)
+        rb_dirwatch_add( obj, RARRAY_AREF( paths, i));
+
+    sigfillset( &all);
+    pthread_sigmask( SIG_SETMASK, &all, &old);
+    i = pthread_create( &w->thread, NULL, &watch_thread, w);
+    pthread_sigmask( SIG_SETMASK, &old, NULL);
+    if (i != 0)
+        rb_syserr_fail( (int) i, "pthread_create");
+    w->running = 1;
+
+    if (rb_block_given_p())
+        return rb_ensure( rb_yield, obj, rb_dirwatch_close, obj);
+    return obj;
+}
+
+struct watch *
+get_watch( VALUE obj)
+{
+    struct watch *w;
+
+    TypedData_Get_Struct( obj, struct watch, &watch_data_type, w);
+    if (w->ifd < 0)
+        rb_raise( rb_eIOError, "closed watch");
+    return w;
+}
+
+void
+watch_mark( void *p)
+{
+    rb_gc_mark( ((struct watch *) p)->io);
+}
+
+void
+watch_free( void *p)
+{
+    struct watch *w = p;
+    int i;
+
+    watch_stop( w);
+    if (w->ifd >= 0)
+        close( w->ifd);
+    for (i = 0; i < w->ndirs; i++)
+        free( w->dirs[ i]);
+    free( w->dirs);
+    watch_batch_free( &w->pending);
+    pthread_mutex_destroy( &w->mutex);
+    xfree( w);
+}
+
+void
+watch_stop( struct watch *w)
+{
+    uint64_t one = 1;
+
+    if (w->running) {
+        (void) !write( w->stopfd, &one, sizeof one);
+        pthread_join( w->thread, NULL);
+        w->running = 0;
+    }
+    if (w->stopfd >= 0)
+        close( w->stopfd), w->stopfd = -1;
+    if (w->notify >= 0)
+        close( w->notify), w->notify = -1;
+}
+
+void *
+watch_stop_nogvl( void *p)
+{
+    watch_stop( p);
+    return NULL;
+}
+
+
+/*
+ *  call-seq:
+ *     watch.add( path)     -> watch
+ *
+ *  Watch another directory.
+ */
+
+VALUE
+rb_dirwatch_add( VALUE self, VALUE path)
+{
+    struct watch_add a;
+
+    FilePathValue( path);
+    for (;;) {
+        a.w = get_watch( self);
+        a.path = RSTRING_PTR( path);
+        a.w->cancel = 0;
+        rb_thread_call_without_gvl( &watch_add_nogvl, &a,
+                                    &watch_add_ubf, a.w);
+        if (a.err != EINTR)
+            break;
+        rb_thread_check_ints();
+    }
+    if (a.err)
+        rb_syserr_fail_str( a.err, path);
+    RB_GC_GUARD( path);
+    return self;
+}
+
+void *
+watch_add_nogvl( void *p)
+{
+    struct watch_add *a = p;
+
+    pthread_mutex_lock( &a->w->mutex);
+    a->err = watch_add_tree( a->w, a->path, 0) < 0 ? errno : 0;
+    pthread_mutex_unlock( &a->w->mutex);
+    return NULL;
+}
+
+/* Adding again after an interrupt is harmless; the watches are kept. */
+
+void
+watch_add_ubf( void *p)
+{
+    ((struct watch *) p)->cancel = 1;
+}
+
+/*
+ *  Add a watch and, if recursive, descend.  Called with the mutex held.
+ *  If +report+ is set, everything found below is recorded as created.
+ */
+
+int
+watch_add_tree( struct watch *w, const char *path, int report)
+{
+    DIR *d;
+    struct dirent *e;
+    struct stat st;
+    char sub[ PATH_MAX];
+    char **n;
+    int wd, isdir;
+
+    wd = inotify_add_watch( w->ifd, path, WATCH_MASK);
+    if (wd < 0)
+        return -1;
+    if (wd >= w->ndirs) {
+        n = realloc( w->dirs, (wd + 64) * sizeof (char *));
+        if (n == NULL) {
+            inotify_rm_watch( w->ifd, wd);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset( n + w->ndirs, 0, (wd + 64 - w->ndirs) * sizeof (char *));
+        w->dirs = n;
+        w->ndirs = wd + 64;
+    }
+    free( w->dirs[ wd]);
+    w->dirs[ wd] = strdup( path);
+    if (!w->recursive)
+        return 0;
+
+    d = opendir( path);
+    if (d == NULL)
+        return 0;
+    while ((e = readdir( d)) != NULL) {
+        if (!report && w->cancel) {
+            closedir( d);
+            errno = EINTR;
+            return -1;
+        }
+        if (e->d_name[ 0] == '.' && (e->d_name[ 1] == '\0' ||
+                    (e->d_name[ 1] == '.' && e->d_name[ 2] == '\0')))
+            continue;
+        if (snprintf( sub, sizeof sub, "%s/%s", path, e->d_name) >=
+                                                            (int) sizeof sub)
+            continue;
+        isdir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN && lstat( sub, &st) == 0)
+            isdir = S_ISDIR( st.st_mode);
+        if (report)
+            watch_record( w, sub, NULL, IN_CREATE | (isdir ? IN_ISDIR : 0));
+        if (isdir && watch_add_tree( w, sub, report) < 0 && errno == EINTR) {
+            closedir( d);
+            return -1;
+        }
+    }
+    closedir( d);
+    return 0;
+}
+
+/*
+ *  A directory moved away keeps its watches but the paths are wrong.
+ *  Drop them; the new place is added when it is reported.
+ */
+
+void
+watch_forget( struct watch *w, const char *path)
+{
+    size_t l = strlen( path);
+    int i;
+
+    for (i = 0; i < w->ndirs; i++)
+        if (w->dirs[ i] != NULL && strncmp( w->dirs[ i], path, l) == 0 &&
+                (w->dirs[ i][ l] == '\0' || w->dirs[ i][ l] == '/')) {
+            inotify_rm_watch( w->ifd, i);
+            free( w->dirs[ i]);
+            w->dirs[ i] = NULL;
+        }
+}
+
+
+void *
+watch_thread( void *p)
+{
+    struct watch *w = p;
+    char buf[ WATCH_BUF] __attribute__(( aligned( __alignof__( struct inotify_event))));
+    struct pollfd fds[ 2];
+    struct timespec now;
+    ssize_t n;
+    long t;
+    char c = 0;
+
+    fds[ 0].fd = w->stopfd;
+    fds[ 0].events = POLLIN;
+    fds[ 1].fd = w->ifd;
+    fds[ 1].events = POLLIN;
+    for (;;) {
+        t = -1;
+        pthread_mutex_lock( &w->mutex);
+        if (w->pending.n > 0 && !w->signalled) {
+            clock_gettime( CLOCK_MONOTONIC, &now);
+            t = (w->deadline.tv_sec - now.tv_sec) * 1000 +
+                (w->deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (t <= 0) {
+                w->signalled = 1;
+                (void) !write( w->notify, &c, 1);
+                t = -1;
+            }
+        }
+        pthread_mutex_unlock( &w->mutex);
+
+        if (poll( fds, 2, (int) t) < 0 && errno != EINTR)
+            break;
+        if (fds[ 0].revents)
+            break;
+        if (fds[ 1].revents & POLLIN) {
+            n = read( w->ifd, buf, sizeof buf);
+            if (n > 0) {
+                pthread_mutex_lock( &w->mutex);
+                watch_events( w, buf, n);
+                pthread_mutex_unlock( &w->mutex);
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR)
+                break;
+        }
+    }
+    return NULL;
+}
+
+/* Called with the mutex held. */
+
+void
+watch_events( struct watch *w, char *buf, ssize_t n)
+{
+    struct inotify_event *e;
+    const char *dir;
+    char sub[ PATH_MAX];
+    ssize_t off;
+
+    for (off = 0; off < n; off += sizeof *e + e->len) {
+        e = (struct inotify_event *) (buf + off);
+        if (e->mask & IN_Q_OVERFLOW) {
+            watch_record( w, "", NULL, IN_Q_OVERFLOW);
+            continue;
+        }
+        if (e->wd < 0 || e->wd >= w->ndirs || (dir = w->dirs[ e->wd]) == NULL)
+            continue;
+        if (e->mask & IN_IGNORED) {
+            free( w->dirs[ e->wd]);
+            w->dirs[ e->wd] = NULL;
+            continue;
+        }
+        watch_record( w, dir, e->len ? e->name : NULL, e->mask);
+        if (!w->recursive || !(e->mask & IN_ISDIR) || !e->len)
+            continue;
+        if (snprintf( sub, sizeof sub, "%s/%s", dir, e->name) >=
+                                                            (int) sizeof sub)
+            continue;
+        if (e->mask & IN_MOVED_FROM)
+            watch_forget( w, sub);
+        else if (e->mask & (IN_CREATE | IN_MOVED_TO))
+            watch_add_tree( w, sub, 1);
+    }
+}
+
+/* Called with the mutex held. */
+
+void
+watch_record( struct watch *w, const char *dir, const char *name, uint32_t mask)
+{
+    struct watch_batch *b = &w->pending;
+    char path[ PATH_MAX];
+    uint64_t h;
+    size_t i, j, *ni;
+    const char *q;
+
+    if (name != NULL) {
+        if (snprintf( path, sizeof path, "%s/%s", dir, name) >=
+                                                        (int) sizeof path)
+            return;
+        dir = path;
+    }
+    mask &= WATCH_MASK | IN_Q_OVERFLOW | IN_ISDIR;
+
+    for (h = 0xcbf29ce484222325ULL, q = dir; *q; q++)
+        h = (h ^ (unsigned char) *q) * 0x100000001b3ULL;
+    if (b->index != NULL)
+        for (i = h & b->imask; b->index[ i]; i = (i + 1) & b->imask)
+            if (strcmp( b->ev[ b->index[ i] - 1].path, dir) == 0) {
+                b->ev[ b->index[ i] - 1].mask |= mask;
+                return;
+            }
+
+    if (b->n == b->capa) {
+        struct watch_ev *ne;
+        size_t c = b->capa ? b->capa * 2 : 64;
+
+        ne = realloc( b->ev, c * sizeof *ne);
+        if (ne == NULL)
+            return;
+        b->ev = ne;
+        b->capa = c;
+    }
+    if ((b->n + 1) * 2 > (b->index ? b->imask + 1 : 0)) {
+        size_t m = b->index ? b->imask * 2 + 1 : 127;
+
+        ni = calloc( m + 1, sizeof *ni);
+        if (ni == NULL)
+            return;
+        for (j = 0; j < b->n; j++) {
+            for (h = 0xcbf29ce484222325ULL, q = b->ev[ j].path; *q; q++)
+                h = (h ^ (unsigned char) *q) * 0x100000001b3ULL;
+            for (i = h & m; ni[ i]; i = (i + 1) & m)
+                ;
+            ni[ i] = j + 1;
+        }
+        free( b->index);
+        b->index = ni;
+        b->imask = m;
+    }
+    for (i = h & b->imask; b->index[ i]; i = (i + 1) & b->imask)
+        ;
+    b->ev[ b->n].path = strdup( dir);
+    if (b->ev[ b->n].path == NULL)
+        return;
+    b->ev[ b->n].mask = mask;
+    b->index[ i] = ++b->n;
+
+    if (b->n == 1) {
+        clock_gettime( CLOCK_MONOTONIC, &w->deadline);
+        w->deadline.tv_sec += w->window / 1000;
+        w->deadline.tv_nsec += (long) (w->window % 1000) * 1000000;
+        if (w->deadline.tv_nsec >= 1000000000)
+            w->deadline.tv_sec++, w->deadline.tv_nsec -= 1000000000;
+    }
+}
+
+void
+watch_batch_free( struct watch_batch *b)
+{
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+        free( b->ev[ i].path);
+    free( b->ev);
+    free( b->index);
+    memset( b, 0, sizeof *b);
+}
+
+VALUE
+watch_batch_value( struct watch_batch *b)
+{
+    VALUE r, ev, path;
+    size_t i, j;
+
+    r = rb_ary_new_capa( b->n);
+    for (i = 0; i < b->n; i++) {
+        ev = rb_ary_new();
+        for (j = 0; j < WATCH_NFLAGS; j++)
+            if (b->ev[ i].mask & watch_flags[ j].bit)
+                rb_ary_push( ev, watch_syms[ j]);
+        path = *b->ev[ i].path ? rb_str_new_cstr( b->ev[ i].path) : Qnil;
+        rb_ary_push( r, rb_assoc_new( path, ev));
+    }
+    return r;
+}
+
+
+/*
+ *  call-seq:
+ *     watch.read( timeout = nil)     -> ary or nil
+ *
+ *  Wait for the next batch of changes.  Returns an array of pairs of a
+ *  path and the list of things that happened to it, like
+ *  <code>[:create, :close_write]</code>.  A path of +nil+ together with
+ *  <code>:overflow</code> means that events were lost.
+ *
+ *  Returns +nil+ when the timeout expired.
+ */
+
+VALUE
+rb_dirwatch_read( int argc, VALUE *argv, VALUE self)
+{
+    VALUE timeout, r;
+    struct watch *w;
+    struct watch_batch b;
+    char buf[ 64];
+
+    rb_scan_args( argc, argv, "01", &timeout);
+    for (;;) {
+        w = get_watch( self);
+        /*
+         * Drain first: a batch signalled from now on is either taken
+         * below or leaves its byte in the pipe.
+         */
+        while (read( rb_io_descriptor( w->io), buf, sizeof buf) > 0)
+            ;
+        memset( &b, 0, sizeof b);
+        pthread_mutex_lock( &w->mutex);
+        if (w->signalled) {
+            b = w->pending;
+            memset( &w->pending, 0, sizeof w->pending);
+            w->signalled = 0;
+        }
+        pthread_mutex_unlock( &w->mutex);
+        if (b.n > 0) {
+            r = watch_batch_value( &b);
+            watch_batch_free( &b);
+            return r;
+        }
+        if (!RTEST( rb_io_wait( w->io, INT2NUM( RUBY_IO_READABLE), timeout)))
+            return Qnil;
+    }
+}
+
+/*
+ *  call-seq:
+ *     watch.each { |path,events| ... }     -> nil
+ *
+ *  Yield changes until the watch is closed.
+ */
+
+VALUE
+rb_dirwatch_each( VALUE self)
+{
+    VALUE b;
+    long i;
+
+    RETURN_ENUMERATOR( self, 0, 0);
+    while (!RTEST( rb_dirwatch_closed_p( self))) {
+        b = rb_dirwatch_read( 0, NULL, self);
+        for (i = 0; !NIL_P( b) && i < RARRAY_LEN( b); i++)
+            rb_yield( RARRAY_AREF( b, i));
+    }
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     watch.to_io     -> io
+ *
+ *  An IO that becomes readable when a batch is ready.  Don't read from
+ *  it yourself; call #read.
+ */
+
+VALUE
+rb_dirwatch_to_io( VALUE self)
+{
+    return get_watch( self)->io;
+}
+
+/*
+ *  call-seq:
+ *     watch.close     -> nil
+ *
+ *  Stop watching.
+ */
+
+VALUE
+rb_dirwatch_close( VALUE self)
+{
+    struct watch *w;
+
+    TypedData_Get_Struct( self, struct watch, &watch_data_type, w);
+    if (w->ifd < 0)
+        return Qnil;
+    rb_thread_call_without_gvl( &watch_stop_nogvl, w, NULL, NULL);
+    close( w->ifd);
+    w->ifd = -1;
+    if (!NIL_P( w->io))
+        rb_io_close( w->io);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     watch.closed?     -> true or false
+ */
+
+VALUE
+rb_dirwatch_closed_p( VALUE self)
+{
+    struct watch *w;
+
+    TypedData_Get_Struct( self, struct watch, &watch_data_type, w);
+    return w->ifd < 0 ? Qtrue : Qfalse;
+}
+
+
+void Init_dirwatch( void)
+{
+    size_t i;
+
+    rb_define_singleton_method( rb_cDir, "watch", rb_dir_s_watch, -1);
+
+    rb_cDirWatch = rb_define_class_under( rb_cDir, "Watch", rb_cObject);
+    rb_undef_alloc_func( rb_cDirWatch);
+    rb_define_method( rb_cDirWatch, "add", rb_dirwatch_add, 1);
+    rb_define_method( rb_cDirWatch, "read", rb_dirwatch_read, -1);
+    rb_define_method( rb_cDirWatch, "each", rb_dirwatch_each, 0);
+    rb_define_method( rb_cDirWatch, "to_io", rb_dirwatch_to_io, 0);
+    rb_define_method( rb_cDirWatch, "close", rb_dirwatch_close, 0);
+    rb_define_method( rb_cDirWatch, "closed?", rb_dirwatch_closed_p, 0);
+
+    for (i = 0; i < WATCH_NFLAGS; i++)
+        watch_syms[ i] = ID2SYM( rb_intern( watch_flags[ i].name));
+
+    id_recursive = rb_intern( "recursive");
+    id_window    = rb_intern( "window");
+}
+
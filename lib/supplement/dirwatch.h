@@ -0,0 +1,23 @@
+/*
+ *  supplement/dirwatch.h  --  Watch directories for changes
+ */
+
+#ifndef __SUPPLEMENT_DIRWATCH_H__
+#define __SUPPLEMENT_DIRWATCH_H__
+
+#include <ruby/ruby.h>
+
+
+extern VALUE rb_dir_s_watch( int, VALUE *, VALUE);
+
+extern VALUE rb_dirwatch_add( VALUE, VALUE);
+extern VALUE rb_dirwatch_read( int, VALUE *, VALUE);
+extern VALUE rb_dirwatch_each( VALUE);
+extern VALUE rb_dirwatch_to_io( VALUE);
+extern VALUE rb_dirwatch_close( VALUE);
+extern VALUE rb_dirwatch_closed_p( VALUE);
+
+extern void Init_dirwatch( void);
+
+#endif
+
@@ -0,0 +1,240 @@
+/*
+ *  supplement/filescan.c  --  Regexp search in mapped files
+ */
+
+#include "filescan.h"
+
+#include <ruby/re.h>
+#include <ruby/encoding.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+struct filescan {
+    VALUE  path;
+    VALUE  re;
+    VALUE  str;
+    VALUE  data;
+    int    fd;
+    char  *base;
+    size_t size;
+    size_t chunk;
+    struct re_registers regs;
+};
+
+struct filescan_pos {
+    long pos;
+    long range;
+};
+
+static VALUE filescan_run( VALUE);
+static VALUE filescan_done( VALUE);
+static OnigPosition filescan_search( regex_t *, VALUE, struct re_registers *,
+                                     void *);
+
+static ID id_chunk = 0;
+static ID id_fixed_encoding_p = 0;
+static ID id_binread = 0;
+
+
+/*
+ *  Document-class: File
+ */
+
+/*
+ *  call-seq:
+ *     File.scan_offsets( path, pattern, chunk: 64 MiB) { |beg, end, ...| ... }  -> nil
+ *     File.scan_offsets( path, pattern, chunk: 64 MiB)                          -> enum
+ *
+ *  Search a file for +pattern+ without reading it into a String.  The
+ *  file is mapped into memory and the offsets of every match and its
+ *  groups are yielded like in <code>String#scan_offsets</code>.  They
+ *  are absolute byte positions in the file.  Files that report no
+ *  size, like those in /proc, are read into memory instead.
+ *
+ *  The file is processed in pieces of +chunk+ bytes.  Only the start
+ *  of a match is restricted to a chunk; the match itself may extend
+ *  into the following ones.  The next chunk is read ahead while the
+ *  current one is searched and pages already done are released.
+ *
+ *     File.scan_offsets "/var/log/messages", /error: (\w+)/ do |b,e,wb,we|
+ *       ...
+ *     end
+ */
+
+VALUE
+rb_file_s_scan_offsets( int argc, VALUE *argv, VALUE file)
+{
+    VALUE path, re, opts;
+    struct filescan fs;
+    struct stat st;
+
+    RETURN_ENUMERATOR( file, argc, argv);
+    rb_scan_args( argc, argv, "2:", &path, &re, &opts);
+    FilePathValue( path);
+    if (!RB_TYPE_P( re, T_REGEXP))
+        re = rb_reg_regcomp( rb_reg_quote( StringValue( re)));
+
+    MEMZERO( &fs, struct filescan, 1);
+    fs.data = Qnil;
+    fs.path = path;
+    fs.re = re;
+    fs.chunk = 64 << 20;
+    if (!NIL_P( opts)) {
+        VALUE c = rb_hash_aref( opts, ID2SYM( id_chunk));
+        if (!NIL_P( c))
+            fs.chunk = NUM2SIZET( c);
+        if (fs.chunk == 0)
+            rb_raise( rb_eArgError, "chunk size must be positive");
+    }
+
+    fs.fd = open( RSTRING_PTR( path), O_RDONLY | O_CLOEXEC);
+    if (fs.fd < 0)
+        rb_sys_fail_str( path);
+    if (fstat( fs.fd, &st) < 0) {
+        close( fs.fd);
+        rb_sys_fail_str( path);
+    }
+    fs.size = st.st_size;
+    if (fs.size == 0) {
+        /* Files like the ones in /proc tell no size; read them. */
+        close( fs.fd);
+        fs.fd = -1;
+        fs.data = rb_str_freeze( rb_funcall( rb_cIO, id_binread, 1, path));
+        fs.base = RSTRING_PTR( fs.data);
+        fs.size = RSTRING_LEN( fs.data);
+    } else {
+        fs.base = mmap( NULL, fs.size, PROT_READ, MAP_PRIVATE, fs.fd, 0);
+        if (fs.base == MAP_FAILED) {
+            close( fs.fd);
+            rb_sys_fail_str( path);
+        }
+    }
+    rb_ensure( filescan_run, (VALUE) &fs, filescan_done, (VALUE) &fs);
+    return Qnil;
+}
+
+VALUE
+filescan_run( VALUE v)
+{
+    struct filescan *fs = (struct filescan *) v;
+    rb_encoding *enc;
+    struct filescan_pos sp;
+    size_t pg, done;
+    VALUE buf[ 16];
+    VALUE *vals, tmp = 0;
+    int i, n;
+
+    if (fs->size == 0)
+        return Qnil;
+
+    /*
+     * The string just points to the mapping.  Binary data is always
+     * valid, so its coderange is set in advance and the regexp engine
+     * will not scan the whole file first.  A regexp with a fixed
+     * encoding needs that scan; invalid data raises an error then.
+     */
+    if (RTEST( rb_funcall( fs->re, id_fixed_encoding_p, 0))) {
+        enc = rb_enc_get( fs->re);
+        fs->str = rb_enc_str_new_static( fs->base, fs->size, enc);
+    } else {
+        enc = rb_ascii8bit_encoding();
+        fs->str = rb_enc_str_new_static( fs->base, fs->size, enc);
+        ENC_CODERANGE_SET( fs->str, ENC_CODERANGE_VALID);
+    }
+    rb_obj_freeze( fs->str);
+
+    pg = sysconf( _SC_PAGESIZE);
+    if (NIL_P( fs->data))
+        madvise( fs->base, fs->size, MADV_SEQUENTIAL);
+    done = 0;
+    for (sp.pos = 0; (size_t) sp.pos < fs->size;) {
+        sp.range = sp.pos + fs->chunk;
+        if ((size_t) sp.range > fs->size)
+            sp.range = fs->size;
+        if ((size_t) sp.range < fs->size && NIL_P( fs->data)) {
+            size_t a = sp.range & ~(pg - 1);
+            size_t l = fs->chunk < fs->size - a ? fs->chunk : fs->size - a;
+            madvise( fs->base + a, l, MADV_WILLNEED);
+        }
+        while (sp.pos < sp.range) {
+            long b, e;
+
+            if (rb_reg_onig_match( fs->re, fs->str, filescan_search,
+                                   &sp, &fs->regs) < 0)
+                break;
+            b = fs->regs.beg[ 0], e = fs->regs.end[ 0];
+            if (b >= sp.range)
+                break;
+            n = 2 * fs->regs.num_regs;
+            vals = n <= 16 ? buf : ALLOCV_N( VALUE, tmp, n);
+            for (i = 0; i < fs->regs.num_regs; i++) {
+                if (fs->regs.beg[ i] < 0)
+                    vals[ 2*i] = vals[ 2*i+1] = Qnil;
+                else {
+                    vals[ 2*i]   = LONG2NUM( fs->regs.beg[ i]);
+                    vals[ 2*i+1] = LONG2NUM( fs->regs.end[ i]);
+                }
+            }
+            rb_yield_values2( n, vals);
+            if (tmp)
+                ALLOCV_END( tmp), tmp = 0;
+            if (e > b)
+                sp.pos = e;
+            else if ((size_t) e < fs->size)
+                sp.pos = e + rb_enc_fast_mbclen( fs->base + e,
+                                                 fs->base + fs->size, enc);
+            else
+                sp.pos = e + 1;
+        }
+        if (sp.pos < sp.range)
+            sp.pos = sp.range;
+        if (((size_t) sp.range & ~(pg - 1)) > done && NIL_P( fs->data)) {
+            size_t d = (size_t) sp.range & ~(pg - 1);
+            madvise( fs->base + done, d - done, MADV_DONTNEED);
+            done = d;
+        }
+    }
+    return Qnil;
+}
+
+OnigPosition
+filescan_search( regex_t *reg, VALUE str, struct re_registers *regs,
+                 void *args)
+{
+    struct filescan_pos *sp = args;
+    const UChar *s, *e;
+
+    s = (const UChar *) RSTRING_PTR( str);
+    e = s + RSTRING_LEN( str);
+    return onig_search( reg, s, e, s + sp->pos, s + sp->range, regs,
+                        ONIG_OPTION_NONE);
+}
+
+VALUE
+filescan_done( VALUE v)
+{
+    struct filescan *fs = (struct filescan *) v;
+
+    onig_region_free( &fs->regs, 0);
+    if (fs->base != NULL && NIL_P( fs->data))
+        munmap( fs->base, fs->size);
+    if (fs->fd >= 0)
+        close( fs->fd);
+    return Qnil;
+}
+
+
+void Init_filescan( void)
+{
+    rb_define_singleton_method( rb_cFile, "scan_offsets", rb_file_s_scan_offsets, -1);
+
+    id_chunk = rb_intern( "chunk");
+    id_fixed_encoding_p = rb_intern( "fixed_encoding?");
+    id_binread = rb_intern( "binread");
+}
+
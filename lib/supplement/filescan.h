@@ -0,0 +1,16 @@
+/*
+ *  supplement/filescan.h  --  Regexp search in mapped files
+ */
+
+#ifndef __SUPPLEMENT_FILESCAN_H__
+#define __SUPPLEMENT_FILESCAN_H__
+
+#include <ruby/ruby.h>
+
+
+extern VALUE rb_file_s_scan_offsets( int, VALUE *, VALUE);
+
+extern void Init_filescan( void);
+
+#endif
+
@@ -4,6 +4,9 @@
 
 #include "filesys.h"
 
+#include <ruby/thread.h>
+
+#include <errno.h>
 #include <stdlib.h>
 #ifdef HAVE_HEADER_SYS_VFS_H
     /* Linux */
@@ -16,8 +19,14 @@
 #endif
 
 
+struct fsstat_call {
+    const char    *path;
+    struct statfs *st;
+    int            err;
+};
 
 static struct statfs *get_statfs( VALUE);
+static void *fsstat_nogvl( void *);
 
 static ID id_mul = 0;
 
@@ -60,21 +69,39 @@ rb_fsstat_s_alloc( VALUE klass)
  *   Filesys::Stat.new( dir_name)  => stat
  *
  * Create a Filesys::Stat object for the given file system.
+ *
+ * Other Ruby threads may run while the file system is asked.
  */
 
 VALUE
 rb_fsstat_init( VALUE obj, VALUE dname)
 {
-    struct statfs *st;
+    struct fsstat_call c;
 
-    TypedData_Get_Struct( obj, struct statfs, &fsstat_data_type, st);
+    TypedData_Get_Struct( obj, struct statfs, &fsstat_data_type, c.st);
 
     SafeStringValue( dname);
-    if (statfs( StringValueCStr( dname), st) == -1)
-        rb_sys_fail( RSTRING_PTR(dname));
+    c.path = StringValueCStr( dname);
+    do {
+        rb_thread_call_without_gvl( &fsstat_nogvl, &c, RUBY_UBF_IO, NULL);
+        if (c.err == EINTR)
+            rb_thread_check_ints();
+    } while (c.err == EINTR);
+    if (c.err)
+        rb_syserr_fail( c.err, RSTRING_PTR(dname));
+    RB_GC_GUARD( dname);
     return Qnil;
 }
 
+void *
+fsstat_nogvl( void *p)
+{
+    struct fsstat_call *c = p;
+
+    c->err = statfs( c->path, c->st) < 0 ? errno : 0;
+    return NULL;
+}
+
 
 struct statfs *
 get_statfs( VALUE self)
@@ -358,5 +385,9 @@ void Init_filesys( void)
     rb_define_method( rb_cFilesysStat, "inspect", rb_fsstat_inspect, 0);
 
     id_mul = rb_intern( "*");
+
+    Init_fswatch();
+    Init_fsmounts();
+    Init_fssync();
 }
 
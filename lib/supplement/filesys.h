@@ -29,7 +29,26 @@ extern VALUE rb_fsstat_pavail( VALUE);
 
 extern VALUE rb_fsstat_inspect( VALUE);
 
+extern VALUE rb_fs_s_watch( int, VALUE *, VALUE);
+extern VALUE rb_fs_s_avail( VALUE, VALUE);
+
+extern VALUE rb_fs_s_mounts( VALUE);
+extern VALUE rb_fs_s_df( int, VALUE *, VALUE);
+
+extern VALUE rb_fs_s_syncfs( VALUE, VALUE);
+extern VALUE rb_file_s_fdatasync_all( int, VALUE *, VALUE);
+extern VALUE rb_io_writeback( int, VALUE *, VALUE);
+
+extern VALUE rb_fswatch_read( int, VALUE *, VALUE);
+extern VALUE rb_fswatch_each( VALUE);
+extern VALUE rb_fswatch_to_io( VALUE);
+extern VALUE rb_fswatch_close( VALUE);
+extern VALUE rb_fswatch_closed_p( VALUE);
+
 extern void Init_filesys( void);
+extern void Init_fswatch( void);
+extern void Init_fsmounts( void);
+extern void Init_fssync( void);
 
 #endif
 
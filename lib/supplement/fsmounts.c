@@ -0,0 +1,446 @@
+/*
+ *  supplement/fsmounts.c  --  Table of mounted file systems
+ */
+
+#include "filesys.h"
+
+#include <ruby/thread.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_HEADER_SYS_VFS_H
+    #include <sys/vfs.h>
+    #define FSID_val __val
+#else
+    #include <sys/param.h>
+    #include <sys/mount.h>
+    #define FSID_val val
+#endif
+
+
+#define MOUNTINFO   "/proc/self/mountinfo"
+#define DF_STACK    (64 * 1024)
+
+
+/*
+ *  Every statfs() gets a detached thread of its own.  When the timeout
+ *  expires, the caller leaves; a thread that hangs in a dead NFS mount
+ *  is simply forgotten.  The last one to leave frees the run.
+ */
+
+struct df_job {
+    char          *path;
+    struct statfs  st;
+    int            err;
+    int            done;
+};
+
+struct df_run {
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    int              refs;
+    size_t           pending;
+    int              stop;
+    struct timespec  deadline;
+    struct df_job   *jobs;
+    size_t           n;
+};
+
+struct df_arg {
+    struct df_run *run;
+    size_t         i;
+};
+
+static char *mounts_field( char **);
+static VALUE mounts_table( struct df_run *);
+static void  df_start( struct df_run *);
+static void *df_thread( void *);
+static void *df_wait_nogvl( void *);
+static void  df_wait_ubf( void *);
+static VALUE df_check_ints( VALUE);
+static void  df_release( struct df_run *);
+static void  df_jobs_free( struct df_run *);
+
+static ID id_timeout = 0;
+
+static const char *mounts_cols[] = {
+    "mount_point", "source", "fstype", "options", "dev"
+};
+#define MOUNTS_NCOLS 5
+
+static const char *df_cols[] = {
+    "type", "bsize", "blocks", "bfree", "bavail", "files", "ffree", "fsid",
+    "error"
+};
+#define DF_NCOLS 9
+
+static VALUE mounts_syms[ MOUNTS_NCOLS];
+static VALUE df_syms[ DF_NCOLS];
+
+
+/*
+ *  call-seq:
+ *     Filesys.mounts()    -> hash
+ *
+ *  The mounted file systems as seen by this process, read from
+ *  <code>/proc/self/mountinfo</code>.  The result is a table of
+ *  columns: a hash of equally long arrays under the keys
+ *  <code>:mount_point</code>, <code>:source</code>,
+ *  <code>:fstype</code>, <code>:options</code> and <code>:dev</code>
+ *  (<code>"major:minor"</code>).
+ *
+ *     m = Filesys.mounts
+ *     m[ :mount_point].zip m[ :fstype]    #=> [["/", "ext4"], ...]
+ */
+
+VALUE
+rb_fs_s_mounts( VALUE fs)
+{
+    struct df_run run;
+    VALUE r;
+
+    memset( &run, 0, sizeof run);
+    r = mounts_table( &run);
+    df_jobs_free( &run);
+    return r;
+}
+
+/*
+ *  call-seq:
+ *     Filesys.df( timeout: 2)    -> hash
+ *
+ *  Like <code>Filesys.mounts</code> with the values of
+ *  <code>Filesys::Stat</code> added as further columns
+ *  <code>:type</code>, <code>:bsize</code>, <code>:blocks</code>,
+ *  <code>:bfree</code>, <code>:bavail</code>, <code>:files</code>,
+ *  <code>:ffree</code> and <code>:fsid</code>.
+ *
+ *  All mounts are asked at the same time and other Ruby threads may
+ *  run meanwhile.  A mount that doesn't answer within +timeout+
+ *  seconds, like a hung NFS server, gets +nil+ values and an
+ *  <code>Errno::ETIMEDOUT</code> in the <code>:error</code> column.
+ *  Other failures show up there as well.
+ */
+
+VALUE
+rb_fs_s_df( int argc, VALUE *argv, VALUE fs)
+{
+    VALUE opts, v, r, cols[ DF_NCOLS];
+    struct df_run tmp, *run;
+    struct df_job *j;
+    double t = 2.0;
+    size_t i, k;
+    int state;
+
+    rb_scan_args( argc, argv, ":", &opts);
+    if (!NIL_P( opts)) {
+        v = rb_hash_aref( opts, ID2SYM( id_timeout));
+        if (!NIL_P( v))
+            t = NUM2DBL( v);
+    }
+
+    memset( &tmp, 0, sizeof tmp);
+    r = mounts_table( &tmp);
+    run = malloc( sizeof *run);
+    if (run == NULL) {
+        df_jobs_free( &tmp);
+        rb_memerror();
+    }
+    *run = tmp;
+    pthread_mutex_init( &run->mutex, NULL);
+    pthread_cond_init( &run->cond, NULL);
+    run->refs = 1;
+    clock_gettime( CLOCK_REALTIME, &run->deadline);
+    run->deadline.tv_sec += (time_t) t;
+    run->deadline.tv_nsec += (long) ((t - (time_t) t) * 1e9);
+    if (run->deadline.tv_nsec >= 1000000000L)
+        run->deadline.tv_sec++, run->deadline.tv_nsec -= 1000000000L;
+
+    df_start( run);
+    for (;;) {
+        rb_thread_call_without_gvl( &df_wait_nogvl, run, &df_wait_ubf, run);
+        if (!run->stop)
+            break;
+        run->stop = 0;
+        rb_protect( &df_check_ints, Qnil, &state);
+        if (state) {
+            df_release( run);
+            rb_jump_tag( state);
+        }
+    }
+
+    for (k = 0; k < DF_NCOLS; k++)
+        cols[ k] = rb_ary_new_capa( run->n);
+    pthread_mutex_lock( &run->mutex);
+    for (i = 0; i < run->n; i++) {
+        j = run->jobs + i;
+        if (j->done && !j->err) {
+            rb_ary_push( cols[ 0], LONG2NUM( j->st.f_type));
+            rb_ary_push( cols[ 1], LONG2NUM( j->st.f_bsize));
+            rb_ary_push( cols[ 2], ULL2NUM( j->st.f_blocks));
+            rb_ary_push( cols[ 3], ULL2NUM( j->st.f_bfree));
+            rb_ary_push( cols[ 4], ULL2NUM( j->st.f_bavail));
+            rb_ary_push( cols[ 5], ULL2NUM( j->st.f_files));
+            rb_ary_push( cols[ 6], ULL2NUM( j->st.f_ffree));
+            rb_ary_push( cols[ 7], rb_ary_new3( 2,
+                                INT2NUM( j->st.f_fsid.FSID_val[ 0]),
+                                INT2NUM( j->st.f_fsid.FSID_val[ 1])));
+            rb_ary_push( cols[ 8], Qnil);
+        } else {
+            for (k = 0; k < DF_NCOLS - 1; k++)
+                rb_ary_push( cols[ k], Qnil);
+            rb_ary_push( cols[ 8],
+                    rb_syserr_new( j->done ? j->err : ETIMEDOUT, j->path));
+        }
+    }
+    pthread_mutex_unlock( &run->mutex);
+    df_release( run);
+
+    for (k = 0; k < DF_NCOLS; k++)
+        rb_hash_aset( r, df_syms[ k], cols[ k]);
+    return r;
+}
+
+/*
+ *  Read the mount table.  The mount points are left in +run+ for the
+ *  statfs() calls.
+ */
+
+VALUE
+mounts_table( struct df_run *run)
+{
+    VALUE r, cols[ MOUNTS_NCOLS];
+    FILE *f;
+    char *line = NULL, *p, *fld[ 10], *q;
+    size_t len = 0, capa = 0, k;
+    int e;
+
+    f = fopen( MOUNTINFO, "re");
+    if (f == NULL)
+        rb_sys_fail( MOUNTINFO);
+    for (k = 0; k < MOUNTS_NCOLS; k++)
+        cols[ k] = rb_ary_new();
+    while (getline( &line, &len, f) > 0) {
+        /* id parent dev root point options [optional...] - type source super */
+        p = line;
+        for (k = 0; k < 6; k++)
+            fld[ k] = mounts_field( &p);
+        do
+            q = mounts_field( &p);
+        while (*q != '\0' && strcmp( q, "-") != 0);
+        fld[ 6] = mounts_field( &p);
+        fld[ 7] = mounts_field( &p);
+        if (*fld[ 4] == '\0' || *fld[ 6] == '\0')
+            continue;
+        if (run->n == capa) {
+            struct df_job *n;
+
+            n = realloc( run->jobs, (capa + 32) * sizeof *n);
+            if (n == NULL) {
+                fclose( f);
+                free( line);
+                df_jobs_free( run);
+                rb_memerror();
+            }
+            run->jobs = n, capa += 32;
+        }
+        memset( run->jobs + run->n, 0, sizeof *run->jobs);
+        run->jobs[ run->n].path = strdup( fld[ 4]);
+        run->n++;
+        rb_ary_push( cols[ 0], rb_str_new_cstr( fld[ 4]));
+        rb_ary_push( cols[ 1], rb_str_new_cstr( fld[ 7]));
+        rb_ary_push( cols[ 2], rb_str_new_cstr( fld[ 6]));
+        rb_ary_push( cols[ 3], rb_str_new_cstr( fld[ 5]));
+        rb_ary_push( cols[ 4], rb_str_new_cstr( fld[ 2]));
+    }
+    e = ferror( f) ? errno : 0;
+    fclose( f);
+    free( line);
+    if (e) {
+        df_jobs_free( run);
+        rb_syserr_fail( e, MOUNTINFO);
+    }
+
+    r = rb_hash_new();
+    for (k = 0; k < MOUNTS_NCOLS; k++)
+        rb_hash_aset( r, mounts_syms[ k], cols[ k]);
+    return r;
+}
+
+/*
+ *  Cut the next space separated field and undo the octal escapes of
+ *  blanks and backslashes.  Returns "" at the end of the line.
+ */
+
+char *
+mounts_field( char **pp)
+{
+    char *p = *pp, *r, *w;
+
+    while (*p == ' ')
+        p++;
+    r = w = p;
+    while (*p != '\0' && *p != ' ' && *p != '\n') {
+        if (p[ 0] == '\\' && p[ 1] >= '0' && p[ 1] <= '3' &&
+                p[ 2] >= '0' && p[ 2] <= '7' && p[ 3] >= '0' && p[ 3] <= '7') {
+            *w++ = (char) ((p[ 1] - '0') << 6 | (p[ 2] - '0') << 3 | (p[ 3] - '0'));
+            p += 4;
+        } else
+            *w++ = *p++;
+    }
+    if (*p != '\0')
+        p++;
+    *w = '\0';
+    *pp = p;
+    return r;
+}
+
+
+void
+df_start( struct df_run *run)
+{
+    struct df_arg *a;
+    pthread_attr_t attr;
+    pthread_t t;
+    sigset_t all, old;
+    size_t i;
+    int e;
+
+    pthread_attr_init( &attr);
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize( &attr, DF_STACK);
+    sigfillset( &all);
+    pthread_sigmask( SIG_SETMASK, &all, &old);
+    for (i = 0; i < run->n; i++) {
+        a = malloc( sizeof *a);
+        e = ENOMEM;
+        if (a != NULL && run->jobs[ i].path != NULL) {
+            a->run = run, a->i = i;
+            pthread_mutex_lock( &run->mutex);
+            run->refs++, run->pending++;
+            pthread_mutex_unlock( &run->mutex);
+            e = pthread_create( &t, &attr, &df_thread, a);
+            if (e == 0)
+                continue;
+            pthread_mutex_lock( &run->mutex);
+            run->refs--, run->pending--;
+            pthread_mutex_unlock( &run->mutex);
+        }
+        free( a);
+        run->jobs[ i].err = e;
+        run->jobs[ i].done = 1;
+    }
+    pthread_sigmask( SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy( &attr);
+}
+
+void *
+df_thread( void *p)
+{
+    struct df_arg *a = p;
+    struct df_run *run = a->run;
+    struct df_job *j = run->jobs + a->i;
+    struct statfs st;
+    int e;
+
+    free( a);
+    e = statfs( j->path, &st) < 0 ? errno : 0;
+    pthread_mutex_lock( &run->mutex);
+    j->st = st;
+    j->err = e;
+    j->done = 1;
+    if (--run->pending == 0)
+        pthread_cond_broadcast( &run->cond);
+    pthread_mutex_unlock( &run->mutex);
+    df_release( run);
+    return NULL;
+}
+
+void *
+df_wait_nogvl( void *p)
+{
+    struct df_run *run = p;
+
+    pthread_mutex_lock( &run->mutex);
+    while (run->pending > 0 && !run->stop)
+        if (pthread_cond_timedwait( &run->cond, &run->mutex,
+                                    &run->deadline) == ETIMEDOUT)
+            break;
+    pthread_mutex_unlock( &run->mutex);
+    return NULL;
+}
+
+VALUE
+df_check_ints( VALUE v)
+{
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+void
+df_wait_ubf( void *p)
+{
+    struct df_run *run = p;
+
+    pthread_mutex_lock( &run->mutex);
+    run->stop = 1;
+    pthread_cond_broadcast( &run->cond);
+    pthread_mutex_unlock( &run->mutex);
+}
+
+/*
+ *  This may be called from a native thread, so plain free() is used
+ *  throughout.
+ */
+
+void
+df_release( struct df_run *run)
+{
+    int last;
+
+    pthread_mutex_lock( &run->mutex);
+    last = --run->refs == 0;
+    pthread_mutex_unlock( &run->mutex);
+    if (!last)
+        return;
+    df_jobs_free( run);
+    pthread_cond_destroy( &run->cond);
+    pthread_mutex_destroy( &run->mutex);
+    free( run);
+}
+
+void
+df_jobs_free( struct df_run *run)
+{
+    size_t i;
+
+    for (i = 0; i < run->n; i++)
+        free( run->jobs[ i].path);
+    free( run->jobs);
+    run->jobs = NULL;
+    run->n = 0;
+}
+
+
+void Init_fsmounts( void)
+{
+    VALUE rb_mFilesys;
+    int k;
+
+    rb_mFilesys = rb_define_module( "Filesys");
+    rb_define_singleton_method( rb_mFilesys, "mounts", rb_fs_s_mounts, 0);
+    rb_define_singleton_method( rb_mFilesys, "df", rb_fs_s_df, -1);
+
+    for (k = 0; k < MOUNTS_NCOLS; k++)
+        mounts_syms[ k] = ID2SYM( rb_intern( mounts_cols[ k]));
+    for (k = 0; k < DF_NCOLS; k++)
+        df_syms[ k] = ID2SYM( rb_intern( df_cols[ k]));
+
+    id_timeout = rb_intern( "timeout");
+}
+
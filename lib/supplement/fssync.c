@@ -0,0 +1,265 @@
+/*
+ *  supplement/fssync.c  --  Flush just the data you need
+ */
+
+#include "filesys.h"
+#include "pool.h"
+
+#include <ruby/io.h>
+#include <ruby/thread.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+struct fssync_one {
+    int    fd;
+    off_t  offset, len;
+    int    flags;
+    int    err;
+};
+
+struct fsync_job {
+    struct supplement_pool_job link;
+    int                        fd;
+    int                        done;
+    int                        err;
+};
+
+struct fsync_all {
+    struct supplement_pool  pool;
+    struct fsync_job       *jobs;
+    long                    n;
+    int                     threads;
+};
+
+static void *syncfs_nogvl( void *);
+static void *writeback_nogvl( void *);
+static void *fsync_all_nogvl( void *);
+static void  fsync_all_ubf( void *);
+static void  fsync_work( struct supplement_pool *, struct supplement_pool_job *);
+static void  fsync_drop( struct supplement_pool *, struct supplement_pool_job *);
+
+static ID id_threads = 0;
+static ID id_wait = 0;
+
+
+/*
+ *  call-seq:
+ *     Filesys.syncfs( path_or_io)    -> nil
+ *
+ *  Write the cached data of just the file system that +path_or_io+
+ *  is on to disk.  Unlike <code>Process.sync</code>, other file systems
+ *  on the host are left alone.  Other Ruby threads may run meanwhile.
+ */
+
+VALUE
+rb_fs_s_syncfs( VALUE fs, VALUE obj)
+{
+    struct fssync_one s;
+    VALUE io, path = Qnil;
+    int own = 0;
+
+    io = rb_check_convert_type( obj, T_FILE, "IO", "to_io");
+    if (!NIL_P( io)) {
+        rb_io_flush( io);
+        s.fd = rb_io_descriptor( io);
+    } else {
+        path = obj;
+        FilePathValue( path);
+        s.fd = rb_cloexec_open( StringValueCStr( path), O_RDONLY, 0);
+        if (s.fd < 0)
+            rb_sys_fail_str( path);
+        own = 1;
+    }
+    rb_thread_call_without_gvl( &syncfs_nogvl, &s, NULL, NULL);
+    if (own)
+        close( s.fd);
+    if (s.err) {
+        if (NIL_P( path))
+            rb_syserr_fail( s.err, "syncfs");
+        rb_syserr_fail_str( s.err, path);
+    }
+    RB_GC_GUARD( path);
+    return Qnil;
+}
+
+void *
+syncfs_nogvl( void *p)
+{
+    struct fssync_one *s = p;
+
+    s->err = syncfs( s->fd) < 0 ? errno : 0;
+    return NULL;
+}
+
+
+/*
+ *  call-seq:
+ *     File.fdatasync_all( ios, threads: true)    -> ios
+ *
+ *  Flush and <code>fdatasync</code> every IO in +ios+, which may also
+ *  be a single IO.  The descriptors
+ *  are synced in parallel by +threads+ native threads (by default one
+ *  per processor), so the device sees all the requests at once.  The
+ *  GVL is released meanwhile.
+ *
+ *  If some of them fail, the first error is raised after all have
+ *  been tried.
+ *
+ *     File.fdatasync_all [journal, index, data]
+ */
+
+VALUE
+rb_file_s_fdatasync_all( int argc, VALUE *argv, VALUE file)
+{
+    VALUE ios, opts, v, tmp = 0;
+    struct fsync_all a;
+    long i;
+
+    rb_scan_args( argc, argv, "1:", &ios, &opts);
+    /* Not rb_Array(): IO#to_a would read the whole file. */
+    v = rb_io_check_io( ios);
+    if (NIL_P( v))
+        v = rb_check_array_type( ios);
+    else
+        v = rb_ary_new3( 1, v);
+    if (NIL_P( v))
+        rb_raise( rb_eTypeError, "no implicit conversion of %" PRIsVALUE
+                                " into Array", rb_obj_class( ios));
+    ios = rb_ary_dup( v);
+    v = NIL_P( opts) ? Qundef :
+                rb_hash_lookup2( opts, ID2SYM( id_threads), Qundef);
+    a.threads = supplement_pool_threads( v == Qundef ? Qtrue : v);
+    a.n = RARRAY_LEN( ios);
+    if (a.threads > a.n)
+        a.threads = (int) a.n;
+    a.jobs = ALLOCV_N( struct fsync_job, tmp, a.n);
+    for (i = 0; i < a.n; i++) {
+        v = rb_io_get_io( RARRAY_AREF( ios, i));
+        RARRAY_ASET( ios, i, v);
+        rb_io_flush( v);
+        a.jobs[ i].fd = rb_io_descriptor( v);
+        a.jobs[ i].done = 0;
+        a.jobs[ i].err = 0;
+    }
+    for (;;) {
+        supplement_pool_init( &a.pool, &fsync_work, &fsync_drop, &a);
+        rb_thread_call_without_gvl( &fsync_all_nogvl, &a, &fsync_all_ubf, &a);
+        supplement_pool_destroy( &a.pool);
+        if (!a.pool.stop)
+            break;
+        rb_thread_check_ints();
+    }
+    for (i = 0; i < a.n; i++)
+        if (a.jobs[ i].err) {
+            v = rb_io_path( RARRAY_AREF( ios, i));
+            rb_syserr_fail_str( a.jobs[ i].err,
+                        NIL_P( v) ? rb_str_new_cstr( "fdatasync") : v);
+        }
+    ALLOCV_END( tmp);
+    return ios;
+}
+
+void *
+fsync_all_nogvl( void *p)
+{
+    struct fsync_all *a = p;
+    long i;
+
+    for (i = 0; i < a->n; i++)
+        if (!a->jobs[ i].done)
+            supplement_pool_push( &a->pool, &a->jobs[ i].link);
+    supplement_pool_run( &a->pool, a->threads);
+    return NULL;
+}
+
+void
+fsync_all_ubf( void *p)
+{
+    supplement_pool_stop( &((struct fsync_all *) p)->pool);
+}
+
+void
+fsync_work( struct supplement_pool *pool, struct supplement_pool_job *l)
+{
+    struct fsync_job *j = (struct fsync_job *) l;
+
+    while (fdatasync( j->fd) < 0)
+        if (errno != EINTR) {
+            j->err = errno;
+            break;
+        }
+    j->done = 1;
+}
+
+/* The jobs live in an array; the ones not reached are retried. */
+
+void
+fsync_drop( struct supplement_pool *pool, struct supplement_pool_job *l)
+{
+}
+
+
+/*
+ *  call-seq:
+ *     io.writeback( offset = 0, len = 0, wait: false)    -> io
+ *
+ *  Start writing the dirty pages of the given range to disk but don't
+ *  wait for it to finish.  A +len+ of zero means up to the end of the
+ *  file.  This is <code>sync_file_range(2)</code>; it makes a later
+ *  <code>fdatasync</code> cheap without blocking now.
+ *
+ *  With <code>wait: true</code>, return when the range has been
+ *  written.  Note that neither form flushes metadata or the disk's
+ *  write cache, so it is no replacement for <code>fdatasync</code>.
+ */
+
+VALUE
+rb_io_writeback( int argc, VALUE *argv, VALUE io)
+{
+    VALUE offset, len, opts;
+    struct fssync_one s;
+
+    rb_scan_args( argc, argv, "02:", &offset, &len, &opts);
+    io = rb_io_get_io( io);
+    rb_io_flush( io);
+    s.fd = rb_io_descriptor( io);
+    s.offset = NIL_P( offset) ? 0 : NUM2OFFT( offset);
+    s.len = NIL_P( len) ? 0 : NUM2OFFT( len);
+    s.flags = SYNC_FILE_RANGE_WRITE;
+    if (!NIL_P( opts) && RTEST( rb_hash_aref( opts, ID2SYM( id_wait))))
+        s.flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+    rb_thread_call_without_gvl( &writeback_nogvl, &s, RUBY_UBF_IO, NULL);
+    if (s.err)
+        rb_syserr_fail_str( s.err, rb_io_path( io));
+    return io;
+}
+
+void *
+writeback_nogvl( void *p)
+{
+    struct fssync_one *s = p;
+
+    s->err = sync_file_range( s->fd, s->offset, s->len, s->flags) < 0 ?
+                                                                errno : 0;
+    return NULL;
+}
+
+
+void Init_fssync( void)
+{
+    VALUE rb_mFilesys;
+
+    rb_mFilesys = rb_define_module( "Filesys");
+    rb_define_singleton_method( rb_mFilesys, "syncfs", rb_fs_s_syncfs, 1);
+    rb_define_singleton_method( rb_cFile, "fdatasync_all",
+                                            rb_file_s_fdatasync_all, -1);
+    rb_define_method( rb_cIO, "writeback", rb_io_writeback, -1);
+
+    id_threads = rb_intern( "threads");
+    id_wait    = rb_intern( "wait");
+}
+
@@ -0,0 +1,556 @@
+/*
+ *  supplement/fswatch.c  --  Watch free space of file systems
+ */
+
+#include "filesys.h"
+
+#include <ruby/io.h>
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_HEADER_SYS_VFS_H
+    #include <sys/vfs.h>
+#else
+    #include <sys/param.h>
+    #include <sys/mount.h>
+#endif
+
+
+/*
+ *  The latest sample of every watched path is kept here, so that
+ *  Filesys.avail may be answered without a system call.  All watches
+ *  of the process are chained together under one mutex.
+ *
+ *  The sampler thread is detached and holds a reference of its own:
+ *  a statfs() on a hung network mount may block for long, and neither
+ *  #close nor the GC should wait for it.  Whoever drops the last
+ *  reference frees the watch.
+ */
+
+struct fswatch_path {
+    char          *path;
+    struct statfs  st;
+    int            valid;
+    int            low;
+};
+
+struct fswatch_cross {
+    size_t  i;
+    int     low;
+    double  pct;
+};
+
+struct fswatch {
+    struct fswatch       *next;
+    int                   refs;
+    int                   running;
+    int                   closed;
+    pid_t                 pid;
+    int                   interval;      /* milliseconds */
+    double                below, hysteresis;
+    int                   stopfd;
+    int                   notify;
+    VALUE                 io;
+    struct fswatch_path  *paths;
+    size_t                npaths;
+    struct fswatch_cross *cross;
+    size_t                ncross, capa;
+};
+
+static pthread_mutex_t fswatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fswatch *fswatch_all = NULL;
+
+static struct fswatch *get_fswatch( VALUE);
+static void  fswatch_mark( void *);
+static void  fswatch_free( void *);
+static void  fswatch_stop( struct fswatch *);
+static void  fswatch_release( struct fswatch *);
+static int   fswatch_foreign( struct fswatch *);
+static void *fswatch_thread( void *);
+static int   fswatch_sample( struct fswatch *, size_t);
+
+static VALUE rb_cFilesysWatch;
+
+static ID id_interval = 0;
+static ID id_below_pct = 0;
+static ID id_hysteresis = 0;
+static VALUE sym_low, sym_ok;
+
+static const rb_data_type_t fswatch_data_type = {
+    "supplement:fswatch",
+    { &fswatch_mark, &fswatch_free, NULL, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+/*
+ *  Document-class: Filesys::Watch
+ *
+ *  A native thread that samples the free space of some file systems in
+ *  regular intervals.  Whenever the available percentage falls below a
+ *  threshold, or rises above it again by more than the hysteresis, a
+ *  crossing is reported through #read or #each.  Samples in between
+ *  produce nothing.
+ */
+
+/*
+ *  call-seq:
+ *     Filesys.watch( paths, interval: 5, below_pct: 10, hysteresis: 1)              -> watch
+ *     Filesys.watch( paths, interval: 5, below_pct: 10, hysteresis: 1) { |w| ... }  -> obj
+ *
+ *  Start watching the file systems that +paths+ are on.  +interval+ is
+ *  the time in seconds between two samples.  A path is reported
+ *  <code>:low</code> when its <code>pavail</code> drops below
+ *  +below_pct+ and <code>:ok</code> when it reaches
+ *  <code>below_pct + hysteresis</code> again.  A file system that is
+ *  already low at the first sample is reported at once.
+ *
+ *  Crossings are not called back from the sampler thread, which cannot
+ *  run Ruby code; they are read by Filesys::Watch#read or #each, or
+ *  waited for through #to_io.  With a block, the watch is passed to
+ *  it and closed afterwards.
+ *
+ *     Filesys.watch %w(/var/spool /srv), below_pct: 5 do |w|
+ *       w.each { |path,state,pct| shed_load path if state == :low }
+ *     end
+ */
+
+VALUE
+rb_fs_s_watch( int argc, VALUE *argv, VALUE fs)
+{
+    VALUE paths, opts, obj, v;
+    struct fswatch *w;
+    pthread_t thr;
+    sigset_t all, old;
+    int fds[ 2];
+    double d;
+    long i;
+
+    rb_scan_args( argc, argv, "1:", &paths, &opts);
+    paths = rb_Array( paths);
+
+    obj = TypedData_Wrap_Struct( rb_cFilesysWatch, &fswatch_data_type, NULL);
+    w = calloc( 1, sizeof *w);
+    if (w == NULL)
+        rb_memerror();
+    w->refs = 1;
+    w->pid = getpid();
+    w->stopfd = w->notify = -1;
+    w->io = Qnil;
+    w->interval = 5000;
+    w->below = 10.0;
+    w->hysteresis = 1.0;
+    DATA_PTR( obj) = w;
+    if (!NIL_P( opts)) {
+        v = rb_hash_aref( opts, ID2SYM( id_interval));
+        if (!NIL_P( v)) {
+            d = NUM2DBL( v);
+            if (d <= 0.0)
+                rb_raise( rb_eArgError, "interval must be positive");
+            w->interval = (int) (d * 1000.0 + 0.5);
+        }
+        v = rb_hash_aref( opts, ID2SYM( id_below_pct));
+        if (!NIL_P( v))
+            w->below = NUM2DBL( v);
+        v = rb_hash_aref( opts, ID2SYM( id_hysteresis));
+        if (!NIL_P( v)) {
+            w->hysteresis = NUM2DBL( v);
+            if (w->hysteresis < 0.0)
+                rb_raise( rb_eArgError, "hysteresis must not be negative");
+        }
+    }
+
+    w->paths = calloc( RARRAY_LEN( paths) + 1, sizeof *w->paths);
+    if (w->paths == NULL)
+        rb_memerror();
+    for (i = 0; i < RARRAY_LEN( paths); i++) {
+        VALUE p = RARRAY_AREF( paths, i);
+
+        FilePathValue( p);
+        w->paths[ i].path = strdup( StringValueCStr( p));
+        w->npaths++;
+        if (w->paths[ i].path == NULL)
+            rb_memerror();
+    }
+
+    w->stopfd = eventfd( 0, EFD_CLOEXEC);
+    if (w->stopfd < 0)
+        rb_sys_fail( "eventfd");
+    if (pipe2( fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        rb_sys_fail( "pipe");
+    w->notify = fds[ 1];
+    w->io = rb_io_fdopen( fds[ 0], O_RDONLY, NULL);
+
+    pthread_mutex_lock( &fswatch_mutex);
+    w->next = fswatch_all;
+    fswatch_all = w;
+    pthread_mutex_unlock( &fswatch_mutex);
+
+    w->refs = 2;
+    sigfillset( &all);
+    pthread_sigmask( SIG_SETMASK, &all, &old);
+    i = pthread_create( &thr, NULL, &fswatch_thread, w);
+    pthread_sigmask( SIG_SETMASK, &old, NULL);
+    if (i != 0) {
+        w->refs = 1;
+        rb_syserr_fail( (int) i, "pthread_create");
+    }
+    pthread_detach( thr);
+    w->running = 1;
+
+    if (rb_block_given_p())
+        return rb_ensure( rb_yield, obj, rb_fswatch_close, obj);
+    return obj;
+}
+
+struct fswatch *
+get_fswatch( VALUE obj)
+{
+    struct fswatch *w;
+
+    TypedData_Get_Struct( obj, struct fswatch, &fswatch_data_type, w);
+    if (fswatch_foreign( w))
+        rb_raise( rb_eIOError, "watch was started by another process");
+    if (w->closed)
+        rb_raise( rb_eIOError, "closed watch");
+    return w;
+}
+
+void
+fswatch_mark( void *p)
+{
+    if (p != NULL)
+        rb_gc_mark( ((struct fswatch *) p)->io);
+}
+
+void
+fswatch_free( void *p)
+{
+    struct fswatch *w = p;
+
+    if (w == NULL)
+        return;
+    fswatch_stop( w);
+    fswatch_release( w);
+}
+
+/*
+ *  Tell the sampler to finish; it doesn't have to be done yet.  In a
+ *  forked child there is no sampler, and the stop descriptor is shared
+ *  with the parent's, so it must not be written to.
+ */
+
+void
+fswatch_stop( struct fswatch *w)
+{
+    struct fswatch **pp;
+    uint64_t one = 1;
+
+    if (w->closed)
+        return;
+    w->closed = 1;
+    pthread_mutex_lock( &fswatch_mutex);
+    for (pp = &fswatch_all; *pp != NULL; pp = &(*pp)->next)
+        if (*pp == w) {
+            *pp = w->next;
+            break;
+        }
+    pthread_mutex_unlock( &fswatch_mutex);
+    if (w->running) {
+        w->running = 0;
+        if (fswatch_foreign( w))
+            fswatch_release( w);
+        else
+            (void) !write( w->stopfd, &one, sizeof one);
+    }
+}
+
+void
+fswatch_release( struct fswatch *w)
+{
+    size_t i;
+
+    if (__atomic_sub_fetch( &w->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (i = 0; i < w->npaths; i++)
+        free( w->paths[ i].path);
+    free( w->paths);
+    free( w->cross);
+    if (w->stopfd >= 0)
+        close( w->stopfd);
+    if (w->notify >= 0)
+        close( w->notify);
+    free( w);
+}
+
+int
+fswatch_foreign( struct fswatch *w)
+{
+    return w->pid != getpid();
+}
+
+void *
+fswatch_thread( void *p)
+{
+    struct fswatch *w = p;
+    struct pollfd pfd;
+    size_t i;
+    int n;
+    char c = 0;
+
+    pfd.fd = w->stopfd;
+    pfd.events = POLLIN;
+    for (;;) {
+        for (n = 0, i = 0; i < w->npaths; i++)
+            n += fswatch_sample( w, i);
+        if (n > 0)
+            (void) !write( w->notify, &c, 1);
+        if (poll( &pfd, 1, w->interval) < 0 && errno != EINTR)
+            break;
+        if (pfd.revents)
+            break;
+    }
+    fswatch_release( w);
+    return NULL;
+}
+
+/*
+ *  Take a sample and store it.  Returns 1 if a crossing was recorded.
+ *  A failing statfs() leaves the previous sample in place.
+ */
+
+int
+fswatch_sample( struct fswatch *w, size_t i)
+{
+    struct fswatch_path *p = w->paths + i;
+    struct fswatch_cross *n;
+    struct statfs st;
+    double pct;
+    int low, r = 0;
+
+    if (statfs( p->path, &st) < 0)
+        return 0;
+    pthread_mutex_lock( &fswatch_mutex);
+    p->st = st;
+    p->valid = 1;
+    if (st.f_blocks > 0) {
+        pct = 100.0 * st.f_bavail / st.f_blocks;
+        low = p->low ? pct < w->below + w->hysteresis : pct < w->below;
+        if (low != p->low) {
+            if (w->ncross == w->capa) {
+                n = realloc( w->cross, (w->capa + 16) * sizeof *n);
+                if (n != NULL)
+                    w->cross = n, w->capa += 16;
+            }
+            if (w->ncross < w->capa) {
+                w->cross[ w->ncross].i = i;
+                w->cross[ w->ncross].low = low;
+                w->cross[ w->ncross].pct = pct;
+                w->ncross++;
+                p->low = low;
+                r = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock( &fswatch_mutex);
+    return r;
+}
+
+
+/*
+ *  call-seq:
+ *     Filesys.avail( path)    -> int or nil
+ *
+ *  Free bytes avail to non-superuser, as of the latest sample of a
+ *  running Filesys::Watch.  +path+ must be spelled exactly as it was
+ *  passed to <code>Filesys.watch</code>.  Returns +nil+ if the path is
+ *  not being watched or hasn't been sampled yet.  Watches inherited
+ *  from a parent process don't count; they are not sampled any more.
+ *
+ *  No system call is made, so this may be asked as often as you like.
+ */
+
+VALUE
+rb_fs_s_avail( VALUE fs, VALUE path)
+{
+    struct fswatch *w;
+    const char *s;
+    unsigned long long r = 0;
+    int found = 0;
+    size_t i;
+    pid_t pid;
+
+    FilePathValue( path);
+    s = StringValueCStr( path);
+    pid = getpid();
+    pthread_mutex_lock( &fswatch_mutex);
+    for (w = fswatch_all; w != NULL && !found; w = w->next)
+        for (i = 0; w->pid == pid && i < w->npaths; i++)
+            if (w->paths[ i].valid && strcmp( w->paths[ i].path, s) == 0) {
+                r = (unsigned long long) w->paths[ i].st.f_bavail *
+                                         w->paths[ i].st.f_bsize;
+                found = 1;
+                break;
+            }
+    pthread_mutex_unlock( &fswatch_mutex);
+    RB_GC_GUARD( path);
+    return found ? ULL2NUM( r) : Qnil;
+}
+
+
+/*
+ *  call-seq:
+ *     watch.read( timeout = nil)     -> ary or nil
+ *
+ *  Wait for threshold crossings.  Returns an array of triples of the
+ *  path, <code>:low</code> or <code>:ok</code>, and the available
+ *  percentage at that moment.
+ *
+ *  Returns +nil+ when the timeout expired.
+ */
+
+VALUE
+rb_fswatch_read( int argc, VALUE *argv, VALUE self)
+{
+    VALUE timeout, r;
+    struct fswatch *w;
+    struct fswatch_cross *cross;
+    size_t n, i;
+    char buf[ 64];
+
+    rb_scan_args( argc, argv, "01", &timeout);
+    for (;;) {
+        w = get_fswatch( self);
+        /*
+         * Drain first: a crossing recorded from now on is either taken
+         * below or leaves its byte in the pipe.
+         */
+        while (read( rb_io_descriptor( w->io), buf, sizeof buf) > 0)
+            ;
+        pthread_mutex_lock( &fswatch_mutex);
+        cross = w->cross, n = w->ncross;
+        w->cross = NULL, w->ncross = w->capa = 0;
+        pthread_mutex_unlock( &fswatch_mutex);
+        if (n > 0) {
+            r = rb_ary_new_capa( n);
+            for (i = 0; i < n; i++)
+                rb_ary_push( r, rb_ary_new3( 3,
+                        rb_str_new_cstr( w->paths[ cross[ i].i].path),
+                        cross[ i].low ? sym_low : sym_ok,
+                        rb_float_new( cross[ i].pct)));
+            free( cross);
+            return r;
+        }
+        free( cross);
+        if (!RTEST( rb_io_wait( w->io, INT2NUM( RUBY_IO_READABLE), timeout)))
+            return Qnil;
+    }
+}
+
+/*
+ *  call-seq:
+ *     watch.each { |path,state,pct| ... }     -> nil
+ *
+ *  Yield crossings until the watch is closed.
+ */
+
+VALUE
+rb_fswatch_each( VALUE self)
+{
+    VALUE b;
+    long i;
+
+    RETURN_ENUMERATOR( self, 0, 0);
+    while (!RTEST( rb_fswatch_closed_p( self))) {
+        b = rb_fswatch_read( 0, NULL, self);
+        for (i = 0; !NIL_P( b) && i < RARRAY_LEN( b); i++)
+            rb_yield( RARRAY_AREF( b, i));
+    }
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     watch.to_io     -> io
+ *
+ *  An IO that becomes readable when crossings are ready.  Don't read
+ *  from it yourself; call #read.
+ */
+
+VALUE
+rb_fswatch_to_io( VALUE self)
+{
+    return get_fswatch( self)->io;
+}
+
+/*
+ *  call-seq:
+ *     watch.close     -> nil
+ *
+ *  Stop sampling.  The paths are no longer known to
+ *  <code>Filesys.avail</code>.  This doesn't wait for the sampler
+ *  thread; one that hangs in a <code>statfs()</code> ends on its own
+ *  later.  In a forked child only the inherited descriptors are closed.
+ */
+
+VALUE
+rb_fswatch_close( VALUE self)
+{
+    struct fswatch *w;
+
+    TypedData_Get_Struct( self, struct fswatch, &fswatch_data_type, w);
+    if (w->closed)
+        return Qnil;
+    fswatch_stop( w);
+    if (!NIL_P( w->io))
+        rb_io_close( w->io);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     watch.closed?     -> true or false
+ */
+
+VALUE
+rb_fswatch_closed_p( VALUE self)
+{
+    struct fswatch *w;
+
+    TypedData_Get_Struct( self, struct fswatch, &fswatch_data_type, w);
+    return w->closed ? Qtrue : Qfalse;
+}
+
+
+void Init_fswatch( void)
+{
+    VALUE rb_mFilesys;
+
+    rb_mFilesys = rb_define_module( "Filesys");
+    rb_define_singleton_method( rb_mFilesys, "watch", rb_fs_s_watch, -1);
+    rb_define_singleton_method( rb_mFilesys, "avail", rb_fs_s_avail, 1);
+
+    rb_cFilesysWatch = rb_define_class_under( rb_mFilesys, "Watch",
+                                                                rb_cObject);
+    rb_undef_alloc_func( rb_cFilesysWatch);
+    rb_define_method( rb_cFilesysWatch, "read", rb_fswatch_read, -1);
+    rb_define_method( rb_cFilesysWatch, "each", rb_fswatch_each, 0);
+    rb_define_method( rb_cFilesysWatch, "to_io", rb_fswatch_to_io, 0);
+    rb_define_method( rb_cFilesysWatch, "close", rb_fswatch_close, 0);
+    rb_define_method( rb_cFilesysWatch, "closed?", rb_fswatch_closed_p, 0);
+
+    id_interval   = rb_intern( "interval");
+    id_below_pct  = rb_intern( "below_pct");
+    id_hysteresis = rb_intern( "hysteresis");
+    sym_low       = ID2SYM( rb_intern( "low"));
+    sym_ok        = ID2SYM( rb_intern( "ok"));
+}
+
@@ -0,0 +1,238 @@
+/*
+ *  supplement/hashes.c  --  Message digests
+ */
+
+#include "hashes.h"
+
+#include <string.h>
+
+
+/*
+ *  SHA-256 (FIPS 180-4).  Nothing here calls Ruby.
+ */
+
+static const uint32_t sha256_k[ 64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32( x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROL64( x, n)  (((x) << (n)) | ((x) >> (64 - (n))))
+
+static void
+sha256_block( struct supplement_sha256 *c, const unsigned char *p)
+{
+    uint32_t w[ 64], a, b, d, e, f, g, h, cc, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+        w[ i] = (uint32_t) p[ 0] << 24 | (uint32_t) p[ 1] << 16 |
+                (uint32_t) p[ 2] << 8  | (uint32_t) p[ 3];
+    for (; i < 64; i++)
+        w[ i] = w[ i - 16] + w[ i - 7] +
+                (ROR32( w[ i - 15], 7) ^ ROR32( w[ i - 15], 18) ^
+                                                    (w[ i - 15] >> 3)) +
+                (ROR32( w[ i - 2], 17) ^ ROR32( w[ i - 2], 19) ^
+                                                    (w[ i - 2] >> 10));
+    a = c->h[ 0], b = c->h[ 1], cc = c->h[ 2], d = c->h[ 3];
+    e = c->h[ 4], f = c->h[ 5], g = c->h[ 6], h = c->h[ 7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR32( e, 6) ^ ROR32( e, 11) ^ ROR32( e, 25)) +
+                ((e & f) ^ (~e & g)) + sha256_k[ i] + w[ i];
+        t2 = (ROR32( a, 2) ^ ROR32( a, 13) ^ ROR32( a, 22)) +
+                ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g, g = f, f = e, e = d + t1;
+        d = cc, cc = b, b = a, a = t1 + t2;
+    }
+    c->h[ 0] += a, c->h[ 1] += b, c->h[ 2] += cc, c->h[ 3] += d;
+    c->h[ 4] += e, c->h[ 5] += f, c->h[ 6] += g, c->h[ 7] += h;
+}
+
+void
+supplement_sha256_init( struct supplement_sha256 *c)
+{
+    static const uint32_t iv[ 8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy( c->h, iv, sizeof iv);
+    c->total = 0;
+    c->n = 0;
+}
+
+void
+supplement_sha256_update( struct supplement_sha256 *c, const void *data,
+                          size_t len)
+{
+    const unsigned char *p = data;
+    size_t l;
+
+    c->total += len;
+    if (c->n > 0) {
+        l = 64 - c->n < len ? 64 - c->n : len;
+        memcpy( c->buf + c->n, p, l);
+        c->n += l, p += l, len -= l;
+        if (c->n < 64)
+            return;
+        sha256_block( c, c->buf);
+        c->n = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block( c, p);
+    memcpy( c->buf, p, len);
+    c->n = len;
+}
+
+void
+supplement_sha256_final( struct supplement_sha256 *c, unsigned char out[ 32])
+{
+    uint64_t bits = c->total * 8;
+    int i;
+
+    c->buf[ c->n++] = 0x80;
+    if (c->n > 56) {
+        memset( c->buf + c->n, 0, 64 - c->n);
+        sha256_block( c, c->buf);
+        c->n = 0;
+    }
+    memset( c->buf + c->n, 0, 56 - c->n);
+    for (i = 0; i < 8; i++)
+        c->buf[ 56 + i] = (unsigned char) (bits >> (56 - 8 * i));
+    sha256_block( c, c->buf);
+    for (i = 0; i < 32; i++)
+        out[ i] = (unsigned char) (c->h[ i / 4] >> (24 - 8 * (i % 4)));
+}
+
+
+/*
+ *  XXH64.  The result is stored big-endian, the canonical form.
+ */
+
+#define XXH_P1  0x9E3779B185EBCA87ULL
+#define XXH_P2  0xC2B2AE3D27D4EB4FULL
+#define XXH_P3  0x165667B19E3779F9ULL
+#define XXH_P4  0x85EBCA77C2B2AE63ULL
+#define XXH_P5  0x27D4EB2F165667C5ULL
+
+static uint64_t
+xxh_read64( const unsigned char *p)
+{
+    return (uint64_t) p[ 0]       | (uint64_t) p[ 1] << 8  |
+           (uint64_t) p[ 2] << 16 | (uint64_t) p[ 3] << 24 |
+           (uint64_t) p[ 4] << 32 | (uint64_t) p[ 5] << 40 |
+           (uint64_t) p[ 6] << 48 | (uint64_t) p[ 7] << 56;
+}
+
+static uint64_t
+xxh_round( uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = ROL64( acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t
+xxh_merge( uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round( 0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void
+xxh64_stripe( struct supplement_xxh64 *c, const unsigned char *p)
+{
+    c->v[ 0] = xxh_round( c->v[ 0], xxh_read64( p));
+    c->v[ 1] = xxh_round( c->v[ 1], xxh_read64( p + 8));
+    c->v[ 2] = xxh_round( c->v[ 2], xxh_read64( p + 16));
+    c->v[ 3] = xxh_round( c->v[ 3], xxh_read64( p + 24));
+}
+
+void
+supplement_xxh64_init( struct supplement_xxh64 *c, uint64_t seed)
+{
+    c->seed = seed;
+    c->v[ 0] = seed + XXH_P1 + XXH_P2;
+    c->v[ 1] = seed + XXH_P2;
+    c->v[ 2] = seed;
+    c->v[ 3] = seed - XXH_P1;
+    c->total = 0;
+    c->n = 0;
+}
+
+void
+supplement_xxh64_update( struct supplement_xxh64 *c, const void *data,
+                         size_t len)
+{
+    const unsigned char *p = data;
+    size_t l;
+
+    c->total += len;
+    if (c->n > 0) {
+        l = 32 - c->n < len ? 32 - c->n : len;
+        memcpy( c->buf + c->n, p, l);
+        c->n += l, p += l, len -= l;
+        if (c->n < 32)
+            return;
+        xxh64_stripe( c, c->buf);
+        c->n = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32)
+        xxh64_stripe( c, p);
+    memcpy( c->buf, p, len);
+    c->n = len;
+}
+
+void
+supplement_xxh64_final( struct supplement_xxh64 *c, unsigned char out[ 8])
+{
+    const unsigned char *p = c->buf;
+    size_t len = c->n;
+    uint64_t h;
+    int i;
+
+    if (c->total >= 32) {
+        h = ROL64( c->v[ 0], 1) + ROL64( c->v[ 1], 7) +
+            ROL64( c->v[ 2], 12) + ROL64( c->v[ 3], 18);
+        for (i = 0; i < 4; i++)
+            h = xxh_merge( h, c->v[ i]);
+    } else
+        h = c->seed + XXH_P5;
+    h += c->total;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh_round( 0, xxh_read64( p));
+        h = ROL64( h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (len >= 4) {
+        h ^= ((uint64_t) p[ 0] | (uint64_t) p[ 1] << 8 |
+              (uint64_t) p[ 2] << 16 | (uint64_t) p[ 3] << 24) * XXH_P1;
+        h = ROL64( h, 23) * XXH_P2 + XXH_P3;
+        p += 4, len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * XXH_P5;
+        h = ROL64( h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    for (i = 0; i < 8; i++)
+        out[ i] = (unsigned char) (h >> (56 - 8 * i));
+}
+
@@ -0,0 +1,40 @@
+/*
+ *  supplement/hashes.h  --  Message digests
+ */
+
+#ifndef __SUPPLEMENT_HASHES_H__
+#define __SUPPLEMENT_HASHES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct supplement_sha256 {
+    uint32_t      h[ 8];
+    uint64_t      total;
+    unsigned char buf[ 64];
+    size_t        n;
+};
+
+extern void supplement_sha256_init( struct supplement_sha256 *);
+extern void supplement_sha256_update( struct supplement_sha256 *,
+                                      const void *, size_t);
+extern void supplement_sha256_final( struct supplement_sha256 *,
+                                     unsigned char [ 32]);
+
+struct supplement_xxh64 {
+    uint64_t      v[ 4];
+    uint64_t      seed;
+    uint64_t      total;
+    unsigned char buf[ 32];
+    size_t        n;
+};
+
+extern void supplement_xxh64_init( struct supplement_xxh64 *, uint64_t);
+extern void supplement_xxh64_update( struct supplement_xxh64 *,
+                                     const void *, size_t);
+extern void supplement_xxh64_final( struct supplement_xxh64 *,
+                                    unsigned char [ 8]);
+
+#endif
+
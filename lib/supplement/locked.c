@@ -5,8 +5,99 @@
 #include "locked.h"
 
 #include <ruby/io.h>
+#include <ruby/thread.h>
+#include <ruby/fiber/scheduler.h>
+#include <ruby/st.h>
+#include <ruby/util.h>
 
 #include <sys/file.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef sigev_notify_thread_id
+    #define sigev_notify_thread_id  _sigev_un._tid
+#endif
+
+#ifndef F_OFD_SETLK
+    /* Not Linux: process-associated locks are the best we have. */
+    #define F_OFD_SETLK   F_SETLK
+    #define F_OFD_SETLKW  F_SETLKW
+#endif
+
+
+/*
+ *  With a +range+, op is LOCK_SH, LOCK_EX or LOCK_UN, maybe or'ed with
+ *  LOCK_NB, and an OFD lock is set on that range instead of a flock.
+ */
+
+struct locked_flock {
+    int             fd;
+    int             op;
+    struct flock   *range;
+    struct timespec left;           /* tv_sec < 0: no timeout */
+    int             err;
+};
+
+struct locked_wait {
+    VALUE          self;
+    int            op;
+    struct flock  *range;
+    double         timeout;         /* < 0: forever */
+    long           retries;
+    int            timedout;
+};
+
+/*
+ *  Contention statistics per path.  They are only touched with the GVL
+ *  held, so they need no lock of their own.
+ */
+
+#define LOCKED_HIST  24
+
+struct locked_stat {
+    unsigned long  acquisitions, retries, timeouts;
+    double         wait_total, wait_max;
+    unsigned long  holds;
+    double         hold_total, hold_max;
+    unsigned long  hist[ LOCKED_HIST];  /* waits below 2**i microseconds */
+};
+
+struct locked_range {
+    VALUE         self;
+    struct flock  fl;
+};
+
+static int   locked_flock( int, int);
+static int   locked_call( struct locked_flock *);
+static void *locked_flock_nogvl( void *);
+static VALUE locked_wait( VALUE);
+static void *locked_wait_nogvl( void *);
+static double locked_now( void);
+static int   locked_type( VALUE);
+static void  locked_range_arg( struct flock *, VALUE, VALUE);
+static VALUE locked_range_unlock( VALUE);
+static struct locked_stat *locked_stat( VALUE);
+static void  locked_record( VALUE, struct locked_wait *, double);
+static int   locked_stat_value( st_data_t, st_data_t, st_data_t);
+static int   locked_stat_free( st_data_t, st_data_t, st_data_t);
+
+static st_table *locked_stats = NULL;
+
+static ID id_blocking = 0;
+static ID id_timeout = 0;
+static ID id_lock = 0;
+static ID id_shared = 0;
+static ID id_exclusive = 0;
+static ID id_closed_p = 0;
+static ID id_locked_since = 0;
+static VALUE sym_acquisitions, sym_retries, sym_timeouts, sym_wait_total,
+             sym_wait_max, sym_holds, sym_hold_total, sym_hold_max,
+             sym_wait_histogram;
 
 
 /*
@@ -17,35 +108,107 @@
 
 /*
  *  call-seq:
- *     LockedFile.open( *args)                 -> file
- *     LockedFile.open( *args) { |file| ... }  -> ob.j
+ *     LockedFile.open( *args, lock: nil, blocking: false, timeout: nil)                 -> file
+ *     LockedFile.open( *args, lock: nil, blocking: false, timeout: nil) { |file| ... }  -> obj
  *
  *  Same as File.open but do an +flock+. If the lock fails, the method
  *  +lock_failed+ will be called. If that doesn't exist, another lock
  *  will be tried.
+ *
+ *  The lock is exclusive if the file is opened for writing and shared
+ *  otherwise.  Pass <code>lock: :shared</code> or
+ *  <code>lock: :exclusive</code> to choose yourself, e.g. to write
+ *  records under #lock_range while holding the file shared, or to
+ *  read a file opened <code>"r+"</code> and #upgrade! only if it has
+ *  to be written.
+ *
+ *  With <code>blocking: true</code> or a +timeout+, the call waits in
+ *  +flock+ itself and gets the lock as soon as it is released.  Other
+ *  threads keep running meanwhile.  If the lock couldn't be taken
+ *  within +timeout+ seconds, the file is closed again and
+ *  <code>Errno::ETIMEDOUT</code> is raised.  Under a
+ *  <code>Fiber.scheduler</code>, the lock is polled and the fiber
+ *  sleeps through the scheduler in between.
+ *
+ *     LockedFile.open "state", "r+", timeout: 2 do |f| ... end
  */
 
 VALUE
 rb_locked_init( int argc, VALUE *argv, VALUE self)
 {
+    struct locked_wait w;
     struct timeval time;
-    int op;
+    VALUE opts, v, *args;
+    int blocking = 0, kw, state;
+    double t0;
+
+    w.op = 0;
+    w.timeout = -1.0;
+    w.retries = 0;
+    w.timedout = 0;
+    kw = rb_keyword_given_p() ? RB_PASS_KEYWORDS : RB_NO_KEYWORDS;
+    if (kw == RB_PASS_KEYWORDS) {
+        opts = rb_hash_dup( argv[ argc - 1]);
+        v = rb_hash_lookup2( opts, ID2SYM( id_blocking), Qundef);
+        if (v != Qundef) {
+            blocking = RTEST( v);
+            rb_hash_delete( opts, ID2SYM( id_blocking));
+        }
+        v = rb_hash_lookup2( opts, ID2SYM( id_timeout), Qundef);
+        if (v != Qundef) {
+            if (!NIL_P( v)) {
+                w.timeout = NUM2DBL( v);
+                if (w.timeout < 0.0)
+                    w.timeout = 0.0;
+            }
+            blocking = 1;
+            rb_hash_delete( opts, ID2SYM( id_timeout));
+        }
+        v = rb_hash_lookup2( opts, ID2SYM( id_lock), Qundef);
+        if (v != Qundef) {
+            w.op = locked_type( v);
+            rb_hash_delete( opts, ID2SYM( id_lock));
+        }
+        args = ALLOCA_N( VALUE, argc);
+        MEMCPY( args, argv, VALUE, argc - 1);
+        args[ argc - 1] = opts;
+        argv = args;
+        if (RHASH_SIZE( opts) == 0)
+            argc--, kw = RB_NO_KEYWORDS;
+    }
+    rb_call_super_kw( argc, argv, kw);
 
-    rb_call_super_kw(argc, argv, RB_PASS_CALLED_KEYWORDS);
+    w.self = self;
+    if (w.op == 0)
+        w.op = rb_io_mode( self) & FMODE_WRITABLE ? LOCK_EX : LOCK_SH;
+    w.range = NULL;
+    t0 = locked_now();
+    if (blocking) {
+        rb_protect( &locked_wait, (VALUE) &w, &state);
+        if (state) {
+            if (w.timedout)
+                locked_record( self, &w, locked_now() - t0);
+            rb_io_close( self);
+            rb_jump_tag( state);
+        }
+        locked_record( self, &w, locked_now() - t0);
+        return self;
+    }
 
-    op = rb_io_mode( self) & FMODE_WRITABLE ? LOCK_EX : LOCK_SH;
-    op |= LOCK_NB;
-    while (flock( rb_io_descriptor( self), op) < 0) {
+    w.op |= LOCK_NB;
+    while ((errno = locked_flock( rb_io_descriptor( self), w.op)) != 0) {
         static ID id_lock_failed = 0;
 
         switch (errno) {
         case EINTR:
+            rb_thread_check_ints();
             break;
         case EAGAIN:
         case EACCES:
 #if defined( EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
         case EWOULDBLOCK:
 #endif
+            w.retries++;
             if (id_lock_failed == 0)
                 id_lock_failed = rb_intern( "lock_failed");
             if (rb_respond_to( self, id_lock_failed))
@@ -61,25 +224,545 @@ rb_locked_init( int argc, VALUE *argv, VALUE self)
             break;
         }
     }
+    locked_record( self, &w, locked_now() - t0);
+    return self;
+}
+
+/*
+ *  Wait for the lock +op+ of a struct locked_wait.  Without a fiber
+ *  scheduler the thread blocks in the lock call without the GVL; a timeout
+ *  is enforced by a timer that interrupts it with the signal Ruby uses
+ *  for its own unblocking.  If the timer is not available, or under a
+ *  scheduler, the lock is polled with growing pauses.
+ *
+ *  The lock is tried without waiting first; that is cheap and tells
+ *  whether it was contended at all.
+ */
+
+VALUE
+locked_wait( VALUE arg)
+{
+    struct locked_wait *w = (struct locked_wait *) arg;
+    struct locked_flock f;
+    struct timeval tv;
+    VALUE sched;
+    double deadline = 0.0, left = -1.0, nap = 0.001;
+    int poll = 0;
+
+    f.fd = rb_io_descriptor( w->self);
+    f.range = w->range;
+    if (w->timeout >= 0.0)
+        deadline = locked_now() + w->timeout;
+    sched = rb_fiber_scheduler_current();
+    if (!NIL_P( sched))
+        poll = 1;
+    else {
+        f.op = w->op | LOCK_NB;
+        rb_thread_call_without_gvl( &locked_flock_nogvl, &f,
+                                    RUBY_UBF_IO, NULL);
+        if (f.err == 0)
+            return Qnil;
+        if (f.err == EWOULDBLOCK)
+            w->retries++;
+    }
+    for (;;) {
+        if (w->timeout >= 0.0) {
+            left = deadline - locked_now();
+            if (left < 0.0)
+                left = 0.0;
+        }
+        if (poll) {
+            f.op = w->op | LOCK_NB;
+            rb_thread_call_without_gvl( &locked_flock_nogvl, &f,
+                                        RUBY_UBF_IO, NULL);
+            if (f.err == EWOULDBLOCK) {
+                w->retries++;
+                if (left == 0.0) {
+                    w->timedout = 1;
+                    rb_syserr_fail_str( ETIMEDOUT, rb_io_path( w->self));
+                }
+                if (left > 0.0 && nap > left)
+                    nap = left;
+                if (!NIL_P( sched))
+                    rb_fiber_scheduler_kernel_sleep( sched, DBL2NUM( nap));
+                else {
+                    tv.tv_sec = 0;
+                    tv.tv_usec = (long) (nap * 1e6);
+                    rb_thread_wait_for( tv);
+                }
+                if (nap < 0.05)
+                    nap *= 2;
+                continue;
+            }
+        } else {
+            f.op = w->op;
+            f.left.tv_sec = left < 0.0 ? -1 : (time_t) left;
+            f.left.tv_nsec = left < 0.0 ? 0 :
+                                (long) ((left - (time_t) left) * 1e9) + 1;
+            rb_thread_call_without_gvl( &locked_wait_nogvl, &f,
+                                        RUBY_UBF_IO, NULL);
+            if (f.err == ENOSYS) {
+                poll = 1;
+                continue;
+            }
+            if (f.err == EINTR && left >= 0.0 && locked_now() >= deadline) {
+                w->timedout = 1;
+                rb_syserr_fail_str( ETIMEDOUT, rb_io_path( w->self));
+            }
+        }
+        switch (f.err) {
+        case 0:
+            return Qnil;
+        case EINTR:
+            rb_thread_check_ints();
+            break;
+        default:
+            rb_syserr_fail_str( f.err, rb_io_path( w->self));
+            break;
+        }
+    }
+}
+
+void *
+locked_wait_nogvl( void *p)
+{
+    struct locked_flock *f = p;
+    struct sigevent sev;
+    struct itimerspec its;
+    timer_t timer;
+    int armed = 0;
+
+    if (f->left.tv_sec >= 0) {
+        memset( &sev, 0, sizeof sev);
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGVTALRM;
+        sev.sigev_notify_thread_id = (pid_t) syscall( SYS_gettid);
+        if (timer_create( CLOCK_MONOTONIC, &sev, &timer) < 0) {
+            f->err = ENOSYS;
+            return NULL;
+        }
+        /* Fire again in case the first signal came before the call. */
+        its.it_value = f->left;
+        its.it_interval.tv_sec = 0;
+        its.it_interval.tv_nsec = 10 * 1000 * 1000;
+        armed = 1;
+        if (timer_settime( timer, 0, &its, NULL) < 0) {
+            timer_delete( timer);
+            f->err = ENOSYS;
+            return NULL;
+        }
+    }
+    locked_call( f);
+    if (armed)
+        timer_delete( timer);
+    return NULL;
+}
+
+double
+locked_now( void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ *  A lock on a network file system may take a while even if it doesn't
+ *  wait for other holders, so the GVL is released.  Returns 0 or the
+ *  error number.
+ */
+
+int
+locked_flock( int fd, int op)
+{
+    struct locked_flock f;
+
+    f.fd = fd;
+    f.op = op;
+    f.range = NULL;
+    rb_thread_call_without_gvl( &locked_flock_nogvl, &f, RUBY_UBF_IO, NULL);
+    return f.err;
+}
+
+void *
+locked_flock_nogvl( void *p)
+{
+    locked_call( p);
+    return NULL;
+}
+
+/*
+ *  The system call itself.  A conflicting lock is always reported as
+ *  EWOULDBLOCK.
+ */
+
+int
+locked_call( struct locked_flock *f)
+{
+    int r;
+
+    if (f->range != NULL) {
+        switch (f->op & ~LOCK_NB) {
+        case LOCK_SH: f->range->l_type = F_RDLCK; break;
+        case LOCK_EX: f->range->l_type = F_WRLCK; break;
+        default:      f->range->l_type = F_UNLCK; break;
+        }
+        r = fcntl( f->fd, f->op & LOCK_NB ? F_OFD_SETLK : F_OFD_SETLKW,
+                   f->range);
+    } else
+        r = flock( f->fd, f->op);
+    f->err = r < 0 ? errno : 0;
+    if (f->err == EAGAIN || f->err == EACCES)
+        f->err = EWOULDBLOCK;
+    return f->err;
+}
+
+
+/*
+ *  call-seq:
+ *     lock_range( offset, len, type = :exclusive, timeout: nil)              -> self
+ *     lock_range( offset, len, type = :exclusive, timeout: nil) { ... }      -> obj
+ *
+ *  Lock +len+ bytes from +offset+ on, +type+ being <code>:shared</code>
+ *  or <code>:exclusive</code>.  A +len+ of zero means up to the end of
+ *  the file, however it grows.  With a block, the range is unlocked
+ *  afterwards.
+ *
+ *  These are Linux open file description locks: they belong to this
+ *  LockedFile, are released when it is closed, and are not lost when
+ *  some other descriptor of the same file is closed.  Disjoint ranges
+ *  don't wait for each other, so writers of different records may run
+ *  in parallel; open the file with <code>lock: :shared</code> for
+ *  that.  Two threads that want to exclude each other need
+ *  LockedFile objects of their own.
+ *
+ *  The call waits like <code>LockedFile.open( ..., timeout:)</code>.
+ *
+ *     LockedFile.open "records", "r+", lock: :shared do |f|
+ *       f.lock_range 4096, 512 do f.pwrite record, 4096 end
+ *     end
+ */
+
+VALUE
+rb_locked_lock_range( int argc, VALUE *argv, VALUE self)
+{
+    VALUE offset, len, type, opts, v;
+    struct locked_range r;
+    struct locked_wait w;
+
+    rb_scan_args( argc, argv, "21:", &offset, &len, &type, &opts);
+    w.op = NIL_P( type) ? LOCK_EX : locked_type( type);
+    w.timeout = -1.0;
+    w.retries = 0;
+    w.timedout = 0;
+    if (!NIL_P( opts)) {
+        v = rb_hash_aref( opts, ID2SYM( id_timeout));
+        if (!NIL_P( v)) {
+            w.timeout = NUM2DBL( v);
+            if (w.timeout < 0.0)
+                w.timeout = 0.0;
+        }
+    }
+    r.self = self;
+    locked_range_arg( &r.fl, offset, len);
+    w.self = self;
+    w.range = &r.fl;
+    locked_wait( (VALUE) &w);
+    if (rb_block_given_p())
+        return rb_ensure( rb_yield, Qnil, &locked_range_unlock, (VALUE) &r);
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     upgrade!( timeout: nil)     -> self
+ *     downgrade!                  -> self
+ *
+ *  Turn a shared lock into an exclusive one or back, without closing
+ *  the file.  A reader that finds it has to write opens the file
+ *  <code>"r+"</code> with <code>lock: :shared</code> and calls
+ *  #upgrade! then.  It waits like
+ *  <code>LockedFile.open( ..., timeout:)</code>; if it times out, the
+ *  shared lock is taken again before the error is raised.
+ *
+ *  As with <code>flock(2)</code>, the conversion is not atomic.  The
+ *  old lock is released first, so another writer may get in between.
+ *  Check what you read if that matters.
+ *
+ *     LockedFile.open "state", "r+", lock: :shared do |f|
+ *       s = f.read
+ *       if stale? s then
+ *         f.upgrade!
+ *         ...
+ *       end
+ *     end
+ */
+
+VALUE
+rb_locked_upgrade_bang( int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts, v;
+    struct locked_wait w;
+    int state;
+
+    rb_scan_args( argc, argv, ":", &opts);
+    w.self = self;
+    w.op = LOCK_EX;
+    w.range = NULL;
+    w.timeout = -1.0;
+    w.retries = 0;
+    w.timedout = 0;
+    if (!NIL_P( opts)) {
+        v = rb_hash_aref( opts, ID2SYM( id_timeout));
+        if (!NIL_P( v)) {
+            w.timeout = NUM2DBL( v);
+            if (w.timeout < 0.0)
+                w.timeout = 0.0;
+        }
+    }
+    rb_protect( &locked_wait, (VALUE) &w, &state);
+    if (state) {
+        w.op = LOCK_SH;
+        w.timeout = -1.0;
+        rb_protect( &locked_wait, (VALUE) &w, NULL);
+        rb_jump_tag( state);
+    }
+    return self;
+}
+
+VALUE
+rb_locked_downgrade_bang( VALUE self)
+{
+    struct locked_wait w;
+
+    w.self = self;
+    w.op = LOCK_SH;
+    w.range = NULL;
+    w.timeout = -1.0;
+    w.retries = 0;
+    w.timedout = 0;
+    locked_wait( (VALUE) &w);
     return self;
 }
 
+/*
+ *  call-seq:
+ *     unlock_range( offset, len)      -> self
+ *
+ *  Release a lock taken by #lock_range.  Parts of a range may be
+ *  unlocked, too.
+ */
+
+VALUE
+rb_locked_unlock_range( VALUE self, VALUE offset, VALUE len)
+{
+    struct locked_range r;
+
+    r.self = self;
+    locked_range_arg( &r.fl, offset, len);
+    locked_range_unlock( (VALUE) &r);
+    return self;
+}
+
+int
+locked_type( VALUE type)
+{
+    ID t;
+
+    t = SYMBOL_P( type) ? SYM2ID( type) : 0;
+    if (t == id_shared)
+        return LOCK_SH;
+    if (t != id_exclusive)
+        rb_raise( rb_eArgError, "lock type must be :shared or :exclusive");
+    return LOCK_EX;
+}
+
+void
+locked_range_arg( struct flock *fl, VALUE offset, VALUE len)
+{
+    memset( fl, 0, sizeof *fl);
+    fl->l_whence = SEEK_SET;
+    fl->l_start = NUM2OFFT( offset);
+    fl->l_len = NUM2OFFT( len);
+    if (fl->l_start < 0 || fl->l_len < 0)
+        rb_raise( rb_eArgError, "negative offset or length");
+}
+
+VALUE
+locked_range_unlock( VALUE arg)
+{
+    struct locked_range *r = (struct locked_range *) arg;
+    struct locked_flock f;
+
+    if (RTEST( rb_funcall( r->self, id_closed_p, 0)))
+        return Qnil;
+    f.fd = rb_io_descriptor( r->self);
+    f.op = LOCK_UN | LOCK_NB;
+    f.range = &r->fl;
+    if (locked_call( &f) != 0)
+        rb_syserr_fail_str( f.err, rb_io_path( r->self));
+    return Qnil;
+}
+
 
 /*
  *  call-seq:
  *     close()                 -> nil
  *
- *  Unlock using flock and close.
+ *  Sync and unmap the regions from #map, unlock using flock and close.
  */
 
 VALUE
 rb_locked_close( VALUE self)
 {
+    struct locked_stat *st;
+    VALUE since;
+    double h;
+    int err;
+
+    since = rb_attr_get( self, id_locked_since);
+    if (!NIL_P( since)) {
+        h = locked_now() - NUM2DBL( since);
+        st = locked_stat( rb_io_path( self));
+        st->holds++;
+        st->hold_total += h;
+        if (h > st->hold_max)
+            st->hold_max = h;
+        rb_ivar_set( self, id_locked_since, Qnil);
+    }
+    err = supplement_lockmap_release( self);
     flock( rb_io_descriptor( self), LOCK_UN);
     rb_call_super( 0, NULL);
+    if (err)
+        rb_syserr_fail_str( err, rb_io_path( self));
     return Qnil;
 }
 
+
+/*
+ *  call-seq:
+ *     LockedFile.stats( reset = false)     -> hash
+ *
+ *  Contention statistics of all LockedFiles opened so far, by path.
+ *  Files opened from a descriptor have no path and are left out.
+ *
+ *
+ *  <code>:acquisitions</code>::    locks taken
+ *  <code>:retries</code>::         attempts that found the lock taken
+ *  <code>:timeouts</code>::        opens that gave up
+ *  <code>:wait_total</code>, <code>:wait_max</code>::
+ *                                  seconds spent waiting
+ *  <code>:holds</code>, <code>:hold_total</code>, <code>:hold_max</code>::
+ *                                  seconds from open until #close
+ *  <code>:wait_histogram</code>::  number of waits below 1, 2, 4, ...
+ *                                  microseconds; the last entry counts
+ *                                  all the longer ones
+ *
+ *  Pass +true+ to start counting anew.
+ *
+ *     s = LockedFile.stats.max_by { |_,v| v[ :wait_total] }
+ */
+
+VALUE
+rb_locked_s_stats( int argc, VALUE *argv, VALUE cls)
+{
+    VALUE reset, r;
+
+    rb_scan_args( argc, argv, "01", &reset);
+    r = rb_hash_new();
+    if (locked_stats != NULL) {
+        st_foreach( locked_stats, &locked_stat_value, (st_data_t) r);
+        if (RTEST( reset)) {
+            st_foreach( locked_stats, &locked_stat_free, 0);
+            st_clear( locked_stats);
+        }
+    }
+    return r;
+}
+
+struct locked_stat *
+locked_stat( VALUE path)
+{
+    struct locked_stat *st;
+    st_data_t v;
+    char *key;
+
+    if (locked_stats == NULL)
+        locked_stats = st_init_strtable();
+    key = StringValueCStr( path);
+    if (st_lookup( locked_stats, (st_data_t) key, &v))
+        return (struct locked_stat *) v;
+    st = ZALLOC( struct locked_stat);
+    st_insert( locked_stats, (st_data_t) ruby_strdup( key), (st_data_t) st);
+    return st;
+}
+
+/*
+ *  Count a finished lock attempt of an open.  On success the time is
+ *  remembered for the hold time.  Files opened from a descriptor have
+ *  no path and are not counted.
+ */
+
+void
+locked_record( VALUE self, struct locked_wait *w, double wait)
+{
+    struct locked_stat *st;
+    VALUE path;
+    double us;
+    int i;
+
+    path = rb_io_path( self);
+    if (NIL_P( path))
+        return;
+    st = locked_stat( path);
+    st->retries += w->retries;
+    st->wait_total += wait;
+    if (wait > st->wait_max)
+        st->wait_max = wait;
+    for (i = 0, us = 1e-6; i < LOCKED_HIST - 1 && wait >= us; i++)
+        us *= 2;
+    st->hist[ i]++;
+    if (w->timedout) {
+        st->timeouts++;
+        return;
+    }
+    st->acquisitions++;
+    rb_ivar_set( self, id_locked_since, DBL2NUM( locked_now()));
+}
+
+int
+locked_stat_value( st_data_t key, st_data_t val, st_data_t arg)
+{
+    struct locked_stat *st = (struct locked_stat *) val;
+    VALUE h, hist;
+    int i;
+
+    h = rb_hash_new();
+    rb_hash_aset( h, sym_acquisitions, ULONG2NUM( st->acquisitions));
+    rb_hash_aset( h, sym_retries,      ULONG2NUM( st->retries));
+    rb_hash_aset( h, sym_timeouts,     ULONG2NUM( st->timeouts));
+    rb_hash_aset( h, sym_wait_total,   DBL2NUM( st->wait_total));
+    rb_hash_aset( h, sym_wait_max,     DBL2NUM( st->wait_max));
+    rb_hash_aset( h, sym_holds,        ULONG2NUM( st->holds));
+    rb_hash_aset( h, sym_hold_total,   DBL2NUM( st->hold_total));
+    rb_hash_aset( h, sym_hold_max,     DBL2NUM( st->hold_max));
+    hist = rb_ary_new_capa( LOCKED_HIST);
+    for (i = 0; i < LOCKED_HIST; i++)
+        rb_ary_push( hist, ULONG2NUM( st->hist[ i]));
+    rb_hash_aset( h, sym_wait_histogram, hist);
+    rb_hash_aset( (VALUE) arg, rb_str_new_cstr( (const char *) key), h);
+    return ST_CONTINUE;
+}
+
+int
+locked_stat_free( st_data_t key, st_data_t val, st_data_t arg)
+{
+    xfree( (void *) key);
+    xfree( (void *) val);
+    return ST_CONTINUE;
+}
+
 void Init_locked( void)
 {
     VALUE rb_cLockedFile;
@@ -88,5 +771,35 @@ void Init_locked( void)
 
     rb_define_method( rb_cLockedFile, "initialize", &rb_locked_init, -1);
     rb_define_method( rb_cLockedFile, "close",      &rb_locked_close, 0);
+    rb_define_method( rb_cLockedFile, "lock_range", &rb_locked_lock_range, -1);
+    rb_define_method( rb_cLockedFile, "unlock_range",
+                                                &rb_locked_unlock_range, 2);
+    rb_define_method( rb_cLockedFile, "upgrade!",
+                                                &rb_locked_upgrade_bang, -1);
+    rb_define_method( rb_cLockedFile, "downgrade!",
+                                                &rb_locked_downgrade_bang, 0);
+    rb_define_singleton_method( rb_cLockedFile, "stats",
+                                                &rb_locked_s_stats, -1);
+
+    Init_appendlog( rb_cLockedFile);
+    Init_lockmap( rb_cLockedFile);
+
+    id_blocking  = rb_intern( "blocking");
+    id_timeout   = rb_intern( "timeout");
+    id_lock      = rb_intern( "lock");
+    id_shared    = rb_intern( "shared");
+    id_exclusive = rb_intern( "exclusive");
+    id_closed_p  = rb_intern( "closed?");
+    id_locked_since = rb_intern( "locked_since");
+
+    sym_acquisitions   = ID2SYM( rb_intern( "acquisitions"));
+    sym_retries        = ID2SYM( rb_intern( "retries"));
+    sym_timeouts       = ID2SYM( rb_intern( "timeouts"));
+    sym_wait_total     = ID2SYM( rb_intern( "wait_total"));
+    sym_wait_max       = ID2SYM( rb_intern( "wait_max"));
+    sym_holds          = ID2SYM( rb_intern( "holds"));
+    sym_hold_total     = ID2SYM( rb_intern( "hold_total"));
+    sym_hold_max       = ID2SYM( rb_intern( "hold_max"));
+    sym_wait_histogram = ID2SYM( rb_intern( "wait_histogram"));
 }
 
@@ -9,8 +9,39 @@
 
 VALUE rb_locked_init( int argc, VALUE *argv, VALUE self);
 VALUE rb_locked_close( VALUE self);
+VALUE rb_locked_lock_range( int argc, VALUE *argv, VALUE self);
+VALUE rb_locked_unlock_range( VALUE self, VALUE offset, VALUE len);
+VALUE rb_locked_upgrade_bang( int argc, VALUE *argv, VALUE self);
+VALUE rb_locked_downgrade_bang( VALUE self);
+VALUE rb_locked_s_stats( int argc, VALUE *argv, VALUE cls);
+
+VALUE rb_alog_s_alloc( VALUE cls);
+VALUE rb_alog_s_open( int argc, VALUE *argv, VALUE cls);
+VALUE rb_alog_init( int argc, VALUE *argv, VALUE self);
+VALUE rb_alog_append( VALUE self, VALUE str);
+VALUE rb_alog_flush( VALUE self);
+VALUE rb_alog_stats( VALUE self);
+VALUE rb_alog_path( VALUE self);
+VALUE rb_alog_close( VALUE self);
+VALUE rb_alog_closed_p( VALUE self);
+
+VALUE rb_locked_map( int argc, VALUE *argv, VALUE self);
+VALUE rb_lockmap_get( VALUE self, VALUE type, VALUE offset);
+VALUE rb_lockmap_set( VALUE self, VALUE type, VALUE offset, VALUE val);
+VALUE rb_lockmap_read( VALUE self, VALUE offset, VALUE len);
+VALUE rb_lockmap_write( VALUE self, VALUE offset, VALUE str);
+VALUE rb_lockmap_fill( int argc, VALUE *argv, VALUE self);
+VALUE rb_lockmap_size( VALUE self);
+VALUE rb_lockmap_writable_p( VALUE self);
+VALUE rb_lockmap_mapped_p( VALUE self);
+VALUE rb_lockmap_sync( VALUE self);
+VALUE rb_lockmap_unmap( VALUE self);
+
+int supplement_lockmap_release( VALUE file);
 
 extern void Init_locked( void);
+extern void Init_appendlog( VALUE rb_cLockedFile);
+extern void Init_lockmap( VALUE rb_cLockedFile);
 
 #endif
 
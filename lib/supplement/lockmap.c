@@ -0,0 +1,457 @@
+/*
+ *  supplement/lockmap.c  --  Shared memory regions under a file lock
+ */
+
+#include "locked.h"
+#include "packtype.h"
+
+#include <ruby/io.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct lockmap {
+    char   *base;
+    size_t  size;
+    int     fd;
+    int     shared;
+    int     writable;
+};
+
+static struct lockmap *get_lockmap( VALUE);
+static void   lockmap_free( void *);
+static size_t lockmap_memsize( const void *);
+static char  *lockmap_at( struct lockmap *, VALUE, size_t);
+static int    lockmap_unmap( struct lockmap *);
+static VALUE  lockmap_yield( VALUE);
+
+static VALUE rb_cLockMap;
+
+static ID id_lockmaps = 0;
+static ID id_shared = 0;
+static ID id_private = 0;
+
+static const rb_data_type_t lockmap_data_type = {
+    "supplement:lockmap",
+    { NULL, &lockmap_free, &lockmap_memsize, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+/*
+ *  call-seq:
+ *     map( len = nil, mode = :shared)                  -> map
+ *     map( len = nil, mode = :shared) { |map| ... }    -> obj
+ *
+ *  Map the first +len+ bytes of the file into memory; +nil+ means the
+ *  whole file.  If the file is shorter and was opened for writing, it
+ *  is extended.
+ *
+ *  With +mode+ <code>:shared</code>, writes go to the file; they need
+ *  a file opened for writing.  A <code>:private</code> map may always
+ *  be written to but the changes stay in this process.
+ *
+ *  The map is valid as long as the lock is held.  When the file is
+ *  closed, it is synced to disk and unmapped.  In the block form, that
+ *  happens when the block ends.
+ *
+ *  Beware of truncating the file while it is mapped.  Touching memory
+ *  beyond its end kills the process with a bus error.  Every access
+ *  checks the file size first and raises an IOError instead, but that
+ *  cannot catch a truncation by another process between the check and
+ *  the access.  Note that a plain <code>File.open( path, "w")</code>, and
+ *  even <code>LockedFile.open( path, "w")</code>, truncates before
+ *  it locks.  Open shared files <code>"r+"</code> or <code>"a+"</code>.
+ *
+ *     LockedFile.open "counters", "r+" do |f|
+ *       m = f.map 4096
+ *       m.set :uint64, 8, (m.get :uint64, 8) + 1
+ *     end
+ */
+
+VALUE
+rb_locked_map( int argc, VALUE *argv, VALUE self)
+{
+    VALUE len, mode, obj, maps;
+    struct lockmap *m;
+    struct stat st;
+    int fd, acc;
+    ID mid;
+
+    rb_scan_args( argc, argv, "02", &len, &mode);
+    fd = rb_io_descriptor( self);
+    obj = TypedData_Make_Struct( rb_cLockMap, struct lockmap,
+                                 &lockmap_data_type, m);
+    m->fd = -1;
+    mid = NIL_P( mode) ? id_shared : rb_sym2id( mode);
+    if (mid == id_shared)
+        m->shared = 1;
+    else if (mid != id_private)
+        rb_raise( rb_eArgError, "map mode must be :shared or :private");
+
+    if (fstat( fd, &st) < 0)
+        rb_sys_fail_str( rb_io_path( self));
+    acc = fcntl( fd, F_GETFL) & O_ACCMODE;
+    m->writable = !m->shared || acc != O_RDONLY;
+    m->size = NIL_P( len) ? (size_t) st.st_size : NUM2SIZET( len);
+    if (m->size == 0)
+        rb_raise( rb_eArgError, "cannot map an empty region");
+    if ((off_t) m->size > st.st_size) {
+        if (acc == O_RDONLY)
+            rb_raise( rb_eArgError, "file is shorter than %zu bytes",
+                                                                m->size);
+        rb_io_flush( self);
+        if (ftruncate( fd, (off_t) m->size) < 0)
+            rb_sys_fail_str( rb_io_path( self));
+    }
+
+    m->base = mmap( NULL, m->size,
+                    PROT_READ | (m->writable ? PROT_WRITE : 0),
+                    m->shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (m->base == MAP_FAILED) {
+        m->base = NULL;
+        rb_sys_fail_str( rb_io_path( self));
+    }
+    m->fd = fcntl( fd, F_DUPFD_CLOEXEC, 0);
+    if (m->fd < 0)
+        rb_sys_fail_str( rb_io_path( self));
+
+    maps = rb_attr_get( self, id_lockmaps);
+    if (NIL_P( maps)) {
+        maps = rb_ary_new();
+        rb_ivar_set( self, id_lockmaps, maps);
+    }
+    rb_ary_push( maps, obj);
+    if (rb_block_given_p())
+        return rb_ensure( lockmap_yield, obj, rb_lockmap_unmap, obj);
+    return obj;
+}
+
+VALUE
+lockmap_yield( VALUE obj)
+{
+    return rb_yield( obj);
+}
+
+/*
+ *  Sync and unmap all regions of a LockedFile before it is unlocked.
+ *  Returns the first error number or 0.
+ */
+
+int
+supplement_lockmap_release( VALUE file)
+{
+    VALUE maps;
+    struct lockmap *m;
+    long i;
+    int err, r = 0;
+
+    maps = rb_attr_get( file, id_lockmaps);
+    if (NIL_P( maps))
+        return 0;
+    for (i = 0; i < RARRAY_LEN( maps); i++) {
+        TypedData_Get_Struct( RARRAY_AREF( maps, i), struct lockmap,
+                              &lockmap_data_type, m);
+        err = lockmap_unmap( m);
+        if (err && !r)
+            r = err;
+    }
+    rb_ivar_set( file, id_lockmaps, Qnil);
+    return r;
+}
+
+
+/*
+ *  Document-class: LockedFile::Map
+ *
+ *  A region of a LockedFile mapped into memory.  Values are read and
+ *  written in place, at byte offsets, in the native types of
+ *  <code>Packed</code> (<code>:int8</code> to <code>:uint64</code>,
+ *  <code>:float</code>, <code>:double</code>) and host byte order.
+ */
+
+struct lockmap *
+get_lockmap( VALUE obj)
+{
+    struct lockmap *m;
+
+    TypedData_Get_Struct( obj, struct lockmap, &lockmap_data_type, m);
+    if (m->base == NULL)
+        rb_raise( rb_eIOError, "unmapped region");
+    return m;
+}
+
+void
+lockmap_free( void *p)
+{
+    struct lockmap *m = p;
+
+    if (m->base != NULL)
+        munmap( m->base, m->size);
+    if (m->fd >= 0)
+        close( m->fd);
+    xfree( m);
+}
+
+size_t
+lockmap_memsize( const void *p)
+{
+    return sizeof (struct lockmap);
+}
+
+/*
+ *  The map keeps a descriptor of its own to look at the file size, so
+ *  it doesn't depend on the File object staying open.
+ */
+
+char *
+lockmap_at( struct lockmap *m, VALUE offset, size_t n)
+{
+    struct stat st;
+    long o;
+
+    o = NUM2LONG( offset);
+    if (o < 0 || (size_t) o > m->size || n > m->size - (size_t) o)
+        rb_raise( rb_eIndexError, "offset %ld out of range", o);
+    if (fstat( m->fd, &st) < 0)
+        rb_sys_fail( "fstat");
+    if ((off_t) (o + n) > st.st_size)
+        rb_raise( rb_eIOError, "file was truncated below the mapped region");
+    return m->base + o;
+}
+
+int
+lockmap_unmap( struct lockmap *m)
+{
+    int err = 0;
+
+    if (m->base == NULL)
+        return 0;
+    if (m->shared && m->writable && msync( m->base, m->size, MS_SYNC) < 0)
+        err = errno;
+    munmap( m->base, m->size);
+    m->base = NULL;
+    if (m->fd >= 0)
+        close( m->fd), m->fd = -1;
+    return err;
+}
+
+
+/*
+ *  call-seq:
+ *     get( type, offset)    -> num
+ *
+ *  Read a value of +type+ at +offset+.
+ */
+
+VALUE
+rb_lockmap_get( VALUE self, VALUE type, VALUE offset)
+{
+    struct lockmap *m;
+    int t;
+
+    m = get_lockmap( self);
+    t = supplement_ptype( type);
+    if (t == PTYPE_VALUE)
+        rb_raise( rb_eArgError, "cannot map Ruby objects");
+    return supplement_ptype_load( t,
+                        lockmap_at( m, offset, supplement_ptype_size( t)));
+}
+
+/*
+ *  call-seq:
+ *     set( type, offset, num)    -> num
+ *
+ *  Write +num+ as a value of +type+ at +offset+.
+ */
+
+VALUE
+rb_lockmap_set( VALUE self, VALUE type, VALUE offset, VALUE val)
+{
+    struct lockmap *m;
+    int t;
+
+    m = get_lockmap( self);
+    t = supplement_ptype( type);
+    if (t == PTYPE_VALUE)
+        rb_raise( rb_eArgError, "cannot map Ruby objects");
+    if (!m->writable)
+        rb_raise( rb_eIOError, "region is read-only");
+    supplement_ptype_store( t,
+                lockmap_at( m, offset, supplement_ptype_size( t)), val);
+    return val;
+}
+
+/*
+ *  call-seq:
+ *     read( offset, len)    -> str
+ *
+ *  A copy of +len+ bytes at +offset+ as a binary String.
+ */
+
+VALUE
+rb_lockmap_read( VALUE self, VALUE offset, VALUE len)
+{
+    struct lockmap *m;
+    size_t n;
+
+    m = get_lockmap( self);
+    n = NUM2SIZET( len);
+    return rb_str_new( lockmap_at( m, offset, n), n);
+}
+
+/*
+ *  call-seq:
+ *     write( offset, str)    -> int
+ *
+ *  Copy +str+ to +offset+.  Returns the number of bytes written.
+ */
+
+VALUE
+rb_lockmap_write( VALUE self, VALUE offset, VALUE str)
+{
+    struct lockmap *m;
+    char *p;
+
+    m = get_lockmap( self);
+    if (!m->writable)
+        rb_raise( rb_eIOError, "region is read-only");
+    StringValue( str);
+    p = lockmap_at( m, offset, RSTRING_LEN( str));
+    memcpy( p, RSTRING_PTR( str), RSTRING_LEN( str));
+    return LONG2NUM( RSTRING_LEN( str));
+}
+
+/*
+ *  call-seq:
+ *     fill( byte = 0, offset = 0, len = nil)    -> self
+ *
+ *  Set +len+ bytes from +offset+ on to +byte+; +nil+ means up to the
+ *  end.
+ */
+
+VALUE
+rb_lockmap_fill( int argc, VALUE *argv, VALUE self)
+{
+    VALUE byte, offset, len;
+    struct lockmap *m;
+    size_t o, n;
+
+    rb_scan_args( argc, argv, "03", &byte, &offset, &len);
+    m = get_lockmap( self);
+    if (!m->writable)
+        rb_raise( rb_eIOError, "region is read-only");
+    if (NIL_P( offset))
+        offset = INT2FIX( 0);
+    o = NUM2SIZET( offset);
+    n = NIL_P( len) ? (o < m->size ? m->size - o : 0) : NUM2SIZET( len);
+    memset( lockmap_at( m, offset, n), NIL_P( byte) ? 0 : NUM2INT( byte), n);
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     size    -> int
+ */
+
+VALUE
+rb_lockmap_size( VALUE self)
+{
+    struct lockmap *m;
+
+    TypedData_Get_Struct( self, struct lockmap, &lockmap_data_type, m);
+    return SIZET2NUM( m->size);
+}
+
+/*
+ *  call-seq:
+ *     writable?    -> true or false
+ */
+
+VALUE
+rb_lockmap_writable_p( VALUE self)
+{
+    return get_lockmap( self)->writable ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     mapped?    -> true or false
+ */
+
+VALUE
+rb_lockmap_mapped_p( VALUE self)
+{
+    struct lockmap *m;
+
+    TypedData_Get_Struct( self, struct lockmap, &lockmap_data_type, m);
+    return m->base != NULL ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     sync    -> self
+ *
+ *  Write the changes to disk now (<code>msync</code>).
+ */
+
+VALUE
+rb_lockmap_sync( VALUE self)
+{
+    struct lockmap *m;
+
+    m = get_lockmap( self);
+    if (m->shared && m->writable && msync( m->base, m->size, MS_SYNC) < 0)
+        rb_sys_fail( "msync");
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     unmap    -> nil
+ *
+ *  Sync and release the region.  Further access raises an IOError.
+ */
+
+VALUE
+rb_lockmap_unmap( VALUE self)
+{
+    struct lockmap *m;
+    int err;
+
+    TypedData_Get_Struct( self, struct lockmap, &lockmap_data_type, m);
+    err = lockmap_unmap( m);
+    if (err)
+        rb_syserr_fail( err, "msync");
+    return Qnil;
+}
+
+
+void Init_lockmap( VALUE rb_cLockedFile)
+{
+    rb_define_method( rb_cLockedFile, "map", &rb_locked_map, -1);
+
+    rb_cLockMap = rb_define_class_under( rb_cLockedFile, "Map", rb_cObject);
+    rb_undef_alloc_func( rb_cLockMap);
+    rb_define_method( rb_cLockMap, "get",       &rb_lockmap_get, 2);
+    rb_define_method( rb_cLockMap, "set",       &rb_lockmap_set, 3);
+    rb_define_method( rb_cLockMap, "read",      &rb_lockmap_read, 2);
+    rb_define_method( rb_cLockMap, "write",     &rb_lockmap_write, 2);
+    rb_define_method( rb_cLockMap, "fill",      &rb_lockmap_fill, -1);
+    rb_define_method( rb_cLockMap, "size",      &rb_lockmap_size, 0);
+    rb_define_method( rb_cLockMap, "writable?", &rb_lockmap_writable_p, 0);
+    rb_define_method( rb_cLockMap, "mapped?",   &rb_lockmap_mapped_p, 0);
+    rb_define_method( rb_cLockMap, "sync",      &rb_lockmap_sync, 0);
+    rb_define_method( rb_cLockMap, "unmap",     &rb_lockmap_unmap, 0);
+
+    id_lockmaps = rb_intern( "lockmaps");
+    id_shared   = rb_intern( "shared");
+    id_private  = rb_intern( "private");
+}
+
@@ -0,0 +1,1051 @@
+/*
+ *  supplement/packed.c  --  Structs with native typed fields
+ */
+
+#include "packed.h"
+
+#include "packtype.h"
+
+#include <limits.h>
+#include <string.h>
+
+
+struct packed_field {
+    ID     name;
+    ID     aset;
+    int    type;
+    size_t offset;
+};
+
+struct packed_layout {
+    int    nfields;
+    int    nvalues;
+    size_t size;
+    struct packed_field field[];
+};
+
+struct packed {
+    VALUE layout;
+    char  data[];
+};
+
+struct packed_array {
+    VALUE  klass;
+    VALUE  layout;
+    long   len;
+    long   capa;
+    char  *ptr;
+};
+
+
+static void   packed_layout_mark( const struct packed_layout *, const char *);
+static size_t packed_layout_memsize( const void *);
+static struct packed_layout *get_layout( VALUE);
+static VALUE  packed_class_layout( VALUE);
+static void   packed_record_init( const struct packed_layout *, char *);
+static int    packed_index( const struct packed_layout *, VALUE);
+static VALUE  packed_new( VALUE, VALUE, const char *);
+static struct packed *get_packed( VALUE);
+static void   packed_mark( void *);
+static size_t packed_memsize( const void *);
+static void   packary_mark( void *);
+static void   packary_free( void *);
+static size_t packary_memsize( const void *);
+static struct packed_array *get_packary( VALUE);
+static long   packary_offset( struct packed_array *, VALUE);
+static void   packary_resize( struct packed_array *, long);
+
+static VALUE rb_cPacked;
+static VALUE rb_cPackedArray;
+
+static ID id_layout = 0;
+
+static const rb_data_type_t layout_data_type = {
+    "supplement:packed_layout",
+    { NULL, RUBY_TYPED_DEFAULT_FREE, &packed_layout_memsize, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t packed_data_type = {
+    "supplement:packed",
+    { &packed_mark, RUBY_TYPED_DEFAULT_FREE, &packed_memsize, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t packary_data_type = {
+    "supplement:packed_array",
+    { &packary_mark, &packary_free, &packary_memsize, NULL},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+void
+packed_layout_mark( const struct packed_layout *l, const char *data)
+{
+    int i;
+
+    if (!l->nvalues)
+        return;
+    for (i = 0; i < l->nfields; i++)
+        if (l->field[ i].type == PTYPE_VALUE) {
+            VALUE v;
+
+            memcpy( &v, data + l->field[ i].offset, sizeof v);
+            rb_gc_mark( v);
+        }
+}
+
+size_t
+packed_layout_memsize( const void *p)
+{
+    const struct packed_layout *l = p;
+    return sizeof *l + l->nfields * sizeof l->field[ 0];
+}
+
+struct packed_layout *
+get_layout( VALUE layout)
+{
+    struct packed_layout *l;
+    TypedData_Get_Struct( layout, struct packed_layout, &layout_data_type, l);
+    return l;
+}
+
+VALUE
+packed_class_layout( VALUE klass)
+{
+    VALUE c;
+
+    for (c = klass; RTEST( c); c = rb_class_superclass( c))
+        if (rb_ivar_defined( c, id_layout))
+            return rb_ivar_get( c, id_layout);
+    rb_raise( rb_eTypeError, "%"PRIsVALUE" is not a packed struct class",
+                                                                    klass);
+    return Qnil;
+}
+
+void
+packed_record_init( const struct packed_layout *l, char *data)
+{
+    int i;
+
+    memset( data, 0, l->size);
+    if (!l->nvalues)
+        return;
+    for (i = 0; i < l->nfields; i++)
+        if (l->field[ i].type == PTYPE_VALUE)
+            supplement_ptype_store( PTYPE_VALUE, data + l->field[ i].offset,
+                                    Qnil);
+}
+
+int
+packed_index( const struct packed_layout *l, VALUE key)
+{
+    int i;
+
+    if (FIXNUM_P( key)) {
+        long n = FIX2LONG( key);
+
+        if (n < 0)
+            n += l->nfields;
+        if (n < 0 || n >= l->nfields)
+            rb_raise( rb_eIndexError, "offset %ld too large for struct(size:%d)",
+                                        FIX2LONG( key), l->nfields);
+        return (int) n;
+    } else {
+        ID id;
+
+        id = rb_check_id( &key);
+        for (i = 0; i < l->nfields; i++)
+            if (l->field[ i].name == id)
+                return i;
+        rb_name_error_str( key, "no member '%"PRIsVALUE"' in struct", key);
+    }
+    return -1;
+}
+
+VALUE
+packed_new( VALUE klass, VALUE layout, const char *data)
+{
+    VALUE obj;
+    struct packed *s;
+
+    obj = rb_packed_s_alloc( klass);
+    s = get_packed( obj);
+    if (s->layout != layout)
+        rb_raise( rb_eTypeError, "layout of %"PRIsVALUE" differs", klass);
+    memcpy( s->data, data, get_layout( layout)->size);
+    return obj;
+}
+
+
+/*
+ *  Document-class: Struct
+ */
+
+/*
+ *  call-seq:
+ *     Struct.packed( name: type, ...)                 -> cls
+ *     Struct.packed( name: type, ...) { ... }         -> cls
+ *
+ *  Create a struct class whose fields are stored as native values inside
+ *  the object instead of as Ruby objects.  Types are
+ *  <code>:int8</code>, <code>:uint8</code>, <code>:int16</code>,
+ *  <code>:uint16</code>, <code>:int32</code>, <code>:uint32</code>,
+ *  <code>:int64</code>, <code>:uint64</code>, <code>:float</code>,
+ *  <code>:double</code> and <code>:value</code> (any Ruby object).
+ *
+ *     P = Struct.packed a: :int64, b: :double, name: :value
+ *     p = P[ 1, 0.5, "x"]     #=> #<packed P a=1, b=0.5, name="x">
+ *     p.b += 1.0
+ *     p.fields :name, :a      #=> ["x", 1]
+ *
+ *  See Packed::Array for a contiguous collection of such records.
+ */
+
+VALUE
+rb_struct_s_packed( int argc, VALUE *argv, VALUE klass)
+{
+    VALUE fields, keys, layout, cls;
+    struct packed_layout *l;
+    long i, n;
+    size_t sz;
+
+    rb_scan_args( argc, argv, "0:", &fields);
+    if (NIL_P( fields) || RHASH_SIZE( fields) == 0)
+        rb_raise( rb_eArgError, "no fields given");
+    keys = rb_funcall( fields, rb_intern( "keys"), 0);
+    n = RARRAY_LEN( keys);
+
+    layout = rb_data_typed_object_zalloc( 0,
+                    sizeof (struct packed_layout) + n * sizeof (struct packed_field),
+                    &layout_data_type);
+    l = RTYPEDDATA_DATA( layout);
+    l->nfields = n;
+    for (i = 0; i < n; i++) {
+        VALUE k = RARRAY_AREF( keys, i);
+        struct packed_field *f = l->field + i;
+
+        f->name = rb_to_id( k);
+        f->aset = rb_id_attrset( f->name);
+        f->type = supplement_ptype( rb_hash_aref( fields, k));
+        if (f->type == PTYPE_VALUE)
+            l->nvalues++;
+    }
+
+    /* Place the widest fields first so that no padding is needed. */
+    l->size = 0;
+    for (sz = 8; sz; sz >>= 1)
+        for (i = 0; i < n; i++)
+            if (supplement_ptype_size( l->field[ i].type) == sz) {
+                l->field[ i].offset = l->size;
+                l->size += sz;
+            }
+    l->size = (l->size + 7) & ~(size_t) 7;
+
+    cls = rb_funcall( rb_cClass, rb_intern( "new"), 1, rb_cPacked);
+    rb_ivar_set( cls, id_layout, layout);
+    for (i = 0; i < n; i++) {
+        rb_define_method( cls, rb_id2name( l->field[ i].name), rb_packed_get, 0);
+        rb_define_method( cls, rb_id2name( l->field[ i].aset), rb_packed_set, 1);
+    }
+    if (rb_block_given_p())
+        rb_funcall_with_block( cls, rb_intern( "class_eval"), 0, NULL,
+                                rb_block_proc());
+    return cls;
+}
+
+
+/*
+ *  Document-class: Packed
+ *
+ *  Base class of the classes generated by Struct.packed.  Instances
+ *  hold their fields in one piece of native memory.
+ */
+
+VALUE
+rb_packed_s_alloc( VALUE klass)
+{
+    VALUE layout, obj;
+    struct packed_layout *l;
+    struct packed *s;
+
+    layout = packed_class_layout( klass);
+    l = get_layout( layout);
+    obj = rb_data_typed_object_zalloc( klass, sizeof (struct packed) + l->size,
+                                        &packed_data_type);
+    s = RTYPEDDATA_DATA( obj);
+    s->layout = layout;
+    packed_record_init( l, s->data);
+    return obj;
+}
+
+struct packed *
+get_packed( VALUE self)
+{
+    struct packed *s;
+    TypedData_Get_Struct( self, struct packed, &packed_data_type, s);
+    return s;
+}
+
+void
+packed_mark( void *p)
+{
+    struct packed *s = p;
+
+    if (s->layout) {
+        rb_gc_mark( s->layout);
+        packed_layout_mark( get_layout( s->layout), s->data);
+    }
+}
+
+size_t
+packed_memsize( const void *p)
+{
+    const struct packed *s = p;
+    return sizeof *s + (s->layout ? get_layout( s->layout)->size : 0);
+}
+
+
+/*
+ *  call-seq:
+ *     members   -> ary
+ *
+ *  The field names as symbols.
+ */
+
+VALUE
+rb_packed_s_members( VALUE klass)
+{
+    struct packed_layout *l;
+    VALUE r;
+    int i;
+
+    l = get_layout( packed_class_layout( klass));
+    r = rb_ary_new2( l->nfields);
+    for (i = 0; i < l->nfields; i++)
+        rb_ary_push( r, ID2SYM( l->field[ i].name));
+    return r;
+}
+
+/*
+ *  call-seq:
+ *     types   -> hash
+ *
+ *  The field names and their native types.
+ *
+ *     P = Struct.packed a: :int64, b: :double
+ *     P.types        #=> {:a=>:int64, :b=>:double}
+ */
+
+VALUE
+rb_packed_s_types( VALUE klass)
+{
+    struct packed_layout *l;
+    VALUE r;
+    int i;
+
+    l = get_layout( packed_class_layout( klass));
+    r = rb_hash_new();
+    for (i = 0; i < l->nfields; i++)
+        rb_hash_aset( r, ID2SYM( l->field[ i].name),
+                            supplement_ptype_name( l->field[ i].type));
+    return r;
+}
+
+/*
+ *  call-seq:
+ *     bytesize   -> int
+ *
+ *  Number of bytes one record occupies.
+ */
+
+VALUE
+rb_packed_s_bytesize( VALUE klass)
+{
+    return SIZET2NUM( get_layout( packed_class_layout( klass))->size);
+}
+
+
+/*
+ *  call-seq:
+ *     new( *values)   -> packed
+ *     [ *values]      -> packed
+ *
+ *  Fields that are not given are zero resp. +nil+.
+ */
+
+VALUE
+rb_packed_init( int argc, VALUE *argv, VALUE self)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    int i;
+
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    if (argc > l->nfields)
+        rb_raise( rb_eArgError, "struct size differs");
+    for (i = 0; i < argc; i++)
+        supplement_ptype_store( l->field[ i].type,
+                                s->data + l->field[ i].offset, argv[ i]);
+    return Qnil;
+}
+
+VALUE
+rb_packed_init_copy( VALUE self, VALUE orig)
+{
+    struct packed *s, *o;
+
+    if (self == orig)
+        return self;
+    rb_check_frozen( self);
+    s = get_packed( self);
+    o = get_packed( orig);
+    if (s->layout != o->layout)
+        rb_raise( rb_eTypeError, "initialize_copy should take same class object");
+    memcpy( s->data, o->data, get_layout( s->layout)->size);
+    return self;
+}
+
+
+/*
+ *  call-seq:
+ *     packed[ name]    -> obj
+ *     packed[ index]   -> obj
+ *
+ *  Field value by name or by position.
+ */
+
+VALUE
+rb_packed_aref( VALUE self, VALUE key)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    int i;
+
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    i = packed_index( l, key);
+    return supplement_ptype_load( l->field[ i].type, s->data + l->field[ i].offset);
+}
+
+/*
+ *  call-seq:
+ *     packed[ name] = obj    -> obj
+ *     packed[ index] = obj   -> obj
+ *
+ *  Set a field.  The value is converted to the field's native type.
+ */
+
+VALUE
+rb_packed_aset( VALUE self, VALUE key, VALUE val)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    int i;
+
+    rb_check_frozen( self);
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    i = packed_index( l, key);
+    supplement_ptype_store( l->field[ i].type, s->data + l->field[ i].offset, val);
+    return val;
+}
+
+VALUE
+rb_packed_get( VALUE self)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    ID id;
+    int i;
+
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    id = rb_frame_this_func();
+    for (i = 0; i < l->nfields; i++)
+        if (l->field[ i].name == id)
+            return supplement_ptype_load( l->field[ i].type,
+                                          s->data + l->field[ i].offset);
+    rb_raise( rb_eNameError, "no such member");
+    return Qnil;
+}
+
+VALUE
+rb_packed_set( VALUE self, VALUE val)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    ID id;
+    int i;
+
+    rb_check_frozen( self);
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    id = rb_frame_this_func();
+    for (i = 0; i < l->nfields; i++)
+        if (l->field[ i].aset == id) {
+            supplement_ptype_store( l->field[ i].type,
+                                    s->data + l->field[ i].offset, val);
+            return val;
+        }
+    rb_raise( rb_eNameError, "no such member");
+    return Qnil;
+}
+
+
+/*
+ *  call-seq:
+ *     members   -> ary
+ *
+ *  The field names as symbols.
+ */
+
+VALUE
+rb_packed_members( VALUE self)
+{
+    return rb_packed_s_members( CLASS_OF( self));
+}
+
+/*
+ *  call-seq:
+ *     to_a     -> ary
+ *     values   -> ary
+ *
+ *  All field values.
+ */
+
+VALUE
+rb_packed_to_a( VALUE self)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    VALUE r;
+    int i;
+
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    r = rb_ary_new2( l->nfields);
+    for (i = 0; i < l->nfields; i++)
+        rb_ary_push( r, supplement_ptype_load( l->field[ i].type,
+                                               s->data + l->field[ i].offset));
+    return r;
+}
+
+/*
+ *  call-seq:
+ *     to_h   -> hash
+ *
+ *  Field names and values.
+ */
+
+VALUE
+rb_packed_to_h( VALUE self)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    VALUE r;
+    int i;
+
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    r = rb_hash_new();
+    for (i = 0; i < l->nfields; i++)
+        rb_hash_aset( r, ID2SYM( l->field[ i].name),
+                        supplement_ptype_load( l->field[ i].type,
+                                               s->data + l->field[ i].offset));
+    return r;
+}
+
+/*
+ *  call-seq:
+ *     each { |obj| ... }   -> self
+ *
+ *  Yield the field values.
+ */
+
+VALUE
+rb_packed_each( VALUE self)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    int i;
+
+    RETURN_ENUMERATOR( self, 0, 0);
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    for (i = 0; i < l->nfields; i++)
+        rb_yield( supplement_ptype_load( l->field[ i].type,
+                                         s->data + l->field[ i].offset));
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     fields( ...)         -> ary
+ *     fetch_values( ...)   -> ary
+ *
+ *  Returns the values of some fields, like Struct#fields.
+ */
+
+VALUE
+rb_packed_fields( int argc, VALUE *argv, VALUE self)
+{
+    VALUE ary;
+    int i;
+
+    ary = rb_ary_new2( argc);
+    for (i = 0; i < argc; i++)
+        rb_ary_push( ary, rb_packed_aref( self, argv[ i]));
+    return ary;
+}
+
+/*
+ *  call-seq:
+ *     packed == other   -> true or false
+ *
+ *  Same class and all fields equal.
+ */
+
+VALUE
+rb_packed_equal( VALUE self, VALUE other)
+{
+    struct packed *s, *o;
+    struct packed_layout *l;
+    int i;
+
+    if (self == other)
+        return Qtrue;
+    if (CLASS_OF( self) != CLASS_OF( other))
+        return Qfalse;
+    s = get_packed( self);
+    o = get_packed( other);
+    l = get_layout( s->layout);
+    for (i = 0; i < l->nfields; i++) {
+        struct packed_field *f = l->field + i;
+
+        if (!rb_equal( supplement_ptype_load( f->type, s->data + f->offset),
+                       supplement_ptype_load( f->type, o->data + f->offset)))
+            return Qfalse;
+    }
+    return Qtrue;
+}
+
+/*
+ *  call-seq:
+ *     inspect   -> str
+ *
+ *  Like Struct#inspect.
+ */
+
+VALUE
+rb_packed_inspect( VALUE self)
+{
+    struct packed *s;
+    struct packed_layout *l;
+    VALUE str, cn;
+    int i;
+
+    s = get_packed( self);
+    l = get_layout( s->layout);
+    str = rb_str_buf_new2( "#<packed ");
+    cn = rb_class_path( rb_obj_class( self));
+    if (RSTRING_PTR( cn)[ 0] != '#') {
+        rb_str_append( str, cn);
+        rb_str_buf_cat2( str, " ");
+    }
+    for (i = 0; i < l->nfields; i++) {
+        if (i > 0)
+            rb_str_buf_cat2( str, ", ");
+        rb_str_append( str, rb_id2str( l->field[ i].name));
+        rb_str_buf_cat2( str, "=");
+        rb_str_append( str, rb_inspect( supplement_ptype_load( l->field[ i].type,
+                                            s->data + l->field[ i].offset)));
+    }
+    rb_str_buf_cat2( str, ">");
+    return str;
+}
+
+
+/*
+ *  Document-class: Packed::Array
+ *
+ *  A sequence of records of one packed struct class, held in one
+ *  contiguous block of memory.  Reading an element returns a copy.
+ *
+ *     P = Struct.packed a: :int64, b: :double
+ *     a = Packed::Array.new P
+ *     a << P[ 1, 0.5]
+ *     a[ 0, :b]        #=> 0.5
+ *     a[ 0, :b] = 2.0
+ *     a[ 0]            #=> #<packed P a=1, b=2.0>
+ */
+
+VALUE
+rb_packary_s_alloc( VALUE klass)
+{
+    struct packed_array *a;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct( klass, struct packed_array, &packary_data_type, a);
+    a->klass = Qnil;
+    a->layout = Qnil;
+    return obj;
+}
+
+void
+packary_mark( void *p)
+{
+    struct packed_array *a = p;
+    struct packed_layout *l;
+    long i;
+
+    rb_gc_mark( a->klass);
+    rb_gc_mark( a->layout);
+    if (NIL_P( a->layout))
+        return;
+    l = get_layout( a->layout);
+    if (l->nvalues)
+        for (i = 0; i < a->len; i++)
+            packed_layout_mark( l, a->ptr + i * l->size);
+}
+
+void
+packary_free( void *p)
+{
+    struct packed_array *a = p;
+
+    ruby_xfree( a->ptr);
+    ruby_xfree( a);
+}
+
+size_t
+packary_memsize( const void *p)
+{
+    const struct packed_array *a = p;
+    return sizeof *a + (NIL_P( a->layout) ? 0 :
+                                    a->capa * get_layout( a->layout)->size);
+}
+
+struct packed_array *
+get_packary( VALUE self)
+{
+    struct packed_array *a;
+
+    TypedData_Get_Struct( self, struct packed_array, &packary_data_type, a);
+    if (NIL_P( a->layout))
+        rb_raise( rb_eTypeError, "uninitialized packed array");
+    return a;
+}
+
+long
+packary_offset( struct packed_array *a, VALUE idx)
+{
+    long i;
+
+    i = NUM2LONG( idx);
+    if (i < 0)
+        i += a->len;
+    return i;
+}
+
+void
+packary_resize( struct packed_array *a, long len)
+{
+    struct packed_layout *l;
+
+    l = get_layout( a->layout);
+    if (len > a->capa) {
+        long capa = a->capa < 16 ? 16 : a->capa;
+        long max = LONG_MAX / (long) l->size;
+
+        if (len > max)
+            rb_raise( rb_eArgError, "packed array size too big");
+        while (capa < len)
+            capa = capa > max / 2 ? max : capa * 2;
+        REALLOC_N( a->ptr, char, capa * l->size);
+        a->capa = capa;
+    }
+    for (; a->len < len; a->len++)
+        packed_record_init( l, a->ptr + a->len * l->size);
+}
+
+
+/*
+ *  call-seq:
+ *     Packed::Array.new( cls, len = 0)   -> ary
+ *
+ *  A packed array of +len+ blank records of class +cls+.
+ */
+
+VALUE
+rb_packary_init( int argc, VALUE *argv, VALUE self)
+{
+    struct packed_array *a;
+    VALUE cls, len;
+
+    TypedData_Get_Struct( self, struct packed_array, &packary_data_type, a);
+    if (!NIL_P( a->layout))
+        rb_raise( rb_eTypeError, "packed array already initialized");
+    rb_scan_args( argc, argv, "11", &cls, &len);
+    a->layout = packed_class_layout( cls);
+    a->klass = cls;
+    packary_resize( a, NIL_P( len) ? 0 : NUM2LONG( len));
+    return Qnil;
+}
+
+VALUE
+rb_packary_init_copy( VALUE self, VALUE orig)
+{
+    struct packed_array *a, *o;
+
+    if (self == orig)
+        return self;
+    rb_check_frozen( self);
+    TypedData_Get_Struct( self, struct packed_array, &packary_data_type, a);
+    o = get_packary( orig);
+    ruby_xfree( a->ptr);
+    a->ptr = NULL;
+    a->len = a->capa = 0;
+    a->klass = o->klass;
+    a->layout = o->layout;
+    packary_resize( a, o->len);
+    memcpy( a->ptr, o->ptr, o->len * get_layout( o->layout)->size);
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     record_class   -> cls
+ *
+ *  The packed struct class of the elements.
+ */
+
+VALUE
+rb_packary_record_class( VALUE self)
+{
+    return get_packary( self)->klass;
+}
+
+/*
+ *  call-seq:
+ *     length   -> int
+ *     size     -> int
+ *
+ *  Number of records.
+ */
+
+VALUE
+rb_packary_length( VALUE self)
+{
+    return LONG2NUM( get_packary( self)->len);
+}
+
+/*
+ *  call-seq:
+ *     bytesize   -> int
+ *
+ *  Bytes used by the records.
+ */
+
+VALUE
+rb_packary_bytesize( VALUE self)
+{
+    struct packed_array *a;
+
+    a = get_packary( self);
+    return SIZET2NUM( a->len * get_layout( a->layout)->size);
+}
+
+/*
+ *  call-seq:
+ *     ary[ index]          -> packed or nil
+ *     ary[ index, field]   -> obj
+ *
+ *  Copy of a record or a single field without creating a record object.
+ */
+
+VALUE
+rb_packary_aref( int argc, VALUE *argv, VALUE self)
+{
+    struct packed_array *a;
+    struct packed_layout *l;
+    VALUE idx, field;
+    long i;
+    char *r;
+
+    a = get_packary( self);
+    l = get_layout( a->layout);
+    rb_scan_args( argc, argv, "11", &idx, &field);
+    i = packary_offset( a, idx);
+    if (i < 0 || i >= a->len) {
+        if (argc > 1)
+            rb_raise( rb_eIndexError, "index %ld out of array", NUM2LONG( idx));
+        return Qnil;
+    }
+    r = a->ptr + i * l->size;
+    if (argc > 1) {
+        int f = packed_index( l, field);
+        return supplement_ptype_load( l->field[ f].type, r + l->field[ f].offset);
+    }
+    return packed_new( a->klass, a->layout, r);
+}
+
+/*
+ *  call-seq:
+ *     ary[ index] = packed          -> packed
+ *     ary[ index, field] = obj      -> obj
+ *
+ *  Store a record or a single field.  Storing a record beyond the end
+ *  fills the gap with blank records.
+ */
+
+VALUE
+rb_packary_aset( int argc, VALUE *argv, VALUE self)
+{
+    struct packed_array *a;
+    struct packed_layout *l;
+    long i;
+
+    rb_check_frozen( self);
+    a = get_packary( self);
+    l = get_layout( a->layout);
+    rb_check_arity( argc, 2, 3);
+    i = packary_offset( a, argv[ 0]);
+    if (argc > 2) {
+        int f;
+
+        if (i < 0 || i >= a->len)
+            rb_raise( rb_eIndexError, "index %ld out of array", NUM2LONG( argv[ 0]));
+        f = packed_index( l, argv[ 1]);
+        supplement_ptype_store( l->field[ f].type,
+                                a->ptr + i * l->size + l->field[ f].offset,
+                                argv[ 2]);
+        return argv[ 2];
+    } else {
+        struct packed *s;
+
+        if (i < 0)
+            rb_raise( rb_eIndexError, "index %ld too small for array",
+                                                    NUM2LONG( argv[ 0]));
+        s = get_packed( argv[ 1]);
+        if (s->layout != a->layout)
+            rb_raise( rb_eTypeError, "record of wrong class");
+        if (i >= LONG_MAX / (long) l->size)
+            rb_raise( rb_eArgError, "packed array size too big");
+        if (i >= a->len)
+            packary_resize( a, i + 1);
+        memcpy( a->ptr + i * l->size, s->data, l->size);
+        return argv[ 1];
+    }
+}
+
+/*
+ *  call-seq:
+ *     ary << packed      -> ary
+ *     push( packed)      -> ary
+ *
+ *  Append a copy of a record.
+ */
+
+VALUE
+rb_packary_push( VALUE self, VALUE rec)
+{
+    VALUE args[ 2];
+
+    args[ 0] = LONG2NUM( get_packary( self)->len);
+    args[ 1] = rec;
+    rb_packary_aset( 2, args, self);
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     each { |packed| ... }   -> self
+ *
+ *  Yield a copy of every record.
+ */
+
+VALUE
+rb_packary_each( VALUE self)
+{
+    struct packed_array *a;
+    long i;
+
+    RETURN_ENUMERATOR( self, 0, 0);
+    a = get_packary( self);
+    for (i = 0; i < a->len; i++)
+        rb_yield( packed_new( a->klass, a->layout,
+                              a->ptr + i * get_layout( a->layout)->size));
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     to_a   -> ary
+ *
+ *  All records as Ruby objects.
+ */
+
+VALUE
+rb_packary_to_a( VALUE self)
+{
+    struct packed_array *a;
+    VALUE r;
+    long i;
+
+    a = get_packary( self);
+    r = rb_ary_new2( a->len);
+    for (i = 0; i < a->len; i++)
+        rb_ary_push( r, packed_new( a->klass, a->layout,
+                              a->ptr + i * get_layout( a->layout)->size));
+    return r;
+}
+
+
+void Init_packed( void)
+{
+    id_layout = rb_intern( "__layout__");
+
+    rb_define_singleton_method( rb_cStruct, "packed", rb_struct_s_packed, -1);
+
+    rb_cPacked = rb_define_class( "Packed", rb_cObject);
+    rb_define_alloc_func( rb_cPacked, rb_packed_s_alloc);
+    rb_define_singleton_method( rb_cPacked, "members", rb_packed_s_members, 0);
+    rb_define_singleton_method( rb_cPacked, "types", rb_packed_s_types, 0);
+    rb_define_singleton_method( rb_cPacked, "bytesize", rb_packed_s_bytesize, 0);
+    rb_define_alias( rb_singleton_class( rb_cPacked), "[]", "new");
+
+    rb_define_method( rb_cPacked, "initialize", rb_packed_init, -1);
+    rb_define_method( rb_cPacked, "initialize_copy", rb_packed_init_copy, 1);
+    rb_define_method( rb_cPacked, "[]", rb_packed_aref, 1);
+    rb_define_method( rb_cPacked, "[]=", rb_packed_aset, 2);
+    rb_define_method( rb_cPacked, "members", rb_packed_members, 0);
+    rb_define_method( rb_cPacked, "to_a", rb_packed_to_a, 0);
+    rb_define_alias(  rb_cPacked, "values", "to_a");
+    rb_define_alias(  rb_cPacked, "deconstruct", "to_a");
+    rb_define_method( rb_cPacked, "to_h", rb_packed_to_h, 0);
+    rb_define_method( rb_cPacked, "each", rb_packed_each, 0);
+    rb_define_method( rb_cPacked, "fields", rb_packed_fields, -1);
+    rb_define_alias(  rb_cPacked, "fetch_values", "fields");
+    rb_define_method( rb_cPacked, "==", rb_packed_equal, 1);
+    rb_define_method( rb_cPacked, "inspect", rb_packed_inspect, 0);
+    rb_define_alias(  rb_cPacked, "to_s", "inspect");
+
+    rb_cPackedArray = rb_define_class_under( rb_cPacked, "Array", rb_cObject);
+    rb_define_alloc_func( rb_cPackedArray, rb_packary_s_alloc);
+    rb_define_method( rb_cPackedArray, "initialize", rb_packary_init, -1);
+    rb_define_method( rb_cPackedArray, "initialize_copy", rb_packary_init_copy, 1);
+    rb_define_method( rb_cPackedArray, "record_class", rb_packary_record_class, 0);
+    rb_define_method( rb_cPackedArray, "length", rb_packary_length, 0);
+    rb_define_alias(  rb_cPackedArray, "size", "length");
+    rb_define_method( rb_cPackedArray, "bytesize", rb_packary_bytesize, 0);
+    rb_define_method( rb_cPackedArray, "[]", rb_packary_aref, -1);
+    rb_define_method( rb_cPackedArray, "[]=", rb_packary_aset, -1);
+    rb_define_method( rb_cPackedArray, "push", rb_packary_push, 1);
+    rb_define_alias(  rb_cPackedArray, "<<", "push");
+    rb_define_method( rb_cPackedArray, "each", rb_packary_each, 0);
+    rb_define_method( rb_cPackedArray, "to_a", rb_packary_to_a, 0);
+    rb_include_module( rb_cPackedArray, rb_mEnumerable);
+}
+
@@ -0,0 +1,46 @@
+/*
+ *  supplement/packed.h  --  Structs with native typed fields
+ */
+
+#ifndef __SUPPLEMENT_PACKED_H__
+#define __SUPPLEMENT_PACKED_H__
+
+#include <ruby/ruby.h>
+
+
+extern VALUE rb_struct_s_packed( int, VALUE *, VALUE);
+
+extern VALUE rb_packed_s_alloc( VALUE);
+extern VALUE rb_packed_s_members( VALUE);
+extern VALUE rb_packed_s_types( VALUE);
+extern VALUE rb_packed_s_bytesize( VALUE);
+extern VALUE rb_packed_init( int, VALUE *, VALUE);
+extern VALUE rb_packed_init_copy( VALUE, VALUE);
+extern VALUE rb_packed_aref( VALUE, VALUE);
+extern VALUE rb_packed_aset( VALUE, VALUE, VALUE);
+extern VALUE rb_packed_get( VALUE);
+extern VALUE rb_packed_set( VALUE, VALUE);
+extern VALUE rb_packed_members( VALUE);
+extern VALUE rb_packed_to_a( VALUE);
+extern VALUE rb_packed_to_h( VALUE);
+extern VALUE rb_packed_each( VALUE);
+extern VALUE rb_packed_fields( int, VALUE *, VALUE);
+extern VALUE rb_packed_equal( VALUE, VALUE);
+extern VALUE rb_packed_inspect( VALUE);
+
+extern VALUE rb_packary_s_alloc( VALUE);
+extern VALUE rb_packary_init( int, VALUE *, VALUE);
+extern VALUE rb_packary_init_copy( VALUE, VALUE);
+extern VALUE rb_packary_record_class( VALUE);
+extern VALUE rb_packary_length( VALUE);
+extern VALUE rb_packary_bytesize( VALUE);
+extern VALUE rb_packary_aref( int, VALUE *, VALUE);
+extern VALUE rb_packary_aset( int, VALUE *, VALUE);
+extern VALUE rb_packary_push( VALUE, VALUE);
+extern VALUE rb_packary_each( VALUE);
+extern VALUE rb_packary_to_a( VALUE);
+
+extern void Init_packed( void);
+
+#endif
+
@@ -0,0 +1,135 @@
+/*
+ *  supplement/packtype.c  --  Native field types
+ */
+
+#include "packtype.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+static const struct {
+    const char *name;
+    size_t      size;
+} ptypes[ PTYPE_COUNT] = {
+    { "int8",   sizeof (int8_t)   },
+    { "uint8",  sizeof (uint8_t)  },
+    { "int16",  sizeof (int16_t)  },
+    { "uint16", sizeof (uint16_t) },
+    { "int32",  sizeof (int32_t)  },
+    { "uint32", sizeof (uint32_t) },
+    { "int64",  sizeof (int64_t)  },
+    { "uint64", sizeof (uint64_t) },
+    { "float",  sizeof (float)    },
+    { "double", sizeof (double)   },
+    { "value",  sizeof (VALUE)    },
+};
+
+
+/*
+ *  Look up a type given as a Symbol or a String like <code>:int64</code>.
+ */
+
+int
+supplement_ptype( VALUE name)
+{
+    const char *n;
+    int i;
+
+    if (SYMBOL_P( name))
+        name = rb_sym2str( name);
+    n = StringValueCStr( name);
+    for (i = 0; i < PTYPE_COUNT; i++)
+        if (strcmp( n, ptypes[ i].name) == 0)
+            return i;
+    rb_raise( rb_eArgError, "unknown native type: %s", n);
+    return -1;
+}
+
+VALUE
+supplement_ptype_name( int t)
+{
+    return ID2SYM( rb_intern( ptypes[ t].name));
+}
+
+size_t
+supplement_ptype_size( int t)
+{
+    return ptypes[ t].size;
+}
+
+
+/*
+ *  Loads and stores go through memcpy() because the address need not
+ *  be aligned (mapped files).
+ */
+
+VALUE
+supplement_ptype_load( int t, const void *p)
+{
+    union {
+        int8_t   i8;  uint8_t  u8;
+        int16_t  i16; uint16_t u16;
+        int32_t  i32; uint32_t u32;
+        int64_t  i64; uint64_t u64;
+        float    f;   double   d;
+        VALUE    v;
+    } u;
+
+    memcpy( &u, p, ptypes[ t].size);
+    switch (t) {
+    case PTYPE_INT8:   return INT2FIX( u.i8);
+    case PTYPE_UINT8:  return INT2FIX( u.u8);
+    case PTYPE_INT16:  return INT2FIX( u.i16);
+    case PTYPE_UINT16: return INT2FIX( u.u16);
+    case PTYPE_INT32:  return INT2NUM( u.i32);
+    case PTYPE_UINT32: return UINT2NUM( u.u32);
+    case PTYPE_INT64:  return LL2NUM( u.i64);
+    case PTYPE_UINT64: return ULL2NUM( u.u64);
+    case PTYPE_FLOAT:  return rb_float_new( u.f);
+    case PTYPE_DOUBLE: return rb_float_new( u.d);
+    default:           return u.v;
+    }
+}
+
+void
+supplement_ptype_store( int t, void *p, VALUE val)
+{
+    union {
+        int8_t   i8;  uint8_t  u8;
+        int16_t  i16; uint16_t u16;
+        int32_t  i32; uint32_t u32;
+        int64_t  i64; uint64_t u64;
+        float    f;   double   d;
+        VALUE    v;
+    } u;
+    long l;
+
+    switch (t) {
+    case PTYPE_INT8:
+    case PTYPE_INT16:
+        l = NUM2LONG( val);
+        if (t == PTYPE_INT8 ? l != (int8_t) l : l != (int16_t) l)
+            rb_raise( rb_eRangeError, "integer %ld too big for %s",
+                                                    l, ptypes[ t].name);
+        if (t == PTYPE_INT8) u.i8 = l; else u.i16 = l;
+        break;
+    case PTYPE_UINT8:
+    case PTYPE_UINT16:
+        l = NUM2LONG( val);
+        if (t == PTYPE_UINT8 ? l != (uint8_t) l : l != (uint16_t) l)
+            rb_raise( rb_eRangeError, "integer %ld too big for %s",
+                                                    l, ptypes[ t].name);
+        if (t == PTYPE_UINT8) u.u8 = l; else u.u16 = l;
+        break;
+    case PTYPE_INT32:  u.i32 = NUM2INT( val);  break;
+    case PTYPE_UINT32: u.u32 = NUM2UINT( val); break;
+    case PTYPE_INT64:  u.i64 = NUM2LL( val);   break;
+    case PTYPE_UINT64: u.u64 = NUM2ULL( val);  break;
+    case PTYPE_FLOAT:  u.f   = NUM2DBL( val);  break;
+    case PTYPE_DOUBLE: u.d   = NUM2DBL( val);  break;
+    default:           u.v   = val;            break;
+    }
+    memcpy( p, &u, ptypes[ t].size);
+}
+
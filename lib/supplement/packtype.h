@@ -0,0 +1,34 @@
+/*
+ *  supplement/packtype.h  --  Native field types
+ */
+
+#ifndef __SUPPLEMENT_PACKTYPE_H__
+#define __SUPPLEMENT_PACKTYPE_H__
+
+#include <ruby/ruby.h>
+
+
+enum supplement_ptype {
+    PTYPE_INT8,
+    PTYPE_UINT8,
+    PTYPE_INT16,
+    PTYPE_UINT16,
+    PTYPE_INT32,
+    PTYPE_UINT32,
+    PTYPE_INT64,
+    PTYPE_UINT64,
+    PTYPE_FLOAT,
+    PTYPE_DOUBLE,
+    PTYPE_VALUE,
+    PTYPE_COUNT
+};
+
+extern int    supplement_ptype( VALUE);
+extern VALUE  supplement_ptype_name( int);
+extern size_t supplement_ptype_size( int);
+
+extern VALUE  supplement_ptype_load(  int, const void *);
+extern void   supplement_ptype_store( int, void *, VALUE);
+
+#endif
+
@@ -0,0 +1,201 @@
+/*
+ *  supplement/pool.c  --  Worker threads
+ */
+
+#include "pool.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+static void *pool_worker( void *);
+
+
+/*
+ *  A pool of native threads working on a queue of jobs.  Jobs may push
+ *  further jobs.  The pool is finished when the queue is empty and all
+ *  threads are idle.  No function here calls Ruby; everything but
+ *  supplement_pool_threads() may be used without the GVL.
+ *
+ *  Job structures start with a struct supplement_pool_job.  The work
+ *  function owns the job it is given; jobs still queued when the pool
+ *  is stopped are passed to the drop function, or to free() if there
+ *  is none.
+ *
+ *  If a done function is set, it is called by the last thread that runs
+ *  out of work, with the mutex held.
+ */
+
+void
+supplement_pool_init( struct supplement_pool *pool, supplement_pool_fn *work,
+                      supplement_pool_fn *drop, void *arg)
+{
+    pthread_mutex_init( &pool->mutex, NULL);
+    pthread_cond_init( &pool->cond, NULL);
+    pool->head = pool->tail = NULL;
+    pool->work = work;
+    pool->drop = drop;
+    pool->done = NULL;
+    pool->arg = arg;
+    pool->threads = NULL;
+    pool->nthreads = 0;
+    pool->idle = 0;
+    pool->finished = 0;
+    pool->stop = 0;
+}
+
+void
+supplement_pool_push( struct supplement_pool *pool,
+                      struct supplement_pool_job *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock( &pool->mutex);
+    if (pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal( &pool->cond);
+    pthread_mutex_unlock( &pool->mutex);
+}
+
+/*
+ *  Start +n+ threads.  Signals are blocked in them so that they are
+ *  always delivered to Ruby's threads.  If no thread can be created,
+ *  supplement_pool_wait() will do the work itself.
+ */
+
+void
+supplement_pool_start( struct supplement_pool *pool, int n)
+{
+    sigset_t all, old;
+    int i;
+
+    if (n < 1)
+        n = 1;
+    pool->threads = malloc( n * sizeof (pthread_t));
+    if (pool->threads == NULL)
+        return;
+    sigfillset( &all);
+    pthread_sigmask( SIG_SETMASK, &all, &old);
+    pthread_mutex_lock( &pool->mutex);
+    for (i = 0; i < n; i++)
+        if (pthread_create( pool->threads + i, NULL, &pool_worker, pool) != 0)
+            break;
+    pool->nthreads = i;
+    pthread_mutex_unlock( &pool->mutex);
+    pthread_sigmask( SIG_SETMASK, &old, NULL);
+}
+
+void *
+pool_worker( void *p)
+{
+    struct supplement_pool *pool = p;
+    struct supplement_pool_job *j;
+
+    pthread_mutex_lock( &pool->mutex);
+    while (!pool->stop && !pool->finished) {
+        j = pool->head;
+        if (j == NULL) {
+            if (++pool->idle == pool->nthreads) {
+                pool->finished = 1;
+                pthread_cond_broadcast( &pool->cond);
+                if (pool->done != NULL)
+                    (*pool->done)( pool);
+                break;
+            }
+            pthread_cond_wait( &pool->cond, &pool->mutex);
+            pool->idle--;
+            continue;
+        }
+        pool->head = j->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock( &pool->mutex);
+        (*pool->work)( pool, j);
+        pthread_mutex_lock( &pool->mutex);
+    }
+    pthread_mutex_unlock( &pool->mutex);
+    return NULL;
+}
+
+/*
+ *  Wait until all jobs are done or the pool was stopped.
+ */
+
+void
+supplement_pool_wait( struct supplement_pool *pool)
+{
+    struct supplement_pool_job *j;
+    int i;
+
+    if (pool->nthreads == 0) {
+        pool->nthreads = 1;
+        pool_worker( pool);
+    }
+    for (i = 0; pool->threads != NULL && i < pool->nthreads; i++)
+        pthread_join( pool->threads[ i], NULL);
+    free( pool->threads);
+    pool->threads = NULL;
+    while ((j = pool->head) != NULL) {
+        pool->head = j->next;
+        if (pool->drop != NULL)
+            (*pool->drop)( pool, j);
+        else
+            free( j);
+    }
+    pool->tail = NULL;
+}
+
+/*
+ *  Make the threads return after their current job.  This may be called
+ *  as an unblocking function.
+ */
+
+void
+supplement_pool_stop( struct supplement_pool *pool)
+{
+    pthread_mutex_lock( &pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast( &pool->cond);
+    pthread_mutex_unlock( &pool->mutex);
+}
+
+void
+supplement_pool_run( struct supplement_pool *pool, int n)
+{
+    supplement_pool_start( pool, n);
+    supplement_pool_wait( pool);
+}
+
+void
+supplement_pool_destroy( struct supplement_pool *pool)
+{
+    pthread_cond_destroy( &pool->cond);
+    pthread_mutex_destroy( &pool->mutex);
+}
+
+
+/*
+ *  Number of threads from a <code>threads:</code> argument.  +nil+ means
+ *  one, +true+ means as many as there are processors.
+ */
+
+int
+supplement_pool_threads( VALUE n)
+{
+    long r;
+
+    if (NIL_P( n) || n == Qfalse)
+        return 1;
+    if (n == Qtrue) {
+        r = sysconf( _SC_NPROCESSORS_ONLN);
+        return r > 0 ? (int) r : 1;
+    }
+    r = NUM2INT( n);
+    if (r < 1)
+        rb_raise( rb_eArgError, "number of threads must be positive");
+    return r;
+}
+
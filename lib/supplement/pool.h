@@ -0,0 +1,51 @@
+/*
+ *  supplement/pool.h  --  Worker threads
+ */
+
+#ifndef __SUPPLEMENT_POOL_H__
+#define __SUPPLEMENT_POOL_H__
+
+#include <ruby/ruby.h>
+
+#include <pthread.h>
+
+
+struct supplement_pool_job {
+    struct supplement_pool_job *next;
+};
+
+struct supplement_pool;
+
+typedef void supplement_pool_fn( struct supplement_pool *,
+                                 struct supplement_pool_job *);
+
+struct supplement_pool {
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;
+    struct supplement_pool_job *head, *tail;
+    supplement_pool_fn         *work;
+    supplement_pool_fn         *drop;
+    void                      (*done)( struct supplement_pool *);
+    void                       *arg;
+    pthread_t                  *threads;
+    int                         nthreads;
+    int                         idle;
+    int                         finished;
+    volatile int                stop;
+};
+
+extern void supplement_pool_init( struct supplement_pool *,
+                                  supplement_pool_fn *, supplement_pool_fn *,
+                                  void *);
+extern void supplement_pool_push( struct supplement_pool *,
+                                  struct supplement_pool_job *);
+extern void supplement_pool_start( struct supplement_pool *, int);
+extern void supplement_pool_wait( struct supplement_pool *);
+extern void supplement_pool_stop( struct supplement_pool *);
+extern void supplement_pool_run( struct supplement_pool *, int);
+extern void supplement_pool_destroy( struct supplement_pool *);
+
+extern int  supplement_pool_threads( VALUE);
+
+#endif
+